@@ -0,0 +1,103 @@
+/**-----------------------------------------------------------------------------
+
+ @file    counter.c
+ @brief   Implementation of per-CPU counter related functions
+ @details
+ @verbatim
+
+  The update is a relaxed atomic add, so it is safe against interrupts and
+  against a task which migrates between reading its CPU id and the add. As
+  the line is almost always owned by the local CPU, it stays cheap.
+
+ @endverbatim
+
+ **-----------------------------------------------------------------------------
+ */
+#include <base/counter.h>
+#include <base/klog.h>
+#include <base/lock.h>
+#include <sys/smp.h>
+
+static struct {
+    [[gnu::aligned(64)]] int64_t slots[COUNTER_MAX];
+} counter_rows[CPU_MAX] = {0};
+
+static counter_t *counter_registry[COUNTER_MAX] = {0};
+static uint32_t counter_num = 1;
+static lock_t counter_lock = {0};
+
+/* Returns the slot of the counter, 0 if the registry is full */
+static uint32_t counter_register(counter_t *c)
+{
+    lock_lock(&counter_lock);
+    if (c->id == 0 && counter_num < COUNTER_MAX) {
+        counter_registry[counter_num] = c;
+        __atomic_store_n(&c->id, counter_num, __ATOMIC_RELEASE);
+        counter_num++;
+    } else if (c->id == 0) {
+        klogw("COUNTER: registry is full, drop \"%s\"\n", c->name);
+    }
+    lock_release(&counter_lock);
+    return c->id;
+}
+
+void counter_add(counter_t *c, int64_t val)
+{
+    uint32_t id = __atomic_load_n(&c->id, __ATOMIC_ACQUIRE);
+    if (id == 0) {
+        id = counter_register(c);
+        if (id == 0) return;
+    }
+
+    uint16_t cpu_id = smp_get_cpu_id();
+    __atomic_add_fetch(&counter_rows[cpu_id].slots[id], val, __ATOMIC_RELAXED);
+}
+
+int64_t counter_read(counter_t *c)
+{
+    uint32_t id = __atomic_load_n(&c->id, __ATOMIC_ACQUIRE);
+    int64_t sum = 0;
+
+    if (id == 0) return 0;
+    for (size_t i = 0; i < CPU_MAX; i++)
+        sum += __atomic_load_n(&counter_rows[i].slots[id], __ATOMIC_RELAXED);
+    return sum;
+}
+
+int64_t counter_read_cpu(counter_t *c, uint16_t cpu_id)
+{
+    uint32_t id = __atomic_load_n(&c->id, __ATOMIC_ACQUIRE);
+
+    if (id == 0 || cpu_id >= CPU_MAX) return 0;
+    return __atomic_load_n(&counter_rows[cpu_id].slots[id], __ATOMIC_RELAXED);
+}
+
+/* Only exact if nobody updates the counter at the same time */
+void counter_reset(counter_t *c)
+{
+    uint32_t id = __atomic_load_n(&c->id, __ATOMIC_ACQUIRE);
+
+    if (id == 0) return;
+    for (size_t i = 0; i < CPU_MAX; i++)
+        __atomic_store_n(&counter_rows[i].slots[id], 0, __ATOMIC_RELAXED);
+}
+
+void counter_dump(void)
+{
+    const smp_info_t *smp = smp_get_info();
+    uint16_t ncpu = (smp != NULL && smp->num_cpus > 0) ? smp->num_cpus : 1;
+
+    lock_lock(&counter_lock);
+    uint32_t num = counter_num;
+    lock_release(&counter_lock);
+
+    kprintf("%d counters on %d CPUs:\n", num - 1, ncpu);
+    for (uint32_t id = 1; id < num; id++) {
+        counter_t *c = counter_registry[id];
+        kprintf("  %24s %12d  [", c->name, counter_read(c));
+        for (uint16_t i = 0; i < ncpu && i < 8; i++) {
+            kprintf(i == 0 ? "%d" : " %d", counter_rows[i].slots[id]);
+        }
+        kprintf(ncpu > 8 ? " ...]\n" : "]\n");
+    }
+}
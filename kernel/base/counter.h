@@ -0,0 +1,45 @@
+/**-----------------------------------------------------------------------------
+
+ @file    counter.h
+ @brief   Definition of per-CPU counter related data structures and functions
+ @details
+ @verbatim
+
+  A counter is a named 64-bit statistic which is updated often and read
+  rarely, e.g., free physical memory or context switches. Each CPU adds to
+  its own slot, so updates never bounce a shared cache line between CPUs.
+  Reading sums the slots of all CPUs.
+
+  Slots live in one table with a row per CPU, so the counters of a CPU are
+  packed together and rows never share a cache line. A counter is put into
+  the registry the first time it is updated, and every registered counter
+  is printed by counter_dump().
+
+      static counter_t foo_count = counter_new("foo.count");
+      counter_inc(&foo_count);
+
+ @endverbatim
+
+ **-----------------------------------------------------------------------------
+ */
+#pragma once
+
+#include <stdint.h>
+
+/* Max number of counters, slot 0 is never used */
+#define COUNTER_MAX         64
+
+typedef struct {
+    const char *name;
+    volatile uint32_t id;       /* Slot in the per-CPU rows, 0 if new */
+} counter_t;
+
+#define counter_new(n)      (counter_t){.name = (n), .id = 0}
+#define counter_inc(c)      counter_add(c, 1)
+#define counter_dec(c)      counter_add(c, -1)
+
+void counter_add(counter_t *c, int64_t val);
+int64_t counter_read(counter_t *c);
+int64_t counter_read_cpu(counter_t *c, uint16_t cpu_id);
+void counter_reset(counter_t *c);
+void counter_dump(void);
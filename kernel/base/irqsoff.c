@@ -0,0 +1,112 @@
+/**-----------------------------------------------------------------------------
+
+ @file    irqsoff.c
+ @brief   Implementation of interrupts-off latency tracer
+ @details
+ @verbatim
+
+  The hooks run with interrupts disabled, so the slot of the current CPU is
+  only touched by this CPU and needs no lock. Reports may read a slot which
+  is being updated, which only makes one line of the report a bit stale.
+
+ @endverbatim
+
+ **-----------------------------------------------------------------------------
+ */
+#include <base/irqsoff.h>
+
+#ifdef ENABLE_IRQSOFF_TRACE
+
+#include <base/klog.h>
+#include <sys/cpu.h>
+#include <sys/hpet.h>
+#include <sys/smp.h>
+
+#define CPU_FLAG_IF         (1 << 9)
+
+static irqsoff_cpu_t irqsoff_cpus[CPU_MAX] = {0};
+static uint64_t irqsoff_tsc_khz = 0;
+
+static irqsoff_cpu_t *irqsoff_this_cpu(void)
+{
+    return &irqsoff_cpus[smp_get_cpu_id()];
+}
+
+/* Called with interrupts disabled, rflags is the value before that */
+void irqsoff_begin(uint64_t rflags, const char *fn, int ln)
+{
+    if (!(rflags & CPU_FLAG_IF))
+        return;
+
+    irqsoff_cpu_t *c = irqsoff_this_cpu();
+    c->fn = fn;
+    c->ln = ln;
+    c->start = read_tsc();
+}
+
+/* Called right before rflags is restored */
+void irqsoff_end(uint64_t rflags)
+{
+    if (!(rflags & CPU_FLAG_IF))
+        return;
+
+    irqsoff_cpu_t *c = irqsoff_this_cpu();
+    if (c->start == 0)
+        return;
+
+    uint64_t cycles = read_tsc() - c->start;
+    c->start = 0;
+    c->windows++;
+    c->total += cycles;
+    if (cycles > c->max) {
+        c->max = cycles;
+        c->max_fn = c->fn;
+        c->max_ln = c->ln;
+    }
+}
+
+/* Measure TSC frequency against HPET once, only for the report */
+static uint64_t irqsoff_get_tsc_khz(void)
+{
+    if (irqsoff_tsc_khz == 0) {
+        uint64_t ns = hpet_get_nanos();
+        uint64_t tsc = read_tsc();
+        while (hpet_get_nanos() - ns < 1000000)
+            asm volatile("pause");
+        uint64_t khz = (read_tsc() - tsc) * 1000000 / (hpet_get_nanos() - ns);
+        irqsoff_tsc_khz = (khz > 0) ? khz : 1;
+    }
+    return irqsoff_tsc_khz;
+}
+
+void irqsoff_report(void)
+{
+    uint64_t khz = irqsoff_get_tsc_khz();
+
+    kprintf("irqsoff: longest interrupts-off window per CPU (TSC %d kHz):\n",
+            khz);
+    kprintf("  CPU  Windows    Avg cycles    Max cycles  Max us Site\n");
+    for (size_t i = 0; i < CPU_MAX; i++) {
+        irqsoff_cpu_t c = irqsoff_cpus[i];
+        if (c.windows == 0)
+            continue;
+        kprintf("  %3d %8d %13d %13d %7d %s:%d\n",
+                i, c.windows, c.total / c.windows, c.max,
+                c.max * 1000 / khz, c.max_fn ? c.max_fn : "?", c.max_ln);
+    }
+}
+
+/* Clear the counters, an open window of any CPU is still closed normally */
+void irqsoff_reset(void)
+{
+    for (size_t i = 0; i < CPU_MAX; i++) {
+        irqsoff_cpu_t *c = &irqsoff_cpus[i];
+        c->windows = 0;
+        c->total = 0;
+        c->max = 0;
+        c->max_fn = NULL;
+        c->max_ln = 0;
+    }
+}
+
+#endif
@@ -0,0 +1,53 @@
+/**-----------------------------------------------------------------------------
+
+ @file    irqsoff.h
+ @brief   Definition of interrupts-off latency tracer
+ @details
+ @verbatim
+
+  Locks disable interrupts for the whole hold time, so a long critical
+  section delays timer and keyboard interrupts on its CPU. With
+  ENABLE_IRQSOFF_TRACE in kconfig.h, every lock acquisition which turns
+  interrupts off starts a window and the release which turns them on again
+  ends it. Nested locks are charged to the outermost one.
+
+  Each CPU keeps the number of windows, their total TSC cycles and the
+  longest window with the call site which started it. Interrupt handlers,
+  which run with interrupts disabled by the CPU, are not counted. Without
+  the option the hooks are empty.
+
+ @endverbatim
+
+ **-----------------------------------------------------------------------------
+ */
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include <kconfig.h>
+
+#ifdef ENABLE_IRQSOFF_TRACE
+
+typedef struct {
+    uint64_t start;         /* TSC when the window began, 0 if not in one */
+    const char *fn;
+    int ln;
+    uint64_t windows;
+    uint64_t total;         /* TSC cycles with interrupts off */
+    uint64_t max;
+    const char *max_fn;
+    int max_ln;
+} irqsoff_cpu_t;
+
+void irqsoff_begin(uint64_t rflags, const char *fn, int ln);
+void irqsoff_end(uint64_t rflags);
+void irqsoff_report(void);
+void irqsoff_reset(void);
+
+#else
+
+#define irqsoff_begin(rflags, fn, ln)   ((void)(rflags), (void)(fn), (void)(ln))
+#define irqsoff_end(rflags)             ((void)(rflags))
+
+#endif
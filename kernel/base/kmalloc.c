@@ -7,6 +7,23 @@
 
   Kernel memory allocation function includes malloc, free and realloc.
 
+  Every allocation is made of whole pages from PMM. The number of pages is
+  stored in a side table indexed by the page frame number of the first page,
+  a zero entry means the address is not the start of an allocation, so that
+  an invalid or double free is simply ignored.
+
+  Side tables are split into chunks of KMALLOC_CHUNK_PAGES frames. A chunk
+  is only allocated when PMM first hands out a page in it, so MMIO holes and
+  other ranges which are never allocated cost one directory entry each.
+
+  When tracking is enabled, a second side table records an interned call-site
+  ID, the requested size and the check number for each allocation, and the
+  per call-site profiling counters are updated.
+
+  kmrealloc() resizes a block in place whenever possible: it returns tail
+  pages to PMM when shrinking and takes the adjacent free pages when growing.
+  The block is only copied when the adjacent pages are in use.
+
  @endverbatim
  @todo    Memory allocation should be improved for better efficiency.
 
@@ -16,48 +33,324 @@
 
 #include <libc/string.h>
 
+#include <kconfig.h>
+
 #include <base/kmalloc.h>
 #include <base/klog.h>
+#include <base/klib.h>
+#include <base/lock.h>
+#include <base/counter.h>
 #include <sys/mm.h>
 #include <sys/panic.h>
 
 size_t kmalloc_checkno = 0;
 
+static lock_t kmalloc_lock = {0};
+
+#define KMALLOC_CHUNK_BITS      15
+#define KMALLOC_CHUNK_PAGES     (1ULL << KMALLOC_CHUNK_BITS)
+#define KMALLOC_CHUNK_MASK      (KMALLOC_CHUNK_PAGES - 1)
+
+static uint64_t kmalloc_npfn = 0;
+static uint64_t kmalloc_nchunk = 0;
+static uint32_t **kmalloc_pages = NULL;
+static kmalloc_track_t **kmalloc_tracks = NULL;
+static bool kmalloc_tracking = false;
+
+static counter_t kmalloc_realloc_inplace = counter_new("kmalloc.realloc_inplace");
+static counter_t kmalloc_realloc_copied = counter_new("kmalloc.realloc_copied");
+
+/* Call-site ID n is stored in kmalloc_sites[n - 1], 0 means unknown */
+static kmalloc_site_t kmalloc_sites[KMALLOC_SITE_MAX] = {0};
+
+static void *alloc_table(size_t len)
+{
+    void *table = (void*)PHYS_TO_VIRT(
+        pmm_get(NUM_PAGES(len), 0x0, __func__, __LINE__));
+    memset(table, 0, len);
+    return table;
+}
+
+/*
+ * Return the side table entry of a frame, must be called with kmalloc_lock
+ * held. A missing chunk is allocated if create is set, or NULL is returned.
+ */
+static uint32_t *page_entry(uint64_t pfn, bool create)
+{
+    uint32_t **chunk = &kmalloc_pages[pfn >> KMALLOC_CHUNK_BITS];
+
+    if (*chunk == NULL) {
+        if (!create) return NULL;
+        *chunk = (uint32_t*)alloc_table(KMALLOC_CHUNK_PAGES * sizeof(uint32_t));
+    }
+    return &(*chunk)[pfn & KMALLOC_CHUNK_MASK];
+}
+
+static kmalloc_track_t *track_entry(uint64_t pfn, bool create)
+{
+    if (kmalloc_tracks == NULL) return NULL;
+
+    kmalloc_track_t **chunk = &kmalloc_tracks[pfn >> KMALLOC_CHUNK_BITS];
+    if (*chunk == NULL) {
+        if (!create) return NULL;
+        *chunk = (kmalloc_track_t*)alloc_table(
+            KMALLOC_CHUNK_PAGES * sizeof(kmalloc_track_t));
+    }
+    return &(*chunk)[pfn & KMALLOC_CHUNK_MASK];
+}
+
+/* Number of pages of the allocation starting at a frame, 0 if none */
+static uint32_t page_count(uint64_t pfn)
+{
+    uint32_t *e = page_entry(pfn, false);
+    return (e == NULL) ? 0 : *e;
+}
+
+/* Return the ID of a call site, must be called with kmalloc_lock held */
+static uint16_t intern_site(const char *func, size_t line)
+{
+    size_t idx = (((uint64_t)func >> 3) ^ (line * 2654435761UL))
+                 & (KMALLOC_SITE_MAX - 1);
+
+    for (size_t n = 0; n < KMALLOC_SITE_MAX; n++) {
+        kmalloc_site_t *s = &kmalloc_sites[idx];
+        if (s->func == NULL) {
+            s->func = func;
+            s->line = line;
+            return idx + 1;
+        }
+        if (s->func == func && s->line == line)
+            return idx + 1;
+        idx = (idx + 1) & (KMALLOC_SITE_MAX - 1);
+    }
+
+    /* The table is full, this allocation is not tracked */
+    return 0;
+}
+
+static void prof_alloc(uint16_t site, size_t size)
+{
+    if (site == 0) return;
+
+    kmalloc_site_t *s = &kmalloc_sites[site - 1];
+    s->allocs++;
+    s->bytes += size;
+    s->live += size;
+    if (s->live > s->peak)
+        s->peak = s->live;
+}
+
+static void prof_free(uint16_t site, size_t size)
+{
+    if (site == 0) return;
+
+    kmalloc_site_t *s = &kmalloc_sites[site - 1];
+    s->frees++;
+    s->live -= MIN(s->live, size);
+}
+
+static uint64_t addr_to_pfn(void *addr)
+{
+    uint64_t phys = VIRT_TO_PHYS(addr);
+
+    if (phys % PAGE_SIZE != 0 || phys / PAGE_SIZE >= kmalloc_npfn)
+        return kmalloc_npfn;
+    return phys / PAGE_SIZE;
+}
+
+/* Record tracking information, must be called with kmalloc_lock held */
+static void track(uint64_t pfn, size_t size, const char *func, size_t line)
+{
+    if (kmalloc_tracking) {
+        kmalloc_track_t *t = track_entry(pfn, true);
+        *t = (kmalloc_track_t) {
+            .site = intern_site(func, line),
+            .checkno = kmalloc_checkno,
+            .size = size
+        };
+        prof_alloc(t->site, size);
+    } else {
+        kmalloc_track_t *t = track_entry(pfn, false);
+        if (t != NULL) *t = (kmalloc_track_t) {0};
+    }
+}
+
+void kmalloc_init(void)
+{
+    kmalloc_npfn = NUM_PAGES(pmm_get_phys_limit());
+    kmalloc_nchunk = DIV_ROUNDUP(kmalloc_npfn, KMALLOC_CHUNK_PAGES);
+    kmalloc_pages = (uint32_t**)alloc_table(kmalloc_nchunk * sizeof(uint32_t*));
+
+#ifdef ENABLE_MEM_DEBUG
+    kmalloc_set_tracking(true);
+#endif
+
+    klogi("kmalloc: page directory for %d frames in %d chunks at 0x%x\n",
+          kmalloc_npfn, kmalloc_nchunk, kmalloc_pages);
+}
+
+void kmalloc_set_tracking(bool enable)
+{
+    lock_lock(&kmalloc_lock);
+    if (enable && kmalloc_tracks == NULL) {
+        kmalloc_tracks = (kmalloc_track_t**)alloc_table(
+            kmalloc_nchunk * sizeof(kmalloc_track_t*));
+    }
+    kmalloc_tracking = enable;
+    lock_release(&kmalloc_lock);
+}
+
+void kmalloc_dump_leaks(void)
+{
+    lock_lock(&kmalloc_lock);
+
+    kprintf("Checking #%d\n", kmalloc_checkno);
+    if (kmalloc_tracks != NULL && kmalloc_checkno > 0) {
+        for (uint64_t pfn = 0; pfn < kmalloc_npfn; pfn++) {
+            /* Skip chunks which were never tracked */
+            if (kmalloc_tracks[pfn >> KMALLOC_CHUNK_BITS] == NULL) {
+                pfn |= KMALLOC_CHUNK_MASK;
+                continue;
+            }
+            kmalloc_track_t *t = track_entry(pfn, false);
+            if (page_count(pfn) == 0 || t->site == 0)
+                continue;
+            if (t->checkno != (uint16_t)kmalloc_checkno)
+                continue;
+            kmalloc_site_t *s = &kmalloc_sites[t->site - 1];
+            kprintf("0x%x %s():%d %d bytes\n", PHYS_TO_VIRT(pfn * PAGE_SIZE),
+                    s->func, s->line, t->size);
+        }
+    }
+    kmalloc_checkno++;
+    kprintf("Update checking point to #%d for kmalloc()\n", kmalloc_checkno);
+
+    lock_release(&kmalloc_lock);
+}
+
+/* Print the top allocators sorted by total requested bytes */
+void kmalloc_prof_report(size_t num)
+{
+    kmalloc_site_t top[KMALLOC_PROF_TOP_MAX];
+    uint16_t picked[KMALLOC_PROF_TOP_MAX];
+    size_t n = 0;
+
+    num = MIN(MAX(num, 1), KMALLOC_PROF_TOP_MAX);
+
+    lock_lock(&kmalloc_lock);
+    bool tracking = kmalloc_tracking;
+    uint64_t inplace = counter_read(&kmalloc_realloc_inplace);
+    uint64_t copied = counter_read(&kmalloc_realloc_copied);
+    for (n = 0; n < num; n++) {
+        size_t best = KMALLOC_SITE_MAX;
+        for (size_t i = 0; i < KMALLOC_SITE_MAX; i++) {
+            kmalloc_site_t *s = &kmalloc_sites[i];
+            if (s->func == NULL || s->allocs == 0)
+                continue;
+            bool seen = false;
+            for (size_t k = 0; k < n; k++) {
+                if (picked[k] == i) seen = true;
+            }
+            if (seen)
+                continue;
+            if (best == KMALLOC_SITE_MAX || s->bytes > kmalloc_sites[best].bytes)
+                best = i;
+        }
+        if (best == KMALLOC_SITE_MAX)
+            break;
+        picked[n] = best;
+        top[n] = kmalloc_sites[best];
+    }
+    lock_release(&kmalloc_lock);
+
+    kprintf("kmrealloc: %d in place, %d copied\n", inplace, copied);
+    kprintf("kmalloc profile (tracking %s), top %d call sites by bytes:\n",
+            tracking ? "on" : "off", n);
+    kprintf("    Allocs    Frees        Bytes         Live         Peak Site\n");
+    for (size_t i = 0; i < n; i++) {
+        kprintf("  %8d %8d %12d %12d %12d %s():%d\n",
+                top[i].allocs, top[i].frees, top[i].bytes,
+                top[i].live, top[i].peak, top[i].func, top[i].line);
+    }
+}
+
+/* Clear the counters, the live bytes are kept as they are still allocated */
+void kmalloc_prof_reset(void)
+{
+    lock_lock(&kmalloc_lock);
+    for (size_t i = 0; i < KMALLOC_SITE_MAX; i++) {
+        kmalloc_site_t *s = &kmalloc_sites[i];
+        s->allocs = 0;
+        s->frees = 0;
+        s->bytes = 0;
+        s->peak = s->live;
+    }
+    counter_reset(&kmalloc_realloc_inplace);
+    counter_reset(&kmalloc_realloc_copied);
+    lock_release(&kmalloc_lock);
+}
+
 void *kmalloc_core(uint64_t size, const char *func, size_t line)
 {
-    memory_metadata_t *alloc = (memory_metadata_t*)
-        PHYS_TO_VIRT(pmm_get(NUM_PAGES(size) + 1, 0x0, func, line));
+    uint64_t np = MAX(NUM_PAGES(size), 1);
+
+    lock_lock(&kmalloc_lock);
 
-    if (alloc == NULL) {
+    uint64_t phys = pmm_get(np, 0x0, func, line);
+    if (phys == 0) {
         kpanic("Out of memory when allocating %d bytes in %s:%d\n",
                size, func, line);
     }
 
-    alloc->magic = MEM_MAGIC_NUM;
-    alloc->checkno = kmalloc_checkno;
-    alloc->numpages = NUM_PAGES(size);
-    alloc->size = size;
+    uint64_t pfn = phys / PAGE_SIZE;
+    *page_entry(pfn, true) = np;
+    track(pfn, size, func, line);
 
-    char *fn_tail = strncpy(alloc->filename, func, sizeof(alloc->filename) - 1);
-    *fn_tail = '\0';
+    lock_release(&kmalloc_lock);
 
-    alloc->lineno = line;
-
-    return ((uint8_t*)alloc) + PAGE_SIZE;
+    return (void*)PHYS_TO_VIRT(phys);
 }
 
 void kmfree_core(void *addr, const char *func, size_t line)
 {
-    (void)func;
+    lock_lock(&kmalloc_lock);
+
+    /* Only free when addr is the start of an allocation */
+    uint64_t pfn = addr_to_pfn(addr);
+    uint32_t *e = (pfn < kmalloc_npfn) ? page_entry(pfn, false) : NULL;
+    if (e != NULL && *e != 0) {
+        pmm_free(pfn * PAGE_SIZE, *e, func, line);
+        *e = 0;
+        kmalloc_track_t *t = track_entry(pfn, false);
+        if (t != NULL) {
+            prof_free(t->site, t->size);
+            *t = (kmalloc_track_t) {0};
+        }
+    }
 
-    memory_metadata_t *d =
-        (memory_metadata_t*)((uint8_t*)addr - PAGE_SIZE);
+    lock_release(&kmalloc_lock);
+}
 
-    /* Only free when magic number is correct */
-    if (d->magic == MEM_MAGIC_NUM) {
-        pmm_free(VIRT_TO_PHYS(d), d->numpages + 1, func, line);
-        d->magic = 0;
+/*
+ * Try to resize an allocation without moving it, must be called with
+ * kmalloc_lock held. Shrinking gives the tail pages back to PMM, growing
+ * takes the physically adjacent pages if they are all free.
+ */
+static bool resize_in_place(uint64_t pfn, uint64_t newnp)
+{
+    uint64_t np = page_count(pfn);
+
+    if (newnp < np) {
+        pmm_free((pfn + newnp) * PAGE_SIZE, np - newnp, __func__, __LINE__);
+    } else if (newnp > np) {
+        if (pfn + newnp > kmalloc_npfn)
+            return false;
+        if (!pmm_alloc((pfn + np) * PAGE_SIZE, newnp - np))
+            return false;
     }
+
+    *page_entry(pfn, false) = newnp;
+    return true;
 }
 
 void *kmrealloc_core(void *addr, size_t newsize, const char *func, size_t line)
@@ -65,30 +358,50 @@ void *kmrealloc_core(void *addr, size_t newsize, const char *func, size_t line)
     if (!addr)
         return kmalloc_core(newsize, func, line);
 
-    memory_metadata_t *d =
-        (memory_metadata_t*)((uint8_t*)addr - PAGE_SIZE);
-
-    if (NUM_PAGES(d->size) == NUM_PAGES(newsize)) {
-        d->size = newsize;
-        d->numpages = NUM_PAGES(newsize);
+    lock_lock(&kmalloc_lock);
 
-        d->magic = MEM_MAGIC_NUM;
-        /* Do not modify d->checkno */
+    uint64_t pfn = addr_to_pfn(addr);
+    if (pfn >= kmalloc_npfn || page_count(pfn) == 0) {
+        lock_release(&kmalloc_lock);
+        kloge("kmrealloc: invalid address 0x%x from %s():%d\n",
+              addr, func, line);
+        return NULL;
+    }
 
-        char *fn_tail = strncpy(d->filename, func, sizeof(d->filename) - 1); 
-        *fn_tail = '\0';
+    uint64_t np = page_count(pfn);
+    size_t oldsize = np * PAGE_SIZE;
+    kmalloc_track_t *t = track_entry(pfn, false);
+    if (t != NULL && t->site != 0)
+        oldsize = t->size;
 
-        d->lineno = line;
+    if (resize_in_place(pfn, MAX(NUM_PAGES(newsize), 1))) {
+        /*
+         * Same as the copying path, everything after the old size is zeroed,
+         * including the old tail page which may hold stale data.
+         */
+        if (newsize > oldsize)
+            memset((uint8_t*)addr + oldsize, 0, newsize - oldsize);
 
+        /* Do not modify checkno */
+        if (kmalloc_tracking) {
+            /* Account as a free followed by an allocation without copying */
+            t = track_entry(pfn, true);
+            prof_free(t->site, t->size);
+            t->site = intern_site(func, line);
+            t->size = newsize;
+            prof_alloc(t->site, newsize);
+        }
+        counter_inc(&kmalloc_realloc_inplace);
+        lock_release(&kmalloc_lock);
         return addr;
     }
 
+    counter_inc(&kmalloc_realloc_copied);
+    lock_release(&kmalloc_lock);
+
     void *new = kmalloc_core(newsize, func, line);
     memset(new, 0, newsize);
-    if (d->size > newsize)
-        memcpy(new, addr, newsize);
-    else
-        memcpy(new, addr, d->size);
+    memcpy(new, addr, MIN(oldsize, newsize));
 
     kmfree_core(addr, func, line);
     return new;
@@ -7,6 +7,14 @@
 
   e.g., malloc, free and realloc.
 
+  Allocation information is kept out of band in tables indexed by page frame
+  number. Only the page count of each allocation is always recorded, call
+  site tracking (interned call-site ID, size and check number) is enabled by
+  ENABLE_MEM_DEBUG or at runtime by kmalloc_set_tracking().
+
+  While tracking is enabled, allocation count, requested bytes, live bytes and
+  peak live bytes are also accumulated per call site for profiling.
+
  @endverbatim
 
  **-----------------------------------------------------------------------------
@@ -15,20 +23,38 @@
 
 #include <stddef.h>
 #include <stdint.h>
+#include <stdbool.h>
+
+#define KMALLOC_SITE_MAX        1024    /* Must be power of 2 */
+#define KMALLOC_PROF_TOP_MAX    32
 
-#define MEM_MAGIC_NUM       0xCDADDBEE
+typedef struct {
+    const char *func;
+    size_t     line;
+
+    /* Profiling counters */
+    uint64_t   allocs;
+    uint64_t   frees;
+    uint64_t   bytes;       /* Total requested bytes */
+    uint64_t   live;        /* Bytes currently allocated */
+    uint64_t   peak;        /* Peak of live bytes */
+} kmalloc_site_t;
 
+/* Tracking record for the first page of an allocation */
 typedef struct {
-    size_t magic;
-    size_t checkno;
-    size_t numpages;
-    size_t size;
-    char   filename[512];
-    size_t lineno;
-} memory_metadata_t;
+    uint16_t site;          /* 0 if the allocation is not tracked */
+    uint16_t checkno;
+    uint32_t size;
+} kmalloc_track_t;
 
 extern size_t kmalloc_checkno;
 
+void kmalloc_init(void);
+void kmalloc_set_tracking(bool enable);
+void kmalloc_dump_leaks(void);
+void kmalloc_prof_report(size_t num);
+void kmalloc_prof_reset(void);
+
 void* kmalloc_core(uint64_t size, const char *func, size_t line);
 void kmfree_core(void* addr, const char *func, size_t line);
 void* kmrealloc_core(void* addr, size_t newsize, const char *func, size_t line);
@@ -0,0 +1,159 @@
+/**-----------------------------------------------------------------------------
+
+ @file    kmem_cache.c
+ @brief   Implementation of named object cache functions
+ @details
+ @verbatim
+
+  Each object is followed by a small bufctl which links free objects together
+  and records the owning cache while the object is in use. Keeping the link
+  outside of the object is what allows constructed state to survive reuse.
+
+  Slabs are allocated by kmalloc() and are never given back, caches only grow
+  up to the peak number of objects in use.
+
+ @endverbatim
+
+ **-----------------------------------------------------------------------------
+ */
+#include <libc/string.h>
+
+#include <base/kmem_cache.h>
+#include <base/kmalloc.h>
+#include <base/klog.h>
+#include <base/klib.h>
+#include <sys/mm.h>
+
+typedef struct {
+    void         *next;     /* next free object, valid when free */
+    kmem_cache_t *owner;    /* owning cache when in use, NULL when free */
+} kmem_bufctl_t;
+
+#define OBJ_TO_BUFCTL(c, o) \
+    ((kmem_bufctl_t*)((uint8_t*)(o) + (c)->stride - sizeof(kmem_bufctl_t)))
+
+static kmem_cache_t *kmem_cache_list = NULL;
+static lock_t kmem_cache_list_lock = {0};
+
+static void kmem_cache_setup(kmem_cache_t *cache)
+{
+    cache->stride = ALIGNUP(cache->objsize, KMEM_CACHE_ALIGN)
+                    + ALIGNUP(sizeof(kmem_bufctl_t), KMEM_CACHE_ALIGN);
+    cache->slab_pages = NUM_PAGES(cache->stride * KMEM_CACHE_SLAB_MIN_OBJS);
+
+    lock_lock(&kmem_cache_list_lock);
+    if (!cache->registered) {
+        cache->next = kmem_cache_list;
+        kmem_cache_list = cache;
+        cache->registered = true;
+    }
+    lock_release(&kmem_cache_list_lock);
+}
+
+/* Carve a new slab into objects, must be called with cache lock held */
+static bool kmem_cache_grow(kmem_cache_t *cache)
+{
+    if (cache->stride == 0)
+        kmem_cache_setup(cache);
+
+    size_t slab_len = cache->slab_pages * PAGE_SIZE;
+    uint8_t *slab = (uint8_t*)kmalloc(slab_len);
+    if (slab == NULL)
+        return false;
+
+    size_t num = slab_len / cache->stride;
+    for (size_t i = num; i > 0; i--) {
+        void *obj = slab + (i - 1) * cache->stride;
+        kmem_bufctl_t *bc = OBJ_TO_BUFCTL(cache, obj);
+
+        if (cache->ctor != NULL)
+            cache->ctor(obj);
+
+        bc->owner = NULL;
+        bc->next = cache->freelist;
+        cache->freelist = obj;
+    }
+
+    cache->nr_slabs++;
+    cache->nr_total += num;
+
+    return true;
+}
+
+/* Create a cache at runtime, returns NULL if out of memory */
+kmem_cache_t *kmem_cache_create(const char *name, size_t size,
+                                kmem_ctor_t ctor)
+{
+    kmem_cache_t *cache = (kmem_cache_t*)kmalloc(sizeof(kmem_cache_t));
+    if (cache == NULL) {
+        kloge("Cache %s: out of memory\n", name);
+        return NULL;
+    }
+    memset(cache, 0, sizeof(kmem_cache_t));
+
+    cache->name = name;
+    cache->objsize = size;
+    cache->ctor = ctor;
+    kmem_cache_setup(cache);
+
+    return cache;
+}
+
+void *kmem_cache_alloc(kmem_cache_t *cache)
+{
+    lock_lock(&cache->lock);
+
+    if (cache->freelist == NULL && !kmem_cache_grow(cache)) {
+        lock_release(&cache->lock);
+        kloge("Cache %s: out of memory\n", cache->name);
+        return NULL;
+    }
+
+    void *obj = cache->freelist;
+    kmem_bufctl_t *bc = OBJ_TO_BUFCTL(cache, obj);
+    cache->freelist = bc->next;
+    bc->next = NULL;
+    bc->owner = cache;
+    cache->nr_inuse++;
+
+    lock_release(&cache->lock);
+    return obj;
+}
+
+void kmem_cache_free(kmem_cache_t *cache, void *obj)
+{
+    if (obj == NULL)
+        return;
+
+    lock_lock(&cache->lock);
+
+    kmem_bufctl_t *bc = OBJ_TO_BUFCTL(cache, obj);
+
+    /* Only free when the object is currently owned by this cache */
+    if (bc->owner != cache) {
+        lock_release(&cache->lock);
+        kloge("Cache %s: invalid free of 0x%x\n", cache->name, obj);
+        return;
+    }
+
+    bc->owner = NULL;
+    bc->next = cache->freelist;
+    cache->freelist = obj;
+    cache->nr_inuse--;
+
+    lock_release(&cache->lock);
+}
+
+void kmem_cache_dump(void)
+{
+    kprintf("Object caches:\n"
+            "  Name                         Size    InUse    Total  Slabs\n");
+
+    lock_lock(&kmem_cache_list_lock);
+    for (kmem_cache_t *c = kmem_cache_list; c != NULL; c = c->next) {
+        kprintf("  %24s %8d %8d %8d %6d\n", c->name, c->objsize,
+                c->nr_inuse, c->nr_total, c->nr_slabs);
+    }
+    lock_release(&kmem_cache_list_lock);
+}
+
@@ -0,0 +1,59 @@
+/**-----------------------------------------------------------------------------
+
+ @file    kmem_cache.h
+ @brief   Definition of named object cache related data structures and
+          functions
+ @details
+ @verbatim
+
+  An object cache hands out fixed size objects carved from slabs of pages, so
+  frequently allocated kernel structures (tnodes, inodes, node descriptors,
+  tasks, ...) do not go to the page allocator on every alloc/free.
+
+  The optional constructor is called once when an object is carved from a new
+  slab. Freed objects go back to the cache untouched, i.e. the constructed
+  state is preserved across reuse and the caller must return an object in its
+  constructed state.
+
+ @endverbatim
+
+ **-----------------------------------------------------------------------------
+ */
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#include <base/lock.h>
+
+#define KMEM_CACHE_ALIGN            16
+#define KMEM_CACHE_SLAB_MIN_OBJS    8
+
+typedef void (*kmem_ctor_t)(void *obj);
+
+typedef struct kmem_cache_s {
+    const char  *name;
+    size_t      objsize;
+    size_t      stride;         /* object + bufctl, aligned */
+    size_t      slab_pages;
+    kmem_ctor_t ctor;
+    void        *freelist;
+    size_t      nr_slabs;
+    size_t      nr_total;
+    size_t      nr_inuse;
+    bool        registered;
+    lock_t      lock;
+    struct kmem_cache_s *next;
+} kmem_cache_t;
+
+/* Static initializer, e.g. kmem_cache_new("task_t", sizeof(task_t), NULL) */
+#define kmem_cache_new(n, size, c)  { .name = (n), .objsize = (size), \
+                                      .ctor = (c) }
+
+kmem_cache_t *kmem_cache_create(const char *name, size_t size,
+                                kmem_ctor_t ctor);
+void *kmem_cache_alloc(kmem_cache_t *cache);
+void kmem_cache_free(kmem_cache_t *cache, void *obj);
+void kmem_cache_dump(void);
+
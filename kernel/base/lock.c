@@ -1,27 +1,276 @@
 #include <base/lock.h>
+#include <base/irqsoff.h>
+#include <base/klib.h>
 #include <base/klog.h>
+#include <sys/cpu.h>
+#include <sys/smp.h>
+#include <sys/panic.h>
+
+static mcs_node_t mcs_nodes[CPU_MAX][LOCK_MCS_NODES] = {0};
+
+/* Spinlocks held by each CPU, nothing may sleep while it holds one */
+static uint32_t lock_depth[CPU_MAX] = {0};
+
+static inline void lock_depth_add(int32_t n)
+{
+    /* Booting CPUs share slot 0 until their gs base is loaded */
+    __atomic_add_fetch(&lock_depth[smp_get_cpu_id()], (uint32_t)n,
+                       __ATOMIC_RELAXED);
+}
+
+/* rwlocks held for reading by each CPU, nested readers skip waiting writers */
+static uint32_t rwlock_read_depth[CPU_MAX] = {0};
+
+uint32_t lock_held_count(void)
+{
+    return __atomic_load_n(&lock_depth[smp_get_cpu_id()], __ATOMIC_RELAXED);
+}
+
+#ifdef ENABLE_LOCK_STAT
+static lock_stat_t lock_stats[LOCK_STAT_MAX] = {0};
+static volatile uint64_t lock_stat_dropped = 0;
+#endif
+
+/* Interrupts are disabled here, so the node can not be taken by others */
+static mcs_node_t *mcs_node_get(void)
+{
+    uint16_t cpu_id = smp_get_cpu_id();
+
+    for (size_t i = 0; i < LOCK_MCS_NODES; i++) {
+        mcs_node_t *node = &mcs_nodes[cpu_id][i];
+        if (!node->used) {
+            node->used = 1;
+            return node;
+        }
+    }
+    kpanic("LOCK: CPU %d nests more than %d MCS locks\n",
+           cpu_id, LOCK_MCS_NODES);
+    return NULL;
+}
+
+/* Returns true if the lock was held by others */
+static bool ticket_lock(lock_t *s)
+{
+    uint16_t ticket = __atomic_fetch_add(&s->next, 1, __ATOMIC_RELAXED);
+    bool contended = false;
+
+    while (true) {
+        uint16_t owner = __atomic_load_n(&s->owner, __ATOMIC_ACQUIRE);
+        if (owner == ticket) break;
+        contended = true;
+        /* Back off in proportion to the number of waiters ahead of us */
+        for (uint16_t i = (uint16_t)(ticket - owner); i > 0; i--)
+            asm volatile("pause");
+    }
+    return contended;
+}
+
+static void ticket_release(lock_t *s)
+{
+    __atomic_store_n(&s->owner, (uint16_t)(s->owner + 1), __ATOMIC_RELEASE);
+}
+
+static bool mcs_lock(lock_t *s)
+{
+    mcs_node_t *node = mcs_node_get();
+    node->next = NULL;
+    node->locked = 1;
+
+    mcs_node_t *prev = __atomic_exchange_n(&s->tail, node, __ATOMIC_ACQ_REL);
+    if (prev != NULL) {
+        __atomic_store_n(&prev->next, node, __ATOMIC_RELEASE);
+        while (__atomic_load_n(&node->locked, __ATOMIC_ACQUIRE))
+            asm volatile("pause");
+    }
+    s->holder = node;
+    return prev != NULL;
+}
+
+static void mcs_release(lock_t *s)
+{
+    mcs_node_t *node = s->holder;
+    mcs_node_t *next = __atomic_load_n(&node->next, __ATOMIC_ACQUIRE);
+
+    if (next == NULL) {
+        mcs_node_t *expected = node;
+        if (__atomic_compare_exchange_n(&s->tail, &expected, NULL, false,
+                                        __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+        {
+            node->used = 0;
+            return;
+        }
+        /* A new waiter is linking itself behind us */
+        while ((next = __atomic_load_n(&node->next, __ATOMIC_ACQUIRE)) == NULL)
+            asm volatile("pause");
+    }
+    __atomic_store_n(&next->locked, 0, __ATOMIC_RELEASE);
+    node->used = 0;
+}
+
+#ifdef ENABLE_LOCK_STAT
+/* Find or claim the entry of a lock, returns NULL if the table is full */
+static lock_stat_t *lock_stat_get(const volatile void *lock,
+                                  const char *fn, int ln)
+{
+    uint64_t h = ((uint64_t)lock >> 3) * 0x9E3779B97F4A7C15ULL;
+
+    for (size_t i = 0; i < LOCK_STAT_MAX; i++) {
+        lock_stat_t *st = &lock_stats[((h >> 32) + i) & (LOCK_STAT_MAX - 1)];
+        const volatile void *key = __atomic_load_n(&st->lock, __ATOMIC_ACQUIRE);
+
+        if (key == lock) return st;
+        if (key != NULL) continue;
+
+        if (__atomic_compare_exchange_n(&st->lock, &key, lock, false,
+                                        __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+        {
+            st->ln = ln;
+            __atomic_store_n(&st->fn, fn, __ATOMIC_RELEASE);
+            return st;
+        }
+        if (key == lock) return st;
+    }
+
+    __atomic_add_fetch(&lock_stat_dropped, 1, __ATOMIC_RELAXED);
+    return NULL;
+}
+
+static void lock_stat_max(uint64_t *max, uint64_t val)
+{
+    uint64_t old = __atomic_load_n(max, __ATOMIC_RELAXED);
+    while (val > old) {
+        if (__atomic_compare_exchange_n(max, &old, val, false,
+                                        __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+            break;
+    }
+}
+
+/* Called once the lock is taken, start is the TSC before trying it */
+static lock_stat_t *lock_stat_acquired(const volatile void *lock,
+                                       const char *fn, int ln,
+                                       bool contended, uint64_t start)
+{
+    lock_stat_t *st = lock_stat_get(lock, fn, ln);
+    if (st == NULL) return NULL;
+
+    uint64_t now = read_tsc();
+
+    __atomic_add_fetch(&st->acquired, 1, __ATOMIC_RELAXED);
+    if (contended) {
+        __atomic_add_fetch(&st->contended, 1, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&st->spin_total, now - start, __ATOMIC_RELAXED);
+        lock_stat_max(&st->spin_max, now - start);
+    }
+    return st;
+}
+
+/* Only for exclusive holders, called before the lock is released */
+static void lock_stat_hold_begin(const volatile void *lock,
+                                 const char *fn, int ln,
+                                 bool contended, uint64_t start)
+{
+    lock_stat_t *st = lock_stat_acquired(lock, fn, ln, contended, start);
+    if (st != NULL) st->hold_start = read_tsc();
+}
+
+static void lock_stat_hold_end(const volatile void *lock)
+{
+    lock_stat_t *st = lock_stat_get(lock, NULL, 0);
+    if (st == NULL || st->hold_start == 0) return;
+
+    lock_stat_max(&st->hold_max, read_tsc() - st->hold_start);
+    st->hold_start = 0;
+}
+
+/* Print the most contended locks */
+void lock_stat_report(size_t num)
+{
+    lock_stat_t top[LOCK_STAT_TOP_MAX];
+    uint16_t picked[LOCK_STAT_TOP_MAX];
+    size_t n = 0, used = 0;
+
+    num = MIN(MAX(num, 1), LOCK_STAT_TOP_MAX);
+
+    for (size_t i = 0; i < LOCK_STAT_MAX; i++) {
+        if (lock_stats[i].lock != NULL) used++;
+    }
+
+    for (n = 0; n < num; n++) {
+        size_t best = LOCK_STAT_MAX;
+        for (size_t i = 0; i < LOCK_STAT_MAX; i++) {
+            lock_stat_t *st = &lock_stats[i];
+            if (st->lock == NULL || st->acquired == 0)
+                continue;
+            bool seen = false;
+            for (size_t k = 0; k < n; k++) {
+                if (picked[k] == i) seen = true;
+            }
+            if (seen)
+                continue;
+            if (best == LOCK_STAT_MAX
+                || st->contended > lock_stats[best].contended
+                || (st->contended == lock_stats[best].contended
+                    && st->acquired > lock_stats[best].acquired))
+                best = i;
+        }
+        if (best == LOCK_STAT_MAX)
+            break;
+        picked[n] = best;
+        top[n] = lock_stats[best];
+    }
+
+    kprintf("lock statistics: %d locks, %d untracked acquisitions, "
+            "top %d by contention (TSC cycles):\n",
+            used, lock_stat_dropped, n);
+    kprintf("  Acquired Contended    Spin avg    Spin max    Hold max Site\n");
+    for (size_t i = 0; i < n; i++) {
+        uint64_t avg = top[i].contended ? top[i].spin_total / top[i].contended : 0;
+        kprintf("  %8d %9d %11d %11d %11d %s:%d\n",
+                top[i].acquired, top[i].contended, avg, top[i].spin_max,
+                top[i].hold_max, top[i].fn ? top[i].fn : "?", top[i].ln);
+    }
+}
+
+/* Clear the counters, locks keep their entries */
+void lock_stat_reset(void)
+{
+    for (size_t i = 0; i < LOCK_STAT_MAX; i++) {
+        lock_stat_t *st = &lock_stats[i];
+        st->acquired = 0;
+        st->contended = 0;
+        st->spin_total = 0;
+        st->spin_max = 0;
+        st->hold_max = 0;
+    }
+    lock_stat_dropped = 0;
+}
+#endif
 
 void lock_lock_impl(lock_t *s, const char *fn, const int ln)
 {
     (void)fn;
     (void)ln;
 
-    asm volatile(
-        "pushfq;"
-        "cli;"
-        "lock btsl $0, %[lock];"
-        "jnc 2f;"
-        "1:"
-        "pause;"
-        "btl $0, %[lock];"
-        "jc 1b;"
-        "lock btsl $0, %[lock];"
-        "jc 1b;"
-        "2:"
-        "pop %[flags]"
-        : [lock] "=m"((s)->lock), [flags] "=m"((s)->rflags)
-        :
-        : "memory", "cc");
+    uint64_t rflags = irq_save();
+    irqsoff_begin(rflags, fn, ln);
+#ifdef ENABLE_LOCK_STAT
+    uint64_t start = read_tsc();
+#endif
+    bool contended;
+
+    if (s->type == LOCK_TYPE_MCS) {
+        contended = mcs_lock(s);
+    } else {
+        contended = ticket_lock(s);
+    }
+    s->rflags = rflags;
+    lock_depth_add(1);
+
+#ifdef ENABLE_LOCK_STAT
+    lock_stat_hold_begin(s, fn, ln, contended, start);
+#else
+    (void)contended;
+#endif
 }
 
 void lock_release_impl(lock_t *s, const char *fn, const int ln)
@@ -29,11 +278,148 @@ void lock_release_impl(lock_t *s, const char *fn, const int ln)
     (void)fn;
     (void)ln;
 
-    asm volatile("push %[flags];"
-                 "lock btrl $0, %[lock];"
-                    "popfq;"
-                 : [lock] "=m"((s)->lock)
-                 : [flags] "m"((s)->rflags)
-                 : "memory", "cc");
+#ifdef ENABLE_LOCK_STAT
+    lock_stat_hold_end(s);
+#endif
+
+    uint64_t rflags = s->rflags;
+
+    if (s->type == LOCK_TYPE_MCS) {
+        mcs_release(s);
+    } else {
+        ticket_release(s);
+    }
+    lock_depth_add(-1);
+    irqsoff_end(rflags);
+    irq_restore(rflags);
+}
+
+
+uint64_t rwlock_read_lock_impl(rwlock_t *l, const char *fn, const int ln)
+{
+    (void)fn;
+    (void)ln;
+
+    uint64_t rflags = irq_save();
+    irqsoff_begin(rflags, fn, ln);
+#ifdef ENABLE_LOCK_STAT
+    uint64_t start = read_tsc();
+#endif
+    uint32_t *depth = &rwlock_read_depth[smp_get_cpu_id()];
+    bool contended = false;
+
+    uint32_t cnts = __atomic_add_fetch(&l->cnts, RWLOCK_READER, __ATOMIC_ACQUIRE);
+    if (!(cnts & (RWLOCK_WRITER | RWLOCK_WAITING))) {
+        /* Fast path */
+    } else if (__atomic_load_n(depth, __ATOMIC_RELAXED) > 0) {
+        /*
+         * This CPU already reads a rwlock, maybe this one. A waiting writer
+         * may wait for it, so only an active writer is waited for, which
+         * can not be one of ours since readers keep writers out.
+         */
+        contended = true;
+        while (__atomic_load_n(&l->cnts, __ATOMIC_ACQUIRE) & RWLOCK_WRITER)
+            asm volatile("pause");
+    } else {
+        /* Slow path: back out and wait in the queue behind earlier writers */
+        contended = true;
+        __atomic_sub_fetch(&l->cnts, RWLOCK_READER, __ATOMIC_RELAXED);
+        lock_lock_impl(&l->wait, fn, ln);
+        __atomic_add_fetch(&l->cnts, RWLOCK_READER, __ATOMIC_ACQUIRE);
+        while (__atomic_load_n(&l->cnts, __ATOMIC_ACQUIRE) & RWLOCK_WRITER)
+            asm volatile("pause");
+        lock_release_impl(&l->wait, fn, ln);
+    }
+    __atomic_add_fetch(depth, 1, __ATOMIC_RELAXED);
+    lock_depth_add(1);
+
+#ifdef ENABLE_LOCK_STAT
+    lock_stat_acquired(l, fn, ln, contended, start);
+#else
+    (void)contended;
+#endif
+    return rflags;
+}
+
+void rwlock_read_release_impl(rwlock_t *l, uint64_t rflags,
+                              const char *fn, const int ln)
+{
+    (void)fn;
+    (void)ln;
+
+    __atomic_sub_fetch(&l->cnts, RWLOCK_READER, __ATOMIC_RELEASE);
+    __atomic_sub_fetch(&rwlock_read_depth[smp_get_cpu_id()], 1,
+                       __ATOMIC_RELAXED);
+    lock_depth_add(-1);
+    irqsoff_end(rflags);
+    irq_restore(rflags);
+}
+
+void rwlock_write_lock_impl(rwlock_t *l, const char *fn, const int ln)
+{
+    (void)fn;
+    (void)ln;
+
+    uint64_t rflags = irq_save();
+    irqsoff_begin(rflags, fn, ln);
+#ifdef ENABLE_LOCK_STAT
+    uint64_t start = read_tsc();
+#endif
+    uint32_t expected = 0;
+    bool contended = false;
+
+    if (!__atomic_compare_exchange_n(&l->cnts, &expected, RWLOCK_WRITER, false,
+                                     __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+    {
+        contended = true;
+        /* Block new readers, then wait for current readers to drain */
+        lock_lock_impl(&l->wait, fn, ln);
+        __atomic_or_fetch(&l->cnts, RWLOCK_WAITING, __ATOMIC_RELAXED);
+        while (true) {
+            expected = RWLOCK_WAITING;
+            if (__atomic_compare_exchange_n(&l->cnts, &expected, RWLOCK_WRITER,
+                                            false, __ATOMIC_ACQUIRE,
+                                            __ATOMIC_RELAXED))
+                break;
+            asm volatile("pause");
+        }
+        lock_release_impl(&l->wait, fn, ln);
+    }
+    l->rflags = rflags;
+    lock_depth_add(1);
+
+#ifdef ENABLE_LOCK_STAT
+    lock_stat_hold_begin(l, fn, ln, contended, start);
+#else
+    (void)contended;
+#endif
 }
 
+void rwlock_write_release_impl(rwlock_t *l, const char *fn, const int ln)
+{
+    (void)fn;
+    (void)ln;
+
+#ifdef ENABLE_LOCK_STAT
+    lock_stat_hold_end(l);
+#endif
+
+    uint64_t rflags = l->rflags;
+    __atomic_sub_fetch(&l->cnts, RWLOCK_WRITER, __ATOMIC_RELEASE);
+    lock_depth_add(-1);
+    irqsoff_end(rflags);
+    irq_restore(rflags);
+}
+
+void seqlock_write_lock_impl(seqlock_t *l, const char *fn, const int ln)
+{
+    lock_lock_impl(&l->lock, fn, ln);
+    __atomic_add_fetch(&l->seq, 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+void seqlock_write_release_impl(seqlock_t *l, const char *fn, const int ln)
+{
+    __atomic_add_fetch(&l->seq, 1, __ATOMIC_RELEASE);
+    lock_release_impl(&l->lock, fn, ln);
+}
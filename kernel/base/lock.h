@@ -7,6 +7,33 @@
 
   e.g., lock new, lock and release.
 
+  Two kinds of fair spinlocks share the same lock_t API:
+  - Ticket lock (default): waiters take a ticket and spin until it is served,
+    good for small locks with a few waiters.
+  - MCS lock: each waiter spins on its own queue node, so only one cache line
+    is touched when the lock is handed over. Use it for heavily contended
+    locks, e.g., the waiter queue of rwlock_t.
+
+  A zero-initialized lock_t is an unlocked ticket lock.
+
+  For read-mostly data there are two more locks:
+  - Reader-writer lock: readers run in parallel, a writer excludes everyone.
+    Contended waiters queue on an internal MCS lock, so writers are not
+    starved by a stream of readers. Interrupts are disabled while it is held
+    and a reader gets the saved rflags back from rwlock_read_lock(). A CPU
+    which already reads a rwlock may take the read side again (e.g., a
+    lookup inside a stat) without queueing behind waiting writers. Taking
+    the write side while reading still deadlocks.
+  - Seqlock: writers serialize on a lock_t and bump a sequence number,
+    readers never block writers and retry if the sequence changed. Readers
+    must only copy plain data, never follow pointers read inside the section.
+
+  With ENABLE_LOCK_STAT in kconfig.h, every lock records how often it is
+  taken and contended, the TSC cycles spent spinning and the longest hold
+  (not for readers). Statistics are kept in a table keyed by lock address
+  and named after the first site which took the lock. Without the option
+  all of it is compiled out.
+
  @endverbatim
 
  **-----------------------------------------------------------------------------
@@ -14,18 +41,111 @@
 #pragma once
 
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
 
+#include <kconfig.h>
+
+#define LOCK_TYPE_TICKET    0
+#define LOCK_TYPE_MCS       1
+
+/* MCS queue nodes per CPU, i.e., the max nesting depth of MCS locks */
+#define LOCK_MCS_NODES      4
+
+typedef struct mcs_node {
+    struct mcs_node *volatile next;
+    volatile uint32_t locked;
+    volatile uint32_t used;
+} mcs_node_t;
+
 typedef volatile struct {
-    int lock;
+    uint16_t owner;         /* Ticket being served */
+    uint16_t next;          /* Next ticket to hand out */
+    uint32_t type;
+    mcs_node_t *tail;       /* Last waiter of MCS queue */
+    mcs_node_t *holder;     /* Queue node of current MCS holder */
     uint64_t rflags;
 } lock_t;
 
-#define lock_new()          (lock_t){0, 0}
+#define lock_new()          (lock_t){0}
+#define lock_new_mcs()      (lock_t){.type = LOCK_TYPE_MCS}
 #define lock_lock(x)        lock_lock_impl(x, __FILE__, __LINE__)
 #define lock_release(x)     lock_release_impl(x, __FILE__, __LINE__)
 
 void lock_lock_impl(lock_t *s, const char *fn, const int ln);
 void lock_release_impl(lock_t *s, const char *fn, const int ln);
+uint32_t lock_held_count(void);
+
+#define RWLOCK_WRITER       0x000000FFU     /* A writer holds the lock */
+#define RWLOCK_WAITING      0x00000100U     /* A writer is waiting */
+#define RWLOCK_READER       0x00000200U     /* One reader */
+
+typedef volatile struct {
+    uint32_t cnts;
+    uint32_t reserved;
+    lock_t wait;            /* Queue of contended readers and writers */
+    uint64_t rflags;        /* Saved by the writer */
+} rwlock_t;
+
+#define rwlock_new()                (rwlock_t){.wait = {.type = LOCK_TYPE_MCS}}
+#define rwlock_read_lock(x)         rwlock_read_lock_impl(x, __FILE__, __LINE__)
+#define rwlock_read_release(x, f)   rwlock_read_release_impl(x, f, __FILE__, __LINE__)
+#define rwlock_write_lock(x)        rwlock_write_lock_impl(x, __FILE__, __LINE__)
+#define rwlock_write_release(x)     rwlock_write_release_impl(x, __FILE__, __LINE__)
+
+uint64_t rwlock_read_lock_impl(rwlock_t *l, const char *fn, const int ln);
+void rwlock_read_release_impl(rwlock_t *l, uint64_t rflags,
+                              const char *fn, const int ln);
+void rwlock_write_lock_impl(rwlock_t *l, const char *fn, const int ln);
+void rwlock_write_release_impl(rwlock_t *l, const char *fn, const int ln);
+
+typedef volatile struct {
+    uint32_t seq;           /* Odd while a writer is updating */
+    uint32_t reserved;
+    lock_t lock;
+} seqlock_t;
+
+#define seqlock_new()               (seqlock_t){0}
+#define seqlock_write_lock(x)       seqlock_write_lock_impl(x, __FILE__, __LINE__)
+#define seqlock_write_release(x)    seqlock_write_release_impl(x, __FILE__, __LINE__)
+
+void seqlock_write_lock_impl(seqlock_t *l, const char *fn, const int ln);
+void seqlock_write_release_impl(seqlock_t *l, const char *fn, const int ln);
+
+/* Wait until no writer is active and return the sequence to check later */
+static inline uint32_t seqlock_read_begin(seqlock_t *l)
+{
+    uint32_t seq;
+    while ((seq = __atomic_load_n(&l->seq, __ATOMIC_ACQUIRE)) & 1)
+        asm volatile("pause");
+    return seq;
+}
+
+/* Return true if a writer ran since seqlock_read_begin() */
+static inline bool seqlock_read_retry(seqlock_t *l, uint32_t seq)
+{
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    return __atomic_load_n(&l->seq, __ATOMIC_RELAXED) != seq;
+}
+
+#ifdef ENABLE_LOCK_STAT
+
+#define LOCK_STAT_MAX       512     /* Must be power of 2 */
+#define LOCK_STAT_TOP_MAX   32
+
+typedef struct {
+    const volatile void *lock;
+    const char *fn;         /* First site which took the lock */
+    int ln;
+    uint64_t acquired;
+    uint64_t contended;
+    uint64_t spin_total;    /* TSC cycles spent waiting */
+    uint64_t spin_max;
+    uint64_t hold_max;      /* TSC cycles, writers and exclusive holders */
+    uint64_t hold_start;
+} lock_stat_t;
 
+void lock_stat_report(size_t num);
+void lock_stat_reset(void);
 
+#endif
@@ -0,0 +1,136 @@
+/**-----------------------------------------------------------------------------
+
+ @file    radix.c
+ @brief   Implementation of radix tree related functions
+ @details
+ @verbatim
+
+  The root covers keys below 64 ^ (shift / 6 + 1). A larger key grows the
+  tree by new roots whose first slot is the old root, so existing nodes
+  never move and readers see either the old or the new root. Deleting the
+  last item of a node frees it and clears its slot in the parent, up to the
+  root, but the height is never reduced.
+
+ @endverbatim
+
+ **-----------------------------------------------------------------------------
+ */
+#include <libc/string.h>
+
+#include <base/radix.h>
+#include <base/kmalloc.h>
+
+static radix_node_t *radix_node_alloc(uint32_t shift)
+{
+    radix_node_t *node = (radix_node_t*)kmalloc(sizeof(radix_node_t));
+    if (node == NULL) return NULL;
+
+    memset(node, 0, sizeof(radix_node_t));
+    node->shift = shift;
+    return node;
+}
+
+static void radix_node_free_rcu(rcu_head_t *head)
+{
+    kmfree((uint8_t*)head - offsetof(radix_node_t, rcu));
+}
+
+static bool radix_covers(const radix_node_t *node, uint64_t key)
+{
+    return node->shift >= RADIX_MAX_SHIFT
+           || (key >> (node->shift + RADIX_BITS)) == 0;
+}
+
+/* Returns the item, NULL if not found */
+void *radix_lookup(const radix_tree_t *tree, uint64_t key)
+{
+    radix_node_t *node = rcu_dereference(tree->root);
+    if (node == NULL || !radix_covers(node, key)) return NULL;
+
+    while (true) {
+        void *p = rcu_dereference(node->slots[(key >> node->shift) & RADIX_MASK]);
+        if (p == NULL || node->shift == 0) return p;
+        node = (radix_node_t*)p;
+    }
+}
+
+/* Returns false if the key is already used or no memory is available */
+bool radix_insert(radix_tree_t *tree, uint64_t key, void *item)
+{
+    radix_node_t *node = tree->root;
+
+    if (item == NULL) return false;
+
+    if (node == NULL) {
+        node = radix_node_alloc(0);
+        if (node == NULL) return false;
+        rcu_assign_pointer(tree->root, node);
+    }
+
+    while (!radix_covers(node, key)) {
+        radix_node_t *root = radix_node_alloc(node->shift + RADIX_BITS);
+        if (root == NULL) return false;
+        root->slots[0] = node;
+        root->count = 1;
+        rcu_assign_pointer(tree->root, root);
+        node = root;
+    }
+
+    while (node->shift > 0) {
+        void **slot = &node->slots[(key >> node->shift) & RADIX_MASK];
+        if (*slot == NULL) {
+            radix_node_t *child = radix_node_alloc(node->shift - RADIX_BITS);
+            if (child == NULL) return false;
+            rcu_assign_pointer(*slot, (void*)child);
+            node->count++;
+        }
+        node = (radix_node_t*)*slot;
+    }
+
+    void **slot = &node->slots[key & RADIX_MASK];
+    if (*slot != NULL) return false;
+
+    rcu_assign_pointer(*slot, item);
+    node->count++;
+    tree->num++;
+    return true;
+}
+
+/* Returns the deleted item, NULL if not found */
+void *radix_delete(radix_tree_t *tree, uint64_t key)
+{
+    radix_node_t *path[RADIX_MAX_SHIFT / RADIX_BITS + 1];
+    size_t depth = 0;
+    radix_node_t *node = tree->root;
+
+    if (node == NULL || !radix_covers(node, key)) return NULL;
+
+    while (true) {
+        path[depth++] = node;
+        void *p = node->slots[(key >> node->shift) & RADIX_MASK];
+        if (p == NULL) return NULL;
+        if (node->shift == 0) break;
+        node = (radix_node_t*)p;
+    }
+
+    void *item = node->slots[key & RADIX_MASK];
+    rcu_assign_pointer(node->slots[key & RADIX_MASK], NULL);
+    tree->num--;
+
+    /* Free empty nodes bottom up, readers may still be walking them */
+    while (depth > 0) {
+        node = path[--depth];
+        if (--node->count > 0) break;
+
+        if (depth == 0) {
+            rcu_assign_pointer(tree->root, NULL);
+        } else {
+            radix_node_t *parent = path[depth - 1];
+            rcu_assign_pointer(
+                parent->slots[(key >> parent->shift) & RADIX_MASK], NULL);
+        }
+        call_rcu(&node->rcu, radix_node_free_rcu);
+    }
+
+    return item;
+}
@@ -0,0 +1,52 @@
+/**-----------------------------------------------------------------------------
+
+ @file    radix.h
+ @brief   radix - radix tree indexed by 64-bit keys
+ @details
+ @verbatim
+
+  Maps integer keys, e.g., task ids, to pointers. Each node has 64 slots
+  indexed by 6 bits of the key, and the tree only grows as high as the
+  largest key needs, so dense keys take few levels and a lookup touches
+  one node per level.
+
+  Lookups may run in RCU read-side sections without any lock. Writers must
+  be serialized by the caller. Nodes are published with rcu_assign_pointer()
+  after they are filled, and empty ones are freed by call_rcu().
+
+ @endverbatim
+
+ **-----------------------------------------------------------------------------
+ */
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include <proc/rcu.h>
+
+#define RADIX_BITS          6
+#define RADIX_SLOTS         (1 << RADIX_BITS)
+#define RADIX_MASK          (RADIX_SLOTS - 1)
+
+/* Shift of the highest possible root, which indexes the top bits of keys */
+#define RADIX_MAX_SHIFT     60
+
+typedef struct radix_node {
+    void *slots[RADIX_SLOTS];       /* Children, or items if shift is 0 */
+    uint32_t shift;                 /* Bits of the key below this level */
+    uint32_t count;                 /* Number of slots in use */
+    rcu_head_t rcu;
+} radix_node_t;
+
+typedef struct {
+    radix_node_t *root;
+    size_t num;
+} radix_tree_t;
+
+#define radix_new()         (radix_tree_t){.root = NULL, .num = 0}
+
+void *radix_lookup(const radix_tree_t *tree, uint64_t key);
+bool radix_insert(radix_tree_t *tree, uint64_t key, void *item);
+void *radix_delete(radix_tree_t *tree, uint64_t key);
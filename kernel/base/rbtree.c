@@ -0,0 +1,229 @@
+/**-----------------------------------------------------------------------------
+
+ @file    rbtree.c
+ @brief   Implementation of red-black tree related functions
+ @details
+ @verbatim
+
+  The classic algorithm with parent pointers and NULL leaves, i.e., a NULL
+  child counts as a black node.
+
+   Ref: Introduction to Algorithms, Chapter 13
+
+ @endverbatim
+
+ **-----------------------------------------------------------------------------
+ */
+#include <base/rbtree.h>
+
+#define rb_is_red(n)        ((n) != NULL && (n)->red)
+
+static void rb_replace_child(rb_root_t *r, rb_node_t *parent,
+                             rb_node_t *old, rb_node_t *new)
+{
+    if (parent == NULL) {
+        r->root = new;
+    } else if (parent->left == old) {
+        parent->left = new;
+    } else {
+        parent->right = new;
+    }
+}
+
+static void rb_rotate_left(rb_root_t *r, rb_node_t *x)
+{
+    rb_node_t *y = x->right;
+
+    x->right = y->left;
+    if (y->left != NULL) y->left->parent = x;
+    y->parent = x->parent;
+    rb_replace_child(r, x->parent, x, y);
+    y->left = x;
+    x->parent = y;
+}
+
+static void rb_rotate_right(rb_root_t *r, rb_node_t *x)
+{
+    rb_node_t *y = x->left;
+
+    x->left = y->right;
+    if (y->right != NULL) y->right->parent = x;
+    y->parent = x->parent;
+    rb_replace_child(r, x->parent, x, y);
+    y->right = x;
+    x->parent = y;
+}
+
+void rb_insert(rb_root_t *r, rb_node_t *node, rb_less_t less)
+{
+    rb_node_t *parent = NULL, **link = &r->root;
+    bool leftmost = true;
+
+    while (*link != NULL) {
+        parent = *link;
+        if (less(node, parent)) {
+            link = &parent->left;
+        } else {
+            link = &parent->right;
+            leftmost = false;
+        }
+    }
+
+    node->parent = parent;
+    node->left = node->right = NULL;
+    node->red = true;
+    *link = node;
+    if (leftmost) r->leftmost = node;
+    r->num++;
+
+    /* Fix up two red nodes in a row */
+    while (rb_is_red(node->parent)) {
+        parent = node->parent;
+        rb_node_t *gparent = parent->parent;
+
+        if (parent == gparent->left) {
+            rb_node_t *uncle = gparent->right;
+            if (rb_is_red(uncle)) {
+                parent->red = uncle->red = false;
+                gparent->red = true;
+                node = gparent;
+                continue;
+            }
+            if (node == parent->right) {
+                rb_rotate_left(r, parent);
+                node = parent;
+                parent = node->parent;
+            }
+            parent->red = false;
+            gparent->red = true;
+            rb_rotate_right(r, gparent);
+        } else {
+            rb_node_t *uncle = gparent->left;
+            if (rb_is_red(uncle)) {
+                parent->red = uncle->red = false;
+                gparent->red = true;
+                node = gparent;
+                continue;
+            }
+            if (node == parent->left) {
+                rb_rotate_right(r, parent);
+                node = parent;
+                parent = node->parent;
+            }
+            parent->red = false;
+            gparent->red = true;
+            rb_rotate_left(r, gparent);
+        }
+    }
+    r->root->red = false;
+}
+
+rb_node_t *rb_next(const rb_node_t *node)
+{
+    if (node->right != NULL) {
+        node = node->right;
+        while (node->left != NULL) node = node->left;
+        return (rb_node_t*)node;
+    }
+
+    while (node->parent != NULL && node == node->parent->right)
+        node = node->parent;
+    return node->parent;
+}
+
+void rb_erase(rb_root_t *r, rb_node_t *node)
+{
+    rb_node_t *child, *parent;
+    bool red;
+
+    if (r->leftmost == node) r->leftmost = rb_next(node);
+    r->num--;
+
+    if (node->left == NULL || node->right == NULL) {
+        /* At most one child, which takes the place of the node */
+        child = (node->left != NULL) ? node->left : node->right;
+        parent = node->parent;
+        red = node->red;
+        if (child != NULL) child->parent = parent;
+        rb_replace_child(r, parent, node, child);
+    } else {
+        /* The successor has no left child, it takes the place of the node */
+        rb_node_t *succ = node->right;
+        while (succ->left != NULL) succ = succ->left;
+
+        child = succ->right;
+        red = succ->red;
+        if (succ->parent == node) {
+            parent = succ;
+        } else {
+            parent = succ->parent;
+            parent->left = child;
+            if (child != NULL) child->parent = parent;
+            succ->right = node->right;
+            node->right->parent = succ;
+        }
+        succ->left = node->left;
+        node->left->parent = succ;
+        succ->parent = node->parent;
+        succ->red = node->red;
+        rb_replace_child(r, node->parent, node, succ);
+    }
+
+    if (red) return;
+
+    /* A black node was removed, the path through child lacks one black */
+    while (child != r->root && !rb_is_red(child)) {
+        if (child == parent->left) {
+            rb_node_t *sib = parent->right;
+            if (rb_is_red(sib)) {
+                sib->red = false;
+                parent->red = true;
+                rb_rotate_left(r, parent);
+                sib = parent->right;
+            }
+            if (!rb_is_red(sib->left) && !rb_is_red(sib->right)) {
+                sib->red = true;
+                child = parent;
+                parent = child->parent;
+                continue;
+            }
+            if (!rb_is_red(sib->right)) {
+                sib->left->red = false;
+                sib->red = true;
+                rb_rotate_right(r, sib);
+                sib = parent->right;
+            }
+            sib->red = parent->red;
+            parent->red = false;
+            sib->right->red = false;
+            rb_rotate_left(r, parent);
+        } else {
+            rb_node_t *sib = parent->left;
+            if (rb_is_red(sib)) {
+                sib->red = false;
+                parent->red = true;
+                rb_rotate_right(r, parent);
+                sib = parent->left;
+            }
+            if (!rb_is_red(sib->left) && !rb_is_red(sib->right)) {
+                sib->red = true;
+                child = parent;
+                parent = child->parent;
+                continue;
+            }
+            if (!rb_is_red(sib->left)) {
+                sib->right->red = false;
+                sib->red = true;
+                rb_rotate_left(r, sib);
+                sib = parent->left;
+            }
+            sib->red = parent->red;
+            parent->red = false;
+            sib->left->red = false;
+            rb_rotate_right(r, parent);
+        }
+        child = r->root;
+        break;
+    }
+    if (child != NULL) child->red = false;
+}
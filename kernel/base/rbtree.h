@@ -0,0 +1,54 @@
+/**-----------------------------------------------------------------------------
+
+ @file    rbtree.h
+ @brief   rbtree - fundamental data structure, intrusive red-black tree
+ @details
+ @verbatim
+
+  The node is embedded in the object, and rb_entry() gets the object back:
+
+      typedef struct { uint64_t key; rb_node_t node; } obj_t;
+
+      rb_insert(&root, &obj->node, obj_less);
+      obj_t *first = rb_entry(rb_first(&root), obj_t, node);
+
+  Equal keys are kept in insertion order. The leftmost node is cached, so
+  rb_first() is O(1), while insertion and removal are O(log n). No memory
+  is allocated and no lock is taken, the caller serializes all accesses.
+
+ @endverbatim
+
+ **-----------------------------------------------------------------------------
+ */
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+typedef struct rb_node {
+    struct rb_node *parent;
+    struct rb_node *left;
+    struct rb_node *right;
+    bool red;
+} rb_node_t;
+
+typedef struct {
+    rb_node_t *root;
+    rb_node_t *leftmost;
+    size_t num;
+} rb_root_t;
+
+/* Returns true if node a should be placed before node b */
+typedef bool (*rb_less_t)(const rb_node_t *a, const rb_node_t *b);
+
+#define rb_entry(ptr, type, member) \
+    ((type*)((uint8_t*)(ptr) - offsetof(type, member)))
+
+#define rb_empty(r)         ((r)->root == NULL)
+#define rb_first(r)         ((r)->leftmost)
+
+void rb_insert(rb_root_t *r, rb_node_t *node, rb_less_t less);
+void rb_erase(rb_root_t *r, rb_node_t *node);
+rb_node_t *rb_next(const rb_node_t *node);
+
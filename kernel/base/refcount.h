@@ -0,0 +1,80 @@
+/**-----------------------------------------------------------------------------
+
+ @file    refcount.h
+ @brief   refcount - atomic reference counter
+ @details
+ @verbatim
+
+  Reference counts which can be taken and dropped without any lock, e.g.,
+  for inodes and node descriptors. All the functions are static inline.
+
+  Taking a reference only needs a relaxed increment since the caller already
+  owns a reference or holds the lock which protects the lookup. Dropping one
+  is a release operation, and the task which drops the last reference gets
+  true from refcount_dec_and_test() after an acquire fence, so it sees every
+  write made by the previous holders before it frees the object.
+
+  If the last reference must only be dropped with a lock held (e.g., the
+  object is still reachable by lookups under that lock), use:
+
+      if (!refcount_dec_not_one(&obj->refcount)) {
+          lock(...);
+          if (refcount_dec_and_test(&obj->refcount)) free(obj);
+          unlock(...);
+      }
+
+ @endverbatim
+
+ **-----------------------------------------------------------------------------
+ */
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include <sys/panic.h>
+
+typedef struct {
+    int64_t counter;
+} refcount_t;
+
+#define refcount_new(n)     (refcount_t){.counter = (n)}
+
+static inline void refcount_set(refcount_t *r, int64_t n)
+{
+    __atomic_store_n(&r->counter, n, __ATOMIC_RELAXED);
+}
+
+static inline int64_t refcount_read(const refcount_t *r)
+{
+    return __atomic_load_n(&r->counter, __ATOMIC_RELAXED);
+}
+
+static inline void refcount_inc(refcount_t *r)
+{
+    __atomic_add_fetch(&r->counter, 1, __ATOMIC_RELAXED);
+}
+
+/* Returns true if the last reference was dropped */
+static inline bool refcount_dec_and_test(refcount_t *r)
+{
+    int64_t n = __atomic_sub_fetch(&r->counter, 1, __ATOMIC_RELEASE);
+    if (n < 0) kpanic("REFCOUNT: underflow of 0x%x\n", r);
+    if (n == 0) {
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        return true;
+    }
+    return false;
+}
+
+/* Drop a reference unless it is the last one, returns false if it is */
+static inline bool refcount_dec_not_one(refcount_t *r)
+{
+    int64_t n = __atomic_load_n(&r->counter, __ATOMIC_RELAXED);
+    do {
+        if (n <= 1) return false;
+    } while (!__atomic_compare_exchange_n(&r->counter, &n, n - 1, true,
+                                          __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+    return true;
+}
+
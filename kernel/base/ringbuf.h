@@ -0,0 +1,168 @@
+/**-----------------------------------------------------------------------------
+
+ @file    ringbuf.h
+ @brief   ringbuf - lock-free bounded ring buffer
+ @details
+ @verbatim
+
+  Fixed size elements are passed through a ring of power-of-two capacity
+  without any lock, e.g., from interrupt handlers to tasks. The caller
+  provides the memory, its size is got from ringbuf_mem_size(). All the
+  functions are static inline and only use compiler builtins, so this file
+  can also be built on the host.
+
+  Two variants share the same API:
+  - RINGBUF_SPSC: one producer and one consumer. Each side owns its index
+    and only reads the other one.
+  - RINGBUF_MPSC: any number of producers and one consumer. Producers
+    reserve a range of slots with a CAS on tail, then publish each slot by
+    writing its sequence number. The consumer stops at the first slot not
+    yet published, so a producer interrupted between reserving and
+    publishing only delays the elements behind it.
+
+  Push and pop move up to n elements at once and return the number moved,
+  which is 0 if the ring is full or empty. Nothing ever blocks.
+
+ @endverbatim
+
+ **-----------------------------------------------------------------------------
+ */
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define RINGBUF_SPSC        0
+#define RINGBUF_MPSC        1
+
+typedef struct {
+    [[gnu::aligned(64)]] uint64_t head;     /* Next element to pop */
+    [[gnu::aligned(64)]] uint64_t tail;     /* Next slot to push */
+    [[gnu::aligned(64)]] uint32_t type;
+    uint32_t elem_size;
+    uint64_t mask;
+    uint64_t *seq;                          /* Per-slot sequence, MPSC only */
+    uint8_t *data;
+} ringbuf_t;
+
+static inline size_t ringbuf_mem_size(uint32_t type, size_t capacity,
+                                      size_t elem_size)
+{
+    size_t size = capacity * elem_size;
+    if (type == RINGBUF_MPSC)
+        size += capacity * sizeof(uint64_t);
+    return size;
+}
+
+/* Capacity must be a power of two, buff must hold ringbuf_mem_size() bytes */
+static inline bool ringbuf_init(ringbuf_t *rb, uint32_t type, void *buff,
+                                size_t capacity, size_t elem_size)
+{
+    if (capacity == 0 || (capacity & (capacity - 1)) != 0 || elem_size == 0)
+        return false;
+
+    rb->head = 0;
+    rb->tail = 0;
+    rb->type = type;
+    rb->elem_size = (uint32_t)elem_size;
+    rb->mask = capacity - 1;
+    if (type == RINGBUF_MPSC) {
+        /* Slot i is published for position p when seq[i] is p + 1 */
+        rb->seq = (uint64_t*)buff;
+        for (size_t i = 0; i < capacity; i++)
+            rb->seq[i] = 0;
+        rb->data = (uint8_t*)buff + capacity * sizeof(uint64_t);
+    } else {
+        rb->seq = NULL;
+        rb->data = (uint8_t*)buff;
+    }
+    return true;
+}
+
+static inline size_t ringbuf_capacity(const ringbuf_t *rb)
+{
+    return rb->mask + 1;
+}
+
+/* Number of elements in the ring, only a snapshot if others are running */
+static inline size_t ringbuf_count(const ringbuf_t *rb)
+{
+    uint64_t head = __atomic_load_n(&rb->head, __ATOMIC_ACQUIRE);
+    uint64_t tail = __atomic_load_n(&rb->tail, __ATOMIC_ACQUIRE);
+    return (size_t)(tail - head);
+}
+
+static inline void *ringbuf_slot(const ringbuf_t *rb, uint64_t pos)
+{
+    return rb->data + (pos & rb->mask) * rb->elem_size;
+}
+
+/* Push up to n elements, returns the number pushed */
+static inline size_t ringbuf_push(ringbuf_t *rb, const void *elems, size_t n)
+{
+    const uint8_t *src = (const uint8_t*)elems;
+    uint64_t cap = rb->mask + 1;
+    uint64_t pos;
+    size_t k;
+
+    if (rb->type == RINGBUF_SPSC) {
+        pos = rb->tail;
+        uint64_t head = __atomic_load_n(&rb->head, __ATOMIC_ACQUIRE);
+        k = (size_t)(cap - (pos - head));
+        if (k > n) k = n;
+        for (size_t i = 0; i < k; i++)
+            __builtin_memcpy(ringbuf_slot(rb, pos + i),
+                             src + i * rb->elem_size, rb->elem_size);
+        __atomic_store_n(&rb->tail, pos + k, __ATOMIC_RELEASE);
+        return k;
+    }
+
+    /* Reserve k slots, the consumer has freed all of them */
+    pos = __atomic_load_n(&rb->tail, __ATOMIC_RELAXED);
+    do {
+        uint64_t head = __atomic_load_n(&rb->head, __ATOMIC_ACQUIRE);
+        k = (size_t)(cap - (pos - head));
+        if (k > n) k = n;
+        if (k == 0) return 0;
+    } while (!__atomic_compare_exchange_n(&rb->tail, &pos, pos + k, true,
+                                          __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+
+    for (size_t i = 0; i < k; i++) {
+        __builtin_memcpy(ringbuf_slot(rb, pos + i),
+                         src + i * rb->elem_size, rb->elem_size);
+        __atomic_store_n(&rb->seq[(pos + i) & rb->mask], pos + i + 1,
+                         __ATOMIC_RELEASE);
+    }
+    return k;
+}
+
+/* Pop up to n elements into elems, returns the number popped */
+static inline size_t ringbuf_pop(ringbuf_t *rb, void *elems, size_t n)
+{
+    uint8_t *dst = (uint8_t*)elems;
+    uint64_t pos = rb->head;
+    size_t k = 0;
+
+    if (rb->type == RINGBUF_SPSC) {
+        uint64_t tail = __atomic_load_n(&rb->tail, __ATOMIC_ACQUIRE);
+        k = (size_t)(tail - pos);
+        if (k > n) k = n;
+        for (size_t i = 0; i < k; i++)
+            __builtin_memcpy(dst + i * rb->elem_size,
+                             ringbuf_slot(rb, pos + i), rb->elem_size);
+    } else {
+        while (k < n && __atomic_load_n(&rb->seq[(pos + k) & rb->mask],
+                                        __ATOMIC_ACQUIRE) == pos + k + 1)
+        {
+            __builtin_memcpy(dst + k * rb->elem_size,
+                             ringbuf_slot(rb, pos + k), rb->elem_size);
+            k++;
+        }
+    }
+
+    /* Slots are handed back to producers only after they have been copied */
+    __atomic_store_n(&rb->head, pos + k, __ATOMIC_RELEASE);
+    return k;
+}
+
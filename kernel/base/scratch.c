@@ -0,0 +1,73 @@
+/**-----------------------------------------------------------------------------
+
+ @file    scratch.c
+ @brief   Implementation of scratch arena functions
+ @details
+ @verbatim
+
+  Buffers are carved from the current task's arena by moving the top offset,
+  popping a buffer releases it together with all buffers pushed after it.
+  Before the scheduler starts there is no current task, a static boot arena
+  is used instead.
+
+ @endverbatim
+
+ **-----------------------------------------------------------------------------
+ */
+#include <base/scratch.h>
+#include <base/kmalloc.h>
+#include <base/klib.h>
+#include <base/klog.h>
+#include <proc/sched.h>
+
+[[gnu::aligned(SCRATCH_ALIGN)]] static uint8_t boot_arena[SCRATCH_SIZE];
+static scratch_t boot_scratch = { .base = boot_arena, .top = 0 };
+
+static scratch_t *scratch_current(void)
+{
+    task_t *t = sched_get_current_task();
+    if (t == NULL)
+        return &boot_scratch;
+
+    if (t->scratch.base == NULL) {
+        t->scratch.base = (uint8_t*)kmalloc(SCRATCH_SIZE);
+        t->scratch.top = 0;
+    }
+    return &t->scratch;
+}
+
+void *scratch_push(size_t len)
+{
+    scratch_t *s = scratch_current();
+    size_t size = ALIGNUP(len, SCRATCH_ALIGN);
+
+    if (s->base == NULL || s->top + size > SCRATCH_SIZE) {
+        klogd("SCRATCH: arena exhausted, fall back to kmalloc %d bytes\n", len);
+        return kmalloc(len);
+    }
+
+    void *ptr = s->base + s->top;
+    s->top += size;
+    return ptr;
+}
+
+void scratch_pop(void *ptr)
+{
+    scratch_t *s = scratch_current();
+    uint8_t *p = (uint8_t*)ptr;
+
+    if (s->base != NULL && p >= s->base && p < s->base + SCRATCH_SIZE) {
+        s->top = p - s->base;
+    } else {
+        kmfree(ptr);
+    }
+}
+
+void scratch_free(scratch_t *s)
+{
+    if (s->base != NULL && s->base != boot_arena)
+        kmfree(s->base);
+    s->base = NULL;
+    s->top = 0;
+}
+
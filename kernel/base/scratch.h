@@ -0,0 +1,36 @@
+/**-----------------------------------------------------------------------------
+
+ @file    scratch.h
+ @brief   Definition of scratch arena related data structures and functions
+ @details
+ @verbatim
+
+  A scratch arena provides temporary buffers (e.g., path and name buffers)
+  with push/pop in LIFO order. Each task owns its arena, so a task which is
+  preempted or migrated to another CPU keeps its buffers. The arena memory is
+  allocated on first use and freed with the task.
+
+  When the arena is exhausted, scratch_push() falls back to kmalloc() and
+  scratch_pop() frees such buffer by kmfree().
+
+ @endverbatim
+
+ **-----------------------------------------------------------------------------
+ */
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define SCRATCH_SIZE            (32 * 1024)
+#define SCRATCH_ALIGN           16
+
+typedef struct {
+    uint8_t *base;
+    size_t  top;
+} scratch_t;
+
+void *scratch_push(size_t len);
+void scratch_pop(void *ptr);
+void scratch_free(scratch_t *s);
+
@@ -0,0 +1,141 @@
+/**-----------------------------------------------------------------------------
+
+ @file    twheel.c
+ @brief   Implementation of hierarchical timer wheel related functions
+ @details
+ @verbatim
+
+  A timer at level n is placed by the bits of its expiry tick which index
+  that level. It is cascaded when the clock enters its slot, which is at
+  most 64 slots ahead, so every timer is moved at most once per level.
+
+ @endverbatim
+
+ **-----------------------------------------------------------------------------
+ */
+#include <base/twheel.h>
+
+static void twheel_link(twheel_t *w, twheel_node_t *node)
+{
+    uint64_t expires = node->expires;
+    uint64_t delta;
+    size_t level;
+
+    if (expires < w->clk) expires = w->clk;
+    delta = expires - w->clk;
+    if (delta > TWHEEL_MAX_DELTA) {
+        expires = w->clk + TWHEEL_MAX_DELTA;
+        delta = TWHEEL_MAX_DELTA;
+    }
+
+    for (level = 0; level < TWHEEL_LEVELS - 1; level++) {
+        if (delta < (1ULL << (TWHEEL_BITS * (level + 1)))) break;
+    }
+
+    twheel_node_t **slot =
+        &w->slots[level][(expires >> (TWHEEL_BITS * level)) & TWHEEL_MASK];
+    node->next = *slot;
+    if (*slot != NULL) (*slot)->pprev = &node->next;
+    node->pprev = slot;
+    *slot = node;
+}
+
+void twheel_add(twheel_t *w, twheel_node_t *node, uint64_t expires)
+{
+    node->expires = expires;
+    twheel_link(w, node);
+    w->num++;
+}
+
+void twheel_del(twheel_t *w, twheel_node_t *node)
+{
+    if (!twheel_pending(node)) return;
+
+    *node->pprev = node->next;
+    if (node->next != NULL) node->next->pprev = node->pprev;
+    node->next = NULL;
+    node->pprev = NULL;
+    w->num--;
+}
+
+static void twheel_cascade(twheel_t *w, size_t level, size_t index)
+{
+    twheel_node_t *node = w->slots[level][index];
+
+    w->slots[level][index] = NULL;
+    while (node != NULL) {
+        twheel_node_t *next = node->next;
+        twheel_link(w, node);
+        node = next;
+    }
+}
+
+/* Run func for the timers which expire no later than now, returns the count */
+size_t twheel_advance(twheel_t *w, uint64_t now, twheel_func_t func, void *arg)
+{
+    size_t count = 0;
+
+    /* Nothing to cascade or expire in an empty wheel */
+    if (w->num == 0) {
+        if (w->clk <= now) w->clk = now + 1;
+        return 0;
+    }
+
+    while (w->clk <= now) {
+        size_t index = w->clk & TWHEEL_MASK;
+
+        if (index == 0) {
+            for (size_t level = 1; level < TWHEEL_LEVELS; level++) {
+                size_t i = (w->clk >> (TWHEEL_BITS * level)) & TWHEEL_MASK;
+                twheel_cascade(w, level, i);
+                if (i != 0) break;
+            }
+        }
+
+        twheel_node_t *node = w->slots[0][index];
+        w->slots[0][index] = NULL;
+        while (node != NULL) {
+            twheel_node_t *next = node->next;
+            node->next = NULL;
+            node->pprev = NULL;
+            w->num--;
+            count++;
+            func(node, arg);
+            node = next;
+        }
+        w->clk++;
+
+        if (w->num == 0 && w->clk <= now) w->clk = now + 1;
+    }
+    return count;
+}
+
+/* Earliest expiry tick of all timers, UINT64_MAX if the wheel is empty */
+uint64_t twheel_next(const twheel_t *w)
+{
+    uint64_t next = UINT64_MAX;
+
+    if (w->num == 0) return next;
+
+    for (size_t level = 0; level < TWHEEL_LEVELS; level++) {
+        size_t start = (w->clk >> (TWHEEL_BITS * level)) & TWHEEL_MASK;
+
+        /*
+         * The first busy slot after the current one holds the earliest timers
+         * of this level, while the current one may also hold timers which are
+         * a whole round ahead, so both are checked.
+         */
+        for (size_t i = 0; i < TWHEEL_SIZE; i++) {
+            const twheel_node_t *node =
+                w->slots[level][(start + i) & TWHEEL_MASK];
+            if (node == NULL) continue;
+            for (; node != NULL; node = node->next) {
+                uint64_t expires = (node->expires < w->clk) ? w->clk
+                                                            : node->expires;
+                if (expires < next) next = expires;
+            }
+            if (i > 0) break;
+        }
+    }
+    return next;
+}
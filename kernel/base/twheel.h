@@ -0,0 +1,57 @@
+/**-----------------------------------------------------------------------------
+
+ @file    twheel.h
+ @brief   twheel - hierarchical timer wheel
+ @details
+ @verbatim
+
+  Timers expire at integer ticks. Level 0 has one slot per tick for the
+  next 64 ticks, each higher level has slots 64 times wider. When level 0
+  wraps around, the due slot of the next level is cascaded, i.e., its timers
+  are added again and go to lower levels. Adding and deleting a timer is
+  O(1), and advancing the wheel only touches the slots which are due.
+
+  The node is embedded in the object. No memory is allocated and no lock is
+  taken, the caller serializes all accesses. twheel_advance() must be called
+  with the current tick before adding timers, since expiry ticks are placed
+  relative to the last advance.
+
+ @endverbatim
+
+ **-----------------------------------------------------------------------------
+ */
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define TWHEEL_BITS         6
+#define TWHEEL_SIZE         (1 << TWHEEL_BITS)
+#define TWHEEL_MASK         (TWHEEL_SIZE - 1)
+#define TWHEEL_LEVELS       4
+
+/* Timers further than this are clamped, about 4.6 hours with 1ms ticks */
+#define TWHEEL_MAX_DELTA    ((1ULL << (TWHEEL_BITS * TWHEEL_LEVELS)) - 1)
+
+typedef struct twheel_node {
+    struct twheel_node *next;
+    struct twheel_node **pprev;
+    uint64_t expires;
+} twheel_node_t;
+
+typedef struct {
+    uint64_t clk;                   /* Next tick to be processed */
+    size_t num;
+    twheel_node_t *slots[TWHEEL_LEVELS][TWHEEL_SIZE];
+} twheel_t;
+
+typedef void (*twheel_func_t)(twheel_node_t *node, void *arg);
+
+#define twheel_pending(n)   ((n)->pprev != NULL)
+
+void twheel_add(twheel_t *w, twheel_node_t *node, uint64_t expires);
+void twheel_del(twheel_t *w, twheel_node_t *node);
+size_t twheel_advance(twheel_t *w, uint64_t now, twheel_func_t func, void *arg);
+uint64_t twheel_next(const twheel_t *w);
+
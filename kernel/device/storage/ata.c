@@ -28,7 +28,8 @@ static ata_device_t ata_primary_slave    = {.io_base = 0x1F0, .control = 0x3F6,
 static ata_device_t ata_secondary_master = {.io_base = 0x170, .control = 0x376, .slave = 0};
 static ata_device_t ata_secondary_slave  = {.io_base = 0x170, .control = 0x376, .slave = 1};
 
-static lock_t ata_lock;
+/* A spinlock, since file systems reach PIO transfers with vfs_tree_lock held */
+static lock_t ata_lock = {0};
 
 /* Function Definition */
 static int ata_read_partition_map(ata_device_t* dev, char* devname);
@@ -429,6 +430,8 @@ void ata_pio_read28(ata_device_t* dev, uint32_t lba, uint8_t sector_count, uint8
     uint16_t bus = dev->io_base;
     uint8_t slave = dev->slave;
 
+    lock_lock(&ata_lock);
+
     ata_io_wait(dev);
 
     port_outb(bus + ATA_REG_HDDEVSEL,  0xE0 | slave << 4 | ((lba & 0x0f000000) >> 24));
@@ -451,6 +454,8 @@ void ata_pio_read28(ata_device_t* dev, uint32_t lba, uint8_t sector_count, uint8
     }
 
     ata_poll(dev, 0);
+
+    lock_release(&ata_lock);
 }
 
 void ata_pio_write28(ata_device_t* dev, uint32_t lba, uint8_t sector_count, uint8_t* source)
@@ -458,6 +463,8 @@ void ata_pio_write28(ata_device_t* dev, uint32_t lba, uint8_t sector_count, uint
     uint16_t bus = dev->io_base;
     uint8_t slave = dev->slave;
 
+    lock_lock(&ata_lock);
+
     ata_io_wait(dev);
 
     port_outb(bus + ATA_REG_HDDEVSEL,  0xE0 | slave << 4 | ((lba & 0x0f000000) >> 24));
@@ -487,6 +494,8 @@ void ata_pio_write28(ata_device_t* dev, uint32_t lba, uint8_t sector_count, uint
     ata_poll(dev, 0);
     port_outb(bus + ATA_REG_COMMAND, ATA_CMD_CACHE_FLUSH);
     ata_poll(dev, 0);
+
+    lock_release(&ata_lock);
 }
 
 int ata_read_partition_map(ata_device_t* dev, char* devname)
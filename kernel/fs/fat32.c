@@ -22,6 +22,7 @@
 #include <fs/fat32.h>
 #include <fs/filebase.h>
 #include <base/kmalloc.h>
+#include <base/kmem_cache.h>
 #include <base/klog.h>
 #include <base/klib.h>
 #include <base/vector.h>
@@ -47,6 +48,9 @@ vfs_fsinfo_t fat32 = {
     .ioctl = NULL
 };
 
+static kmem_cache_t item_cache =
+    kmem_cache_new("fat32_ident_item_t", sizeof(fat32_ident_item_t), NULL);
+
 static fat32_ident_t* create_ident()
 {
     fat32_ident_t* id = (fat32_ident_t*)kmalloc(sizeof(fat32_ident_t));
@@ -340,7 +344,7 @@ int64_t fat32_refresh(vfs_inode_t* this)
             }
 
             fat32_ident_item_t* item =
-                (fat32_ident_item_t*)kmalloc(sizeof(fat32_ident_item_t));
+                (fat32_ident_item_t*)kmem_cache_alloc(&item_cache);
             if (item != NULL) {
                 memcpy(&item->entry, fe, sizeof(fat_dir_entry_t));
                 strcpy(item->name, fn);
@@ -9,6 +9,9 @@
   node) related functions, e.g., alloc, free and node to fd (file descriptor),
   path to node conversions.
 
+  Child lists are read without any lock in RCU read-side sections. Writers
+  hold vfs_tree_lock, and a replaced list is freed after a grace period.
+
  @endverbatim
 
  **-----------------------------------------------------------------------------
@@ -18,18 +21,29 @@
 
 #include <fs/filebase.h>
 #include <base/kmalloc.h>
+#include <base/kmem_cache.h>
+#include <base/scratch.h>
 #include <base/hash.h>
+#include <base/klib.h>
 #include <sys/hpet.h>
 #include <sys/cmos.h>
 
 #include <fs/vfs.h>
 #include <proc/syscall.h>
 
+/* Object caches for the nodes which are frequently created and destroyed */
+static kmem_cache_t tnode_cache =
+    kmem_cache_new("vfs_tnode_t", sizeof(vfs_tnode_t), NULL);
+static kmem_cache_t inode_cache =
+    kmem_cache_new("vfs_inode_t", sizeof(vfs_inode_t), NULL);
+static kmem_cache_t node_desc_cache =
+    kmem_cache_new("vfs_node_desc_t", sizeof(vfs_node_desc_t), NULL);
+
 /* Allocate a tnode in memory */
 vfs_tnode_t *vfs_alloc_tnode(const char *name, vfs_inode_t *inode,
                              vfs_inode_t* parent)
 {
-    vfs_tnode_t* tnode = (vfs_tnode_t*)kmalloc(sizeof(vfs_tnode_t));
+    vfs_tnode_t* tnode = (vfs_tnode_t*)kmem_cache_alloc(&tnode_cache);
 
     memset(tnode, 0, sizeof(vfs_tnode_t));
     memcpy(tnode->name, name, sizeof(tnode->name));
@@ -47,7 +61,7 @@ vfs_inode_t *vfs_alloc_inode(vfs_node_type_t type, uint32_t perms,
                              uint32_t uid, vfs_fsinfo_t* fs,
                              vfs_tnode_t* mountpoint)
 {
-    vfs_inode_t* inode = (vfs_inode_t*)kmalloc(sizeof(vfs_inode_t));
+    vfs_inode_t* inode = (vfs_inode_t*)kmem_cache_alloc(&inode_cache);
     memset(inode, 0, sizeof(vfs_inode_t));
     *inode = (vfs_inode_t) {
         .type = type,
@@ -56,19 +70,127 @@ vfs_inode_t *vfs_alloc_inode(vfs_node_type_t type, uint32_t perms,
         .fs = fs,
         .ident = NULL,
         .mountpoint = mountpoint,
-        .refcount = 0,
+        .refcount = refcount_new(0),
         .size = 0
     };
     return inode;
 }
 
+/* Free an inode which is no longer referenced by any tnode */
+void vfs_free_inode(vfs_inode_t *inode)
+{
+    if (inode->child != NULL)
+        kmfree(inode->child);
+    kmem_cache_free(&inode_cache, inode);
+}
+
+static void vfs_free_child_list(rcu_head_t *head)
+{
+    kmfree((uint8_t*)head - offsetof(vfs_child_list_t, rcu));
+}
+
+/* Allocate a child list which holds at least num entries in whole pages */
+static vfs_child_list_t *vfs_alloc_child_list(size_t num)
+{
+    size_t size = sizeof(vfs_child_list_t) + num * sizeof(vfs_tnode_t*);
+    size = NUM_PAGES(size) * PAGE_SIZE;
+
+    vfs_child_list_t *cl = (vfs_child_list_t*)kmalloc(size);
+    cl->capacity = (size - sizeof(vfs_child_list_t)) / sizeof(vfs_tnode_t*);
+    cl->len = 0;
+    return cl;
+}
+
+/* Add a child, must be called with vfs_tree_lock held */
+void vfs_add_child(vfs_inode_t *parent, vfs_tnode_t *child)
+{
+    vfs_child_list_t *old = parent->child;
+    size_t len = (old != NULL) ? old->len : 0;
+
+    /* Readers do not look at the new slot until len is increased */
+    if (old != NULL && len < old->capacity) {
+        old->nodes[len] = child;
+        __atomic_store_n(&old->len, len + 1, __ATOMIC_RELEASE);
+        return;
+    }
+
+    vfs_child_list_t *cl = vfs_alloc_child_list(MAX(len * 2, 1));
+    if (len > 0)
+        memcpy(cl->nodes, old->nodes, len * sizeof(vfs_tnode_t*));
+    cl->nodes[len] = child;
+    cl->len = len + 1;
+
+    rcu_assign_pointer(parent->child, cl);
+    if (old != NULL)
+        call_rcu(&old->rcu, vfs_free_child_list);
+}
+
+/* Remove a child, must be called with vfs_tree_lock held */
+bool vfs_remove_child(vfs_inode_t *parent, vfs_tnode_t *child)
+{
+    vfs_child_list_t *old = parent->child;
+    size_t len = (old != NULL) ? old->len : 0;
+    size_t i;
+
+    for (i = 0; i < len; i++) {
+        if (old->nodes[i] == child) break;
+    }
+    if (i == len)
+        return false;
+
+    /* Readers may be walking the old list, so never shift it in place */
+    vfs_child_list_t *cl = vfs_alloc_child_list(old->capacity);
+    memcpy(cl->nodes, old->nodes, i * sizeof(vfs_tnode_t*));
+    memcpy(&cl->nodes[i], &old->nodes[i + 1],
+           (len - i - 1) * sizeof(vfs_tnode_t*));
+    cl->len = len - 1;
+
+    rcu_assign_pointer(parent->child, cl);
+    call_rcu(&old->rcu, vfs_free_child_list);
+    return true;
+}
+
 /* Free a tnode, and the inode if needed */
 void vfs_free_nodes(vfs_tnode_t *tnode)
 {
     vfs_inode_t *inode = tnode->inode;
-    if (inode->refcount <= 0)
-        kmfree(inode);
-    kmfree(tnode);
+    if (refcount_read(&inode->refcount) <= 0)
+        vfs_free_inode(inode);
+    kmem_cache_free(&tnode_cache, tnode);
+}
+
+/*
+ * Allocate a node descriptor, copy from an existing one if src is not NULL.
+ * The caller owns the only reference of the new descriptor.
+ */
+vfs_node_desc_t *vfs_alloc_node_desc(const vfs_node_desc_t *src)
+{
+    vfs_node_desc_t *nd =
+        (vfs_node_desc_t*)kmem_cache_alloc(&node_desc_cache);
+    if (nd == NULL)
+        return NULL;
+
+    if (src != NULL)
+        memcpy(nd, src, sizeof(vfs_node_desc_t));
+    else
+        memset(nd, 0, sizeof(vfs_node_desc_t));
+    refcount_set(&nd->refcount, 1);
+
+    return nd;
+}
+
+/* Take one more reference of a node descriptor, e.g., to share it */
+vfs_node_desc_t *vfs_get_node_desc(vfs_node_desc_t *nd)
+{
+    refcount_inc(&nd->refcount);
+    return nd;
+}
+
+/* Drop a reference of a node descriptor, free it with the last one */
+void vfs_free_node_desc(vfs_node_desc_t *nd)
+{
+    if (refcount_dec_and_test(&nd->refcount))
+        kmem_cache_free(&node_desc_cache, nd);
 }
 
 /* Return the node descriptor for a handle */
@@ -84,11 +206,11 @@ vfs_node_desc_t *vfs_handle_to_fd(vfs_handle_t handle)
     return NULL;
 }
 
-/* Convert a path to a node, creates the node if required */
-vfs_tnode_t *vfs_path_to_node(
-    const char *pathname, uint8_t mode, vfs_node_type_t create_type)
+/* Path to node conversion with caller provided temporary buffers */
+static vfs_tnode_t *path_to_node(
+    const char *pathname, uint8_t mode, vfs_node_type_t create_type,
+    char *tmpbuff, char *path)
 {
-    char tmpbuff[VFS_MAX_PATH_LEN], path[VFS_MAX_PATH_LEN];
     vfs_tnode_t *curr = &vfs_root;
 
     /*  Only work with absolute paths */
@@ -149,10 +271,13 @@ vfs_tnode_t *vfs_path_to_node(
 
         /* Search for token in children of current node */
         foundnode = false;
-        if (!IS_TRAVERSABLE(curr->inode))
+        vfs_inode_t *inode = rcu_dereference(curr->inode);
+        if (!IS_TRAVERSABLE(inode))
             break;
-        for (i = 0; i < curr->inode->child.len; i++) {
-            vfs_tnode_t* child = vec_at(&(curr->inode->child), i);
+        vfs_child_list_t *cl = rcu_dereference(inode->child);
+        size_t num = vfs_child_count(cl);
+        for (i = 0; i < num; i++) {
+            vfs_tnode_t* child = cl->nodes[i];
             if (strncmp(child->name, tmpbuff, sizeof(child->name)) == 0) {
                 foundnode = true;
                 curr = child;
@@ -189,7 +314,7 @@ vfs_tnode_t *vfs_path_to_node(
             vfs_tnode_t* new_tnode = 
                 vfs_alloc_tnode(tmpbuff, new_inode, curr->inode);
 
-            vec_push_back(&(curr->inode->child), new_tnode);
+            vfs_add_child(curr->inode, new_tnode);
             if (curr->inode->fs != NULL) {
                 curr->inode->fs->mknode(new_tnode);
                 new_tnode->inode->fs = curr->inode->fs;
@@ -237,3 +362,38 @@ vfs_tnode_t *vfs_path_to_node(
     /* Found the node, return it */
     return curr;
 }
+
+/* Convert a path to a node, creates the node if required */
+vfs_tnode_t *vfs_path_to_node(
+    const char *pathname, uint8_t mode, vfs_node_type_t create_type)
+{
+    char *tmpbuff = (char*)scratch_push(VFS_MAX_PATH_LEN);
+    char *path = (char*)scratch_push(VFS_MAX_PATH_LEN);
+
+    /* Pure lookups walk the tree without any lock */
+    vfs_tnode_t *node;
+    if (mode & CREATE) {
+        lock_lock(&vfs_tree_lock);
+        node = path_to_node(pathname, mode, create_type, tmpbuff, path);
+        lock_release(&vfs_tree_lock);
+    } else {
+        rcu_read_lock();
+        node = path_to_node(pathname, mode, create_type, tmpbuff, path);
+        rcu_read_unlock();
+    }
+
+    scratch_pop(path);
+    scratch_pop(tmpbuff);
+    return node;
+}
+
+/* Copy the stat data of a node without holding any VFS lock */
+void vfs_get_stat(vfs_tnode_t *tnode, vfs_stat_t *st)
+{
+    uint32_t seq;
+    do {
+        seq = seqlock_read_begin(&vfs_stat_seq);
+        memcpy(st, &(tnode->st), sizeof(vfs_stat_t));
+    } while (seqlock_read_retry(&vfs_stat_seq, seq));
+}
+
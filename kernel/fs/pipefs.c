@@ -133,17 +133,8 @@ int64_t pipefs_rmnode(vfs_tnode_t *this)
     if (id == NULL) goto err_exit;
     kmfree(id);
 
-    vfs_inode_t *parent = this->parent;
-    size_t child_num = vec_length(&parent->child);
-    if (child_num > 0) {
-        for (size_t i = 0; i < child_num; i++) {
-            vfs_tnode_t *t = vec_at(&parent->child, i); 
-            if (t == this) {
-                vec_erase(&parent->child, i); 
-                return 0;
-            }
-        }
-    }   
+    if (vfs_remove_child(this->parent, this))
+        return 0;
 err_exit:
     return -1; 
 }
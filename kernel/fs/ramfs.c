@@ -3,6 +3,7 @@
 #include <fs/ramfs.h>
 #include <fs/filebase.h>
 #include <base/kmalloc.h>
+#include <base/kmem_cache.h>
 #include <base/klog.h>
 #include <base/klib.h>
 #include <sys/panic.h>
@@ -14,6 +15,9 @@
 
 static bool debug_info = false;
 
+static kmem_cache_t item_cache =
+    kmem_cache_new("ramfs_ident_item_t", sizeof(ramfs_ident_item_t), NULL);
+
 /* Filesystem information */
 vfs_fsinfo_t ramfs = {
     .name = "ramfs",
@@ -136,7 +140,7 @@ void ramfs_init(void *address, uint64_t size)
             file_time += DEFAULT_TZ_SEC_SHIFT;
 
             ramfs_ident_item_t *item =
-                (ramfs_ident_item_t*)kmalloc(sizeof(ramfs_ident_item_t));
+                (ramfs_ident_item_t*)kmem_cache_alloc(&item_cache);
             if (item == NULL) continue;
 
             memset(item, 0, sizeof(ramfs_ident_item_t));
@@ -311,10 +315,8 @@ vfs_tnode_t *ramfs_open(vfs_inode_t *this, const char *pathname)
 
             uint8_t *buff = (uint8_t*)id->data;
             if (item->entry.size >= 2) {
-                memory_metadata_t *d =
-                    (memory_metadata_t*)((uint8_t*)id->data - PAGE_SIZE);
-                klogd("RAMFS: %s writes 0x%x [0x%02x 0x%02x ...MAGIC 0x%x] with %d bytes\n",
-                      path, id->data, buff[0], buff[1], d->magic, item->entry.size);
+                klogd("RAMFS: %s writes 0x%x [0x%02x 0x%02x ...] with %d bytes\n",
+                      path, id->data, buff[0], buff[1], item->entry.size);
             }
 
             break;
@@ -369,12 +371,10 @@ int64_t ramfs_read(vfs_inode_t *this, size_t offset, size_t len, void *buff)
         memcpy(buff, ((uint8_t*)id->data) + offset, len);
         if (len >= 2) {
             uint8_t *ptr = (uint8_t*)id->data;
-            memory_metadata_t *d =
-                (memory_metadata_t*)((uint8_t*)id->data - PAGE_SIZE);
             task_t *t = sched_get_current_task();
-            klogd("RAMFS: read %d bytes [0x%2x 0x%2x...MAGIC 0x%x] from 0x%x with "
+            klogd("RAMFS: read %d bytes [0x%2x 0x%2x...] from 0x%x with "
                   "offset %d and return %d in task %d\n",
-                  len, ptr[0], ptr[1], d->magic, id->data, offset, retlen,
+                  len, ptr[0], ptr[1], id->data, offset, retlen,
                   (t != NULL) ? t->tid : 0);
         }
     } else {
@@ -398,17 +398,8 @@ int64_t ramfs_rmnode(vfs_tnode_t *this)
     }
     kmfree(id);
 
-    vfs_inode_t *parent = this->parent;
-    size_t child_num = vec_length(&parent->child);
-    if (child_num > 0) {
-        for (size_t i = 0; i < child_num; i++) {
-            vfs_tnode_t *t = vec_at(&parent->child, i); 
-            if (t == this) {
-                vec_erase(&parent->child, i); 
-                return 0;
-            }
-        }
-    }
+    if (vfs_remove_child(this->parent, this))
+        return 0;
 err_exit:
 #endif
     return -1;
@@ -455,7 +446,7 @@ int64_t ramfs_setlink(vfs_tnode_t* this, vfs_inode_t* inode)
 
     /* We do not clean data here */
 #if 0
-    if (this->inode->refcount == 0) {
+    if (refcount_read(&this->inode->refcount) == 0) {
         ramfs_ident_t* id = (ramfs_ident_t*)this->inode->ident;
         if (id->data)
             kmfree(id->data);
@@ -174,7 +174,7 @@ int64_t ttyfs_read(vfs_inode_t* this, size_t offset, size_t len, void *buff)
     while (id->isize < (int64_t)len) {
         event_para_t para = 0;
         lock_release(&tty_lock);
-        lock_release(&vfs_lock);    /* If waiting, we need to release lock */
+        mutex_unlock(&vfs_lock);    /* If waiting, we need to release lock */
         if (eb_subscribe(sched_get_tid(), EVENT_KEY_PRESSED, &para)) {
             lock_lock(&tty_lock);
 
@@ -201,7 +201,7 @@ int64_t ttyfs_read(vfs_inode_t* this, size_t offset, size_t len, void *buff)
         } else {
             lock_lock(&tty_lock);
         }
-        lock_lock(&vfs_lock);
+        mutex_lock(&vfs_lock);
     }
 
     /* OK, data is enough! Read data from input buffer */
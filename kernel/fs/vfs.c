@@ -32,11 +32,18 @@
 #include <base/lock.h>
 #include <base/vector.h>
 #include <base/hash.h>
+#include <base/scratch.h>
 
 static bool vfs_initialized = false;
 
 /* VFS wide lock */
-lock_t vfs_lock = {0};
+mutex_t vfs_lock = mutex_new();
+
+/* Lock of tnode tree writers, lookups and directory reads use RCU instead */
+lock_t vfs_tree_lock = lock_new();
+
+/* Sequence lock of stat data in tnodes */
+seqlock_t vfs_stat_seq = seqlock_new();
 
 /* Stat structure related definitions */
 lock_t dev_lock = {0};
@@ -79,15 +86,23 @@ ino_t vfs_new_ino_id(void)
     return ino_id; 
 }
 
+static void vfs_free_inode_rcu(rcu_head_t *head)
+{
+    vfs_free_inode((vfs_inode_t*)((uint8_t*)head - offsetof(vfs_inode_t, rcu)));
+}
+
 static void dumpnodes_helper(vfs_tnode_t* from, int lvl)
 {
     for (int i = 0; i < 1 + lvl; i++)
         kprintf(" ");
-    kprintf(" %d: [%s] -> %x inode (%d refs)\n", lvl, from->name, from->inode, from->inode->refcount);
+    kprintf(" %d: [%s] -> %x inode (%d refs)\n", lvl, from->name, from->inode,
+            refcount_read(&from->inode->refcount));
 
-    if (IS_TRAVERSABLE(from->inode))
-        for (size_t i = 0; i < from->inode->child.len; i++)
-            dumpnodes_helper(vec_at(&(from->inode->child), i), lvl + 1);
+    if (IS_TRAVERSABLE(from->inode)) {
+        vfs_child_list_t *cl = rcu_dereference(from->inode->child);
+        for (size_t i = 0; i < vfs_child_count(cl); i++)
+            dumpnodes_helper(cl->nodes[i], lvl + 1);
+    }
 }
 
 void vfs_debug()
@@ -152,7 +167,7 @@ void vfs_init()
 int64_t vfs_create(char* path, vfs_node_type_t type)
 {
     int64_t status = 0;
-    lock_lock(&vfs_lock);
+    mutex_lock(&vfs_lock);
 
     vfs_tnode_t* tnode = vfs_path_to_node(path, CREATE, type);
     if (tnode == NULL) {
@@ -164,6 +179,7 @@ int64_t vfs_create(char* path, vfs_node_type_t type)
 
         time_t file_time = now_sec + boot_time;
 
+        seqlock_write_lock(&vfs_stat_seq);
         tnode->st.st_atim.tv_sec = file_time;
         tnode->st.st_mtim.tv_sec = file_time;
         tnode->st.st_ctim.tv_sec = file_time;
@@ -171,9 +187,10 @@ int64_t vfs_create(char* path, vfs_node_type_t type)
         tnode->st.st_atim.tv_nsec = 0;
         tnode->st.st_mtim.tv_nsec = 0;
         tnode->st.st_ctim.tv_nsec = 0;
+        seqlock_write_release(&vfs_stat_seq);
     }
 
-    lock_release(&vfs_lock);
+    mutex_unlock(&vfs_lock);
     return status;
 }
 
@@ -192,7 +209,9 @@ int64_t vfs_chmod(vfs_handle_t handle, int32_t newperms)
 
     /* Set new permissions and sync */
     fd->inode->perms = newperms & (S_IRWXU | S_IRWXG | S_IRWXO);
+    seqlock_write_lock(&vfs_stat_seq);
     fd->tnode->st.st_mode |= fd->inode->perms;
+    seqlock_write_release(&vfs_stat_seq);
     fd->inode->fs->sync(fd->inode);
     return 0;
 }
@@ -213,7 +232,7 @@ int64_t vfs_ioctl(vfs_handle_t handle, int64_t request, int64_t arg)
 /* Mounts a block device with specified filesystem at a path */
 int64_t vfs_mount(char* device, char* path, char* fsname)
 {
-    lock_lock(&vfs_lock);
+    mutex_lock(&vfs_lock);
 
     /* Get the fs info */
     vfs_fsinfo_t* fs = vfs_get_fs(fsname);
@@ -236,21 +255,30 @@ int64_t vfs_mount(char* device, char* path, char* fsname)
     vfs_tnode_t* at = vfs_path_to_node(path, NO_CREATE, 0);
     if (!at)
         goto fail;
-    if (at->inode->type != VFS_NODE_FOLDER || at->inode->child.len != 0) {
+    if (at->inode->type != VFS_NODE_FOLDER
+        || vfs_child_count(at->inode->child) != 0)
+    {
         kloge("\"%s\" is not an empty folder\n", path);
         goto fail;
     }
-    kmfree(at->inode);
 
     /* Mount the fs */
-    at->inode = fs->mount(dev ? dev->inode : NULL);
-    at->inode->mountpoint = at;
+    vfs_inode_t* mnt = fs->mount(dev ? dev->inode : NULL);
+
+    lock_lock(&vfs_tree_lock);
+    vfs_inode_t *old = at->inode;
+    mnt->mountpoint = at;
+    rcu_assign_pointer(at->inode, mnt);
+    lock_release(&vfs_tree_lock);
+
+    /* Lookups may still be walking the old inode */
+    call_rcu(&old->rcu, vfs_free_inode_rcu);
 
     klogi("Mounted %s at %s as %s\n", device ? device : "<no-device>", path, fsname);
-    lock_release(&vfs_lock);
+    mutex_unlock(&vfs_lock);
     return 0;
 fail:
-    lock_release(&vfs_lock);
+    mutex_unlock(&vfs_lock);
     return -1;
 }
 
@@ -276,7 +304,7 @@ int64_t vfs_read(vfs_handle_t handle, size_t len, void* buff)
         return 0;
     }
 
-    lock_lock(&vfs_lock);
+    mutex_lock(&vfs_lock);
 
     vfs_inode_t* inode = fd->inode;
 
@@ -298,7 +326,7 @@ int64_t vfs_read(vfs_handle_t handle, size_t len, void* buff)
 
     fd->seek_pos += len;
 end:
-    lock_release(&vfs_lock);
+    mutex_unlock(&vfs_lock);
     return (int64_t)len;
 }
 
@@ -309,7 +337,7 @@ int64_t vfs_unlink(char *path)
 {
     klogd("VFS: unlink %s\n", path);
 
-    lock_lock(&vfs_lock);
+    mutex_lock(&vfs_lock);
 
     /* Find the node and set st_nlink parameter */
     vfs_tnode_t* req = vfs_path_to_node(path, NO_CREATE, 0); 
@@ -326,21 +354,25 @@ int64_t vfs_unlink(char *path)
                   path);
             goto fail;
         }
+        seqlock_write_lock(&vfs_stat_seq);
         req->st.st_nlink = 0;
+        seqlock_write_release(&vfs_stat_seq);
     }   
 
-    /* Remove this file if needed */
-    if (req->inode->refcount == 0) {
+    /* Remove this file if needed, the count only drops to 0 under vfs_lock */
+    if (refcount_read(&req->inode->refcount) == 0) {
         if (req->inode->fs->rmnode != NULL) {
+            lock_lock(&vfs_tree_lock);
             req->inode->fs->rmnode(req);
+            lock_release(&vfs_tree_lock);
         }
     }
 
-    lock_release(&vfs_lock);
+    mutex_unlock(&vfs_lock);
     return 0;
 
 fail:
-    lock_release(&vfs_lock);
+    mutex_unlock(&vfs_lock);
     return -1;
 }
 
@@ -357,7 +389,7 @@ int64_t vfs_write(vfs_handle_t handle, size_t len, const void *buff)
         return 0;
     }
 
-    lock_lock(&vfs_lock);
+    mutex_lock(&vfs_lock);
     vfs_inode_t* inode = nd->inode;
 
     /* Expand file if writing more data than its size */
@@ -375,9 +407,11 @@ int64_t vfs_write(vfs_handle_t handle, size_t len, const void *buff)
     }
 
     /* Set file size to stat data structure */
+    seqlock_write_lock(&vfs_stat_seq);
     nd->tnode->st.st_size = nd->inode->size;
+    seqlock_write_release(&vfs_stat_seq);
 
-    lock_release(&vfs_lock);
+    mutex_unlock(&vfs_lock);
     return (int64_t)len;
 }
 
@@ -388,7 +422,7 @@ int64_t vfs_seek(vfs_handle_t handle, size_t pos, int64_t whence)
     if (!fd)
         return -1;
 
-    lock_lock(&vfs_lock);
+    mutex_lock(&vfs_lock);
 
     int64_t offset = -1;
     switch (whence) {
@@ -417,7 +451,7 @@ int64_t vfs_seek(vfs_handle_t handle, size_t pos, int64_t whence)
         klogd("Seek position out of bounds: %d(0x%x):%d in len %d with "
               "offset %d\n",
               pos, pos, whence, fd->inode->size, fd->seek_pos);
-        lock_release(&vfs_lock);
+        mutex_unlock(&vfs_lock);
         return -1; 
     }
 
@@ -427,7 +461,7 @@ int64_t vfs_seek(vfs_handle_t handle, size_t pos, int64_t whence)
         ret = offset;
     }
 
-    lock_release(&vfs_lock);
+    mutex_unlock(&vfs_lock);
     return ret;
 }
 
@@ -475,14 +509,15 @@ vfs_handle_t vfs_open(char *path, vfs_openmode_t mode)
 {
     klogv("VFS: open %s with mode 0x%8x\n", path, mode);
 
-    lock_lock(&vfs_lock);
+    mutex_lock(&vfs_lock);
 
     /* Find the node */
     vfs_tnode_t* req = vfs_path_to_node(path, NO_CREATE, 0);
     if (!req) {
         klogd("VFS: Cannot find inode for %s\n", path);
         vfs_tnode_t* pn = NULL;
-        char curpath[VFS_MAX_PATH_LEN] = {0}, parent[VFS_MAX_PATH_LEN] = {0};
+        char *curpath = (char*)scratch_push(VFS_MAX_PATH_LEN);
+        char *parent = (char*)scratch_push(VFS_MAX_PATH_LEN);
         strcpy(curpath, path);
         while (true) {
             vfs_get_parent_dir(curpath, parent, NULL);
@@ -495,6 +530,8 @@ vfs_handle_t vfs_open(char *path, vfs_openmode_t mode)
             klogd("VFS: Can not open %s, visit back to %s\n", path, parent);
             req = pn->inode->fs->open(pn->inode, path);
         }
+        scratch_pop(parent);
+        scratch_pop(curpath);
         if (!req) goto fail;
     } else {
         /* OK, move forward to open the file */
@@ -504,11 +541,13 @@ vfs_handle_t vfs_open(char *path, vfs_openmode_t mode)
         }
     }
 
-    req->inode->refcount++;
-
     /* Create node descriptor */
-    vfs_node_desc_t* nd = (vfs_node_desc_t*)kmalloc(sizeof(vfs_node_desc_t));
-    memset(nd, 0, sizeof(vfs_node_desc_t));
+    vfs_node_desc_t* nd = vfs_alloc_node_desc(NULL);
+    if (!nd)
+        goto fail;
+
+    /* Taken with vfs_lock held, so unlink never sees a stale zero */
+    refcount_inc(&req->inode->refcount);
 
     strcpy(nd->path, path);
     nd->tnode = req;
@@ -531,7 +570,7 @@ vfs_handle_t vfs_open(char *path, vfs_openmode_t mode)
         kloge("VFS: cannot insert \"%s\" because of invalid task\n", path);
     }
 
-    lock_release(&vfs_lock);
+    mutex_unlock(&vfs_lock);
 
     if (strcmp(path, "/dev/tty") != 0) {
         klogd("VFS: Open %s with mode 0x%x and return handle %d, "
@@ -543,7 +582,7 @@ vfs_handle_t vfs_open(char *path, vfs_openmode_t mode)
 
     return fh;
 fail:
-    lock_release(&vfs_lock);
+    mutex_unlock(&vfs_lock);
     kloge("VFS: failed when opening %s with mode 0x%8x\n", path, mode);
     return VFS_INVALID_HANDLE;
 }
@@ -552,14 +591,10 @@ int64_t vfs_close(vfs_handle_t handle)
 {
     klogv("VFS: close file handle %d\n", handle);
 
-    lock_lock(&vfs_lock);
-
+    /* The open file table belongs to current task, no global lock needed */
     vfs_node_desc_t *fd = vfs_handle_to_fd(handle);
     if (!fd)
-        goto fail;
-
-    fd->inode->refcount--;
-    kmfree(fd);
+        return -1;
 
     task_t *t = sched_get_current_task();
     if (t != NULL) {
@@ -568,19 +603,28 @@ int64_t vfs_close(vfs_handle_t handle)
         kloge("VFS: cannot remove file %d because of invalid task\n", handle);
     }
 
-    /* Remove this file if needed */
-    if (fd->inode->refcount == 0 && fd->tnode->st.st_nlink == 0) {
-        if (fd->inode->fs->rmnode != NULL) {
+    /*
+     * Only the last reference is dropped with vfs_lock held, since open and
+     * unlink check the count under the same lock.
+     */
+    vfs_inode_t *inode = fd->inode;
+    if (!refcount_dec_not_one(&inode->refcount)) {
+        mutex_lock(&vfs_lock);
+        /* Remove this file if needed */
+        if (refcount_dec_and_test(&inode->refcount)
+            && fd->tnode->st.st_nlink == 0 && inode->fs->rmnode != NULL)
+        {
             klogd("VFS: close \"%s\" and remove tnode\n", fd->path);
-            fd->inode->fs->rmnode(fd->tnode);
+            lock_lock(&vfs_tree_lock);
+            inode->fs->rmnode(fd->tnode);
+            lock_release(&vfs_tree_lock);
         }
+        mutex_unlock(&vfs_lock);
     }
 
-    lock_release(&vfs_lock);
+    vfs_free_node_desc(fd);
+
     return 0;
-fail:
-    lock_release(&vfs_lock);
-    return -1;
 }
 
 int64_t vfs_refresh(vfs_handle_t handle)
@@ -589,13 +633,13 @@ int64_t vfs_refresh(vfs_handle_t handle)
     if (!fd)
         return -1; 
 
-    lock_lock(&vfs_lock);
+    mutex_lock(&vfs_lock);
     fd->inode->fs->refresh(fd->inode);
+    char *path = (char*)scratch_push(VFS_MAX_PATH_LEN);
     for (size_t i = 0; ; i++) {
         vfs_dirent_t de;
         if (fd->inode->fs->getdent(fd->inode, i, &de)) break;
 
-        char path[VFS_MAX_PATH_LEN] = {0};
         strcpy(path, fd->path);
         strcat(path, "/");
         strcat(path, de.name);
@@ -603,7 +647,8 @@ int64_t vfs_refresh(vfs_handle_t handle)
         memcpy(&tn->inode->tm, &de.tm, sizeof(tm_t));
         tn->inode->size = de.size;
     }
-    lock_release(&vfs_lock);
+    scratch_pop(path);
+    mutex_unlock(&vfs_lock);
 
     return 0;
 }
@@ -615,7 +660,7 @@ int64_t vfs_getdent(vfs_handle_t handle, vfs_dirent_t* dirent) {
     if (!fd)
         return -1;
 
-    lock_lock(&vfs_lock);
+    rcu_read_lock();
 
     /* Can only traverse folders */
     if (!IS_TRAVERSABLE(fd->inode)) {
@@ -627,13 +672,14 @@ int64_t vfs_getdent(vfs_handle_t handle, vfs_dirent_t* dirent) {
     /* Need to make sure that we alreay load all children here */
 
     /* We've reached the end */
-    if (fd->seek_pos >= fd->inode->child.len) {
+    vfs_child_list_t *cl = rcu_dereference(fd->inode->child);
+    if (fd->seek_pos >= vfs_child_count(cl)) {
         status = 0;
         goto done;
     }
 
     /* Initialize the dirent */
-    vfs_tnode_t* entry = vec_at(&(fd->inode->child), fd->seek_pos);
+    vfs_tnode_t* entry = cl->nodes[fd->seek_pos];
     dirent->type = entry->inode->type;
     memcpy(dirent->name, entry->name, sizeof(entry->name));
     memcpy(&dirent->tm, &entry->inode->tm, sizeof(tm_t));
@@ -643,7 +689,7 @@ int64_t vfs_getdent(vfs_handle_t handle, vfs_dirent_t* dirent) {
     fd->seek_pos++;
 
 done:
-    lock_release(&vfs_lock);
+    rcu_read_unlock();
     return status;
 }
 
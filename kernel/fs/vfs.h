@@ -26,6 +26,8 @@
 #include <stdint.h>
 #include <base/vector.h>
 #include <base/time.h>
+#include <base/refcount.h>
+#include <proc/rcu.h>
 
 /* Some limits */
 #define VFS_MAX_PATH_LEN    4096
@@ -185,22 +187,35 @@ struct vfs_tnode_t {
     vfs_inode_t *parent;
 };
 
+/*
+ * Children of a folder. Readers walk it in RCU read-side section. Writers
+ * append in place while there is room, otherwise they publish a new copy.
+ */
+typedef struct {
+    rcu_head_t rcu;
+    size_t capacity;
+    size_t len;
+    vfs_tnode_t *nodes[];
+} vfs_child_list_t;
+
 struct vfs_inode_t {
     vfs_node_type_t type;           /* File type */
     char link[VFS_MAX_NAME_LEN];    /* Target file if file is symlink */
     size_t size;                    /* File size */
     uint32_t perms;                 /* File permission, modified by chmod */
     uint32_t uid;                   /* User id */
-    uint32_t refcount;              /* Reference count, used by symlink */
+    refcount_t refcount;            /* Open handles in all tasks */
     tm_t tm;
     vfs_fsinfo_t* fs;
     void* ident;
     vfs_tnode_t* mountpoint;
-    vec_struct(vfs_tnode_t*) child;
+    vfs_child_list_t* child;        /* Published by RCU, NULL if empty */
+    rcu_head_t rcu;
 };
 
 typedef struct {
     char path[VFS_MAX_PATH_LEN];
+    refcount_t refcount;            /* Tasks sharing it after fork */
     vfs_tnode_t *tnode;
     vfs_inode_t *inode;
     vfs_openmode_t mode;
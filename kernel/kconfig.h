@@ -7,7 +7,10 @@
 
 #undef  ENABLE_KLOG_DEBUG
 #undef  ENABLE_MEM_DEBUG
+#undef  ENABLE_LOCK_STAT
+#undef  ENABLE_IRQSOFF_TRACE
 #undef  ENABLE_BASH
+#undef  ENABLE_KERNEL_TEST
 
 #ifndef ENABLE_BASH
 #define DEFAULT_SHELL_APP       "/bin/init"
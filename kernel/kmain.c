@@ -34,6 +34,7 @@
 #include <base/time.h>
 #include <base/image.h>
 #include <base/klog.h>
+#include <base/kmalloc.h>
 #include <sys/mm.h>
 #include <sys/gdt.h>
 #include <sys/idt.h>
@@ -60,6 +61,7 @@
 #include <fs/ttyfs.h>
 #include <fs/pipefs.h>
 #include <proc/elf.h>
+#include <test.h>
 
 LIMINE_BASE_REVISION(1)
 
@@ -169,6 +171,13 @@ _Noreturn void kshell(task_id_t tid)
                 self_info.actual_res_x, self_info.actual_res_y);
     }   
 
+#ifdef ENABLE_KERNEL_TEST
+    size_t failed = kernel_test();
+    if (failed > 0) {
+        kpanic("%d kernel tests failed\n", failed);
+    }
+#endif
+
     /* Start all programs */
 #ifdef ENABLE_BASH
     const char *argv[] = { "/usr/bin/bash", "--login", NULL };
@@ -236,6 +245,7 @@ void kmain(void)
     idt_init();
 
     pmm_init(mm_request.response);
+    kmalloc_init();
     vmm_init(mm_request.response, kernel_addr_request.response);
 
     term_start();
@@ -16,7 +16,7 @@
 
 static bool debug_info = false;
 
-extern lock_t sched_lock;
+extern rwlock_t sched_lock;
 
 int elf_find_symbol_table(elf_hdr_t *hdr, elf_shdr_t *shdr)
 {
@@ -58,7 +58,7 @@ int64_t elf_load(
     elf_shdr_t *shdr = NULL;
     uint64_t *phaddr = NULL;
 
-    mem_map_t m;
+    mem_map_t m = {0};
     m.flags = VMM_FLAGS_DEFAULT | VMM_FLAGS_USERMODE;
 
     const char* fn = path_name;
@@ -224,7 +224,7 @@ int64_t elf_load(
                   page_count);
         }
 
-        mem_map_t m1;
+        mem_map_t m1 = {0};
         m1.vaddr = virt;
         m1.paddr = addr;
         m1.np = page_count;
@@ -28,6 +28,9 @@ bool eb_publish(task_id_t tid, event_type_t type, event_para_t para)
     vec_push_back(&eb_publishers, e);
     lock_release(&eb_lock);    
 
+    /* Events are dispatched in context switches, which need a tick */
+    sched_kick_current();
+
     if (eb_debug) {
         klogi("EB: task id %d published  para 0x%8x with type 0x%8x "
               "and millis %d, ticks %d\n",
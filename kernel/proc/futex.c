@@ -0,0 +1,228 @@
+/**-----------------------------------------------------------------------------
+
+ @file    futex.c
+ @brief   Implementation of futex related functions
+ @details
+ @verbatim
+
+  Lock order is futex bucket lock first, then sched_lock, the same as wait
+  queues. The futex word is compared while its bucket is locked, and wakers
+  take the same lock, so a wakeup between the check and the sleep is never
+  lost.
+
+  A waiter entry lives on the waiter's stack. Wakers dequeue it before the
+  task is marked ready, so a waiter which finds its entry still queued after
+  sched_suspend() returns has timed out. Requeue may move an entry to another
+  bucket, the waiter retries until it holds the lock of its current bucket.
+
+ @endverbatim
+
+ **-----------------------------------------------------------------------------
+ */
+#include <libc/errno.h>
+
+#include <sys/mm.h>
+#include <proc/futex.h>
+#include <proc/sched.h>
+
+#define FUTEX_USER_LIMIT    0x0000800000000000ULL
+
+static futex_bucket_t futex_table[FUTEX_HASH_SIZE] = {0};
+
+static futex_bucket_t *futex_bucket(uint64_t key)
+{
+    /* Fibonacci hashing, the low 2 bits of an aligned word are always 0 */
+    uint64_t h = (key >> 2) * 0x9E3779B97F4A7C15ULL;
+    return &futex_table[(h >> 32) % FUTEX_HASH_SIZE];
+}
+
+/* Physical address of the futex word, or 0 if it is not a mapped user word */
+static uint64_t futex_key(int32_t *uaddr)
+{
+    uint64_t vaddr = (uint64_t)uaddr;
+    task_t *t = sched_get_current_task();
+
+    if (vaddr == 0 || (vaddr & (sizeof(int32_t) - 1)) != 0)
+        return 0;
+
+    /* Only the lower half belongs to userspace */
+    if (vaddr >= FUTEX_USER_LIMIT)
+        return 0;
+
+    uint64_t paddr = vmm_get_paddr(t != NULL ? t->addrspace : NULL, vaddr);
+    if (paddr == 0)
+        return 0;
+
+    return paddr + (vaddr & (PAGE_SIZE - 1));
+}
+
+static void futex_enqueue(futex_bucket_t *b, futex_waiter_t *w)
+{
+    w->next = NULL;
+    if (b->tail == NULL) {
+        b->head = w;
+    } else {
+        b->tail->next = w;
+    }
+    b->tail = w;
+    w->queued = true;
+}
+
+static void futex_dequeue(futex_bucket_t *b, futex_waiter_t *prev,
+                          futex_waiter_t *w)
+{
+    if (prev == NULL) {
+        b->head = w->next;
+    } else {
+        prev->next = w->next;
+    }
+    if (b->tail == w) b->tail = prev;
+    w->next = NULL;
+    w->queued = false;
+}
+
+/* Lock the bucket the waiter is in now, it may be moved by requeue */
+static futex_bucket_t *futex_lock_waiter(futex_waiter_t *w)
+{
+    while (true) {
+        uint64_t key = __atomic_load_n(&w->key, __ATOMIC_ACQUIRE);
+        futex_bucket_t *b = futex_bucket(key);
+
+        lock_lock(&b->lock);
+        if (w->key == key) return b;
+        lock_release(&b->lock);
+    }
+}
+
+/* Lock two buckets in address order, they may be the same one */
+static void futex_lock_pair(futex_bucket_t *b1, futex_bucket_t *b2)
+{
+    if (b1 == b2) {
+        lock_lock(&b1->lock);
+    } else if (b1 < b2) {
+        lock_lock(&b1->lock);
+        lock_lock(&b2->lock);
+    } else {
+        lock_lock(&b2->lock);
+        lock_lock(&b1->lock);
+    }
+}
+
+static void futex_unlock_pair(futex_bucket_t *b1, futex_bucket_t *b2)
+{
+    if (b1 == b2) {
+        lock_release(&b1->lock);
+    } else if (b1 < b2) {
+        lock_release(&b2->lock);
+        lock_release(&b1->lock);
+    } else {
+        lock_release(&b1->lock);
+        lock_release(&b2->lock);
+    }
+}
+
+/*
+ * Sleep if *uaddr still equals expected, for at most millis (0 means waiting
+ * forever). Returns 0 when woken, or -EAGAIN, -ETIMEDOUT, -EFAULT.
+ */
+int64_t futex_wait(int32_t *uaddr, int32_t expected, time_t millis)
+{
+    futex_waiter_t w = {0};
+
+    w.task = sched_get_current_task();
+    if (w.task == NULL) return -EINVAL;
+
+    w.key = futex_key(uaddr);
+    if (w.key == 0) return -EFAULT;
+
+    futex_bucket_t *b = futex_bucket(w.key);
+
+    lock_lock(&b->lock);
+    if (__atomic_load_n(uaddr, __ATOMIC_ACQUIRE) != expected) {
+        lock_release(&b->lock);
+        return -EAGAIN;
+    }
+    futex_enqueue(b, &w);
+    sched_prepare_suspend(w.task, millis);
+    lock_release(&b->lock);
+
+    sched_suspend();
+
+    int64_t ret = 0;
+
+    b = futex_lock_waiter(&w);
+    if (w.queued) {
+        futex_waiter_t *prev = NULL;
+        for (futex_waiter_t *it = b->head; it != &w; it = it->next)
+            prev = it;
+        futex_dequeue(b, prev, &w);
+        ret = -ETIMEDOUT;
+    }
+    lock_release(&b->lock);
+
+    sched_cancel_suspend(w.task);
+
+    return ret;
+}
+
+/* Wake at most nr_wake waiters of uaddr, returns the number woken */
+int64_t futex_wake(int32_t *uaddr, int64_t nr_wake)
+{
+    return futex_requeue(uaddr, nr_wake, NULL, 0);
+}
+
+/*
+ * Wake at most nr_wake waiters of uaddr and move at most nr_requeue of the
+ * remaining ones to uaddr2 without waking them, e.g., a condition broadcast
+ * wakes one waiter and requeues the rest to the mutex. Returns the number of
+ * waiters woken or requeued.
+ */
+int64_t futex_requeue(int32_t *uaddr, int64_t nr_wake,
+                      int32_t *uaddr2, int64_t nr_requeue)
+{
+    uint64_t key = futex_key(uaddr);
+    if (key == 0) return -EFAULT;
+
+    if (nr_wake < 0) nr_wake = 0;
+    if (nr_requeue < 0) nr_requeue = 0;
+
+    /* Requeueing onto the same word would move the waiters behind the walk
+     * forever, only wake them then
+     */
+    uint64_t key2 = key;
+    if (nr_requeue > 0) {
+        key2 = futex_key(uaddr2);
+        if (key2 == 0) return -EFAULT;
+        if (key2 == key) nr_requeue = 0;
+    }
+
+    futex_bucket_t *b = futex_bucket(key);
+    futex_bucket_t *b2 = futex_bucket(key2);
+    int64_t woken = 0, requeued = 0;
+
+    futex_lock_pair(b, b2);
+
+    futex_waiter_t *prev = NULL, *it = b->head;
+    while (it != NULL && (woken < nr_wake || requeued < nr_requeue)) {
+        futex_waiter_t *next = it->next;
+
+        if (it->key != key) {
+            prev = it;
+        } else if (woken < nr_wake) {
+            futex_dequeue(b, prev, it);
+            sched_wakeup(it->task);
+            woken++;
+        } else {
+            futex_dequeue(b, prev, it);
+            __atomic_store_n(&it->key, key2, __ATOMIC_RELEASE);
+            futex_enqueue(b2, it);
+            requeued++;
+        }
+        it = next;
+    }
+
+    futex_unlock_pair(b, b2);
+
+    return woken + requeued;
+}
+
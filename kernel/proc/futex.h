@@ -0,0 +1,48 @@
+/**-----------------------------------------------------------------------------
+
+ @file    futex.h
+ @brief   Definition of futex related data structures and functions
+ @details
+ @verbatim
+
+  A futex is a 32-bit word in user memory. Userspace handles the uncontended
+  case with atomics and only enters the kernel to sleep on the word or to
+  wake its waiters.
+
+  Waiters are kept in a fixed hash table of buckets. The key is the physical
+  address of the word, so tasks which map the same page at different virtual
+  addresses (e.g., a MAP_SHARED block after fork) meet in the same bucket.
+
+ @endverbatim
+
+ **-----------------------------------------------------------------------------
+ */
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include <base/lock.h>
+#include <base/time.h>
+#include <proc/task.h>
+
+#define FUTEX_HASH_SIZE     64
+
+typedef struct futex_waiter {
+    uint64_t key;
+    task_t *task;
+    struct futex_waiter *next;
+    volatile bool queued;
+} futex_waiter_t;
+
+typedef struct {
+    lock_t lock;
+    futex_waiter_t *head;
+    futex_waiter_t *tail;
+} futex_bucket_t;
+
+int64_t futex_wait(int32_t *uaddr, int32_t expected, time_t millis);
+int64_t futex_wake(int32_t *uaddr, int64_t nr_wake);
+int64_t futex_requeue(int32_t *uaddr, int64_t nr_wake,
+                      int32_t *uaddr2, int64_t nr_requeue);
+
@@ -0,0 +1,70 @@
+/**-----------------------------------------------------------------------------
+
+ @file    mutex.c
+ @brief   Implementation of sleeping mutex related functions
+ @details
+ @verbatim
+
+  The waiter is queued while the internal spinlock is held, so an unlock
+  between the check and the sleep always finds it in the wait queue.
+
+ @endverbatim
+
+ **-----------------------------------------------------------------------------
+ */
+#include <proc/mutex.h>
+#include <proc/sched.h>
+
+void mutex_lock(mutex_t *m)
+{
+    task_t *curr = sched_get_current_task();
+
+    /* Catch callers in atomic context even if the mutex is free now */
+    if (curr != NULL) waitq_might_sleep();
+
+    while (true) {
+        waitq_entry_t e;
+
+        lock_lock(&m->lock);
+        if (!m->locked) {
+            m->locked = true;
+            m->owner = curr;
+            lock_release(&m->lock);
+            return;
+        }
+        if (curr == NULL) {
+            lock_release(&m->lock);
+            asm volatile("pause");
+            continue;
+        }
+        waitq_prepare(&m->wq, &e, 0);
+        lock_release(&m->lock);
+
+        waitq_wait(&m->wq, &e);
+    }
+}
+
+bool mutex_trylock(mutex_t *m)
+{
+    bool ret = false;
+
+    lock_lock(&m->lock);
+    if (!m->locked) {
+        m->locked = true;
+        m->owner = sched_get_current_task();
+        ret = true;
+    }
+    lock_release(&m->lock);
+
+    return ret;
+}
+
+void mutex_unlock(mutex_t *m)
+{
+    lock_lock(&m->lock);
+    m->locked = false;
+    m->owner = NULL;
+    waitq_wake_one(&m->wq);
+    lock_release(&m->lock);
+}
+
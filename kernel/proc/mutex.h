@@ -0,0 +1,38 @@
+/**-----------------------------------------------------------------------------
+
+ @file    mutex.h
+ @brief   Definition of sleeping mutex related data structures and functions
+ @details
+ @verbatim
+
+  Unlike lock_t, a waiter of mutex_t gives up CPU instead of spinning with
+  interrupts disabled, so it suits locks which are held for a long time,
+  e.g., across disk I/O. A mutex must not be taken while holding a spinlock
+  or in interrupt context, mutex_lock() panics if a spinlock is held. Before
+  the scheduler starts, waiters spin.
+
+ @endverbatim
+
+ **-----------------------------------------------------------------------------
+ */
+#pragma once
+
+#include <stdbool.h>
+
+#include <base/lock.h>
+#include <proc/task.h>
+#include <proc/waitq.h>
+
+typedef struct {
+    lock_t lock;
+    volatile bool locked;
+    task_t *owner;
+    waitq_t wq;
+} mutex_t;
+
+#define mutex_new()     (mutex_t){0}
+
+void mutex_lock(mutex_t *m);
+bool mutex_trylock(mutex_t *m);
+void mutex_unlock(mutex_t *m);
+
@@ -0,0 +1,180 @@
+/**-----------------------------------------------------------------------------
+
+ @file    rcu.c
+ @brief   Implementation of read-copy-update related functions
+ @details
+ @verbatim
+
+  Every grace period request bumps rcu_gp_seq. A CPU which passes a
+  quiescent state, i.e., switches tasks or idles outside any read-side
+  section, copies the current sequence into its own slot. A grace period
+  is over once the slots of all online CPUs caught up with it, since each
+  of them has left every read-side section which started before.
+
+  The read-side nesting count lives in the task, so it follows the task,
+  and the scheduler keeps such task on its CPU until it reaches zero.
+
+ @endverbatim
+
+ **-----------------------------------------------------------------------------
+ */
+#include <base/lock.h>
+#include <sys/cpu.h>
+#include <sys/smp.h>
+#include <sys/panic.h>
+#include <proc/rcu.h>
+#include <proc/sched.h>
+
+static volatile uint64_t rcu_gp_seq = 0;
+static volatile uint64_t rcu_qs_seq[CPU_MAX] = {0};
+static volatile bool rcu_online[CPU_MAX] = {0};
+
+/* Callbacks are queued in the order of their grace periods */
+static lock_t rcu_cb_lock = {0};
+static rcu_head_t *rcu_cb_head = NULL;
+static rcu_head_t *rcu_cb_tail = NULL;
+
+void rcu_read_lock(void)
+{
+    /* Interrupts are disabled so that the task is not moved to another CPU */
+    uint64_t rflags = irq_save();
+    task_t *t = sched_get_current_task();
+    if (t != NULL) t->rcu_nesting++;
+    irq_restore(rflags);
+}
+
+void rcu_read_unlock(void)
+{
+    uint64_t rflags = irq_save();
+    task_t *t = sched_get_current_task();
+    if (t != NULL) {
+        if (t->rcu_nesting == 0)
+            kpanic("RCU: tid %d unlocks without read lock\n", t->tid);
+        t->rcu_nesting--;
+    }
+    irq_restore(rflags);
+}
+
+void rcu_cpu_online(uint16_t cpu_id)
+{
+    rcu_qs_seq[cpu_id] = __atomic_load_n(&rcu_gp_seq, __ATOMIC_SEQ_CST);
+    __atomic_store_n(&rcu_online[cpu_id], true, __ATOMIC_SEQ_CST);
+}
+
+/*
+ * A CPU which halts without ticks, e.g., in tickless idle, is quiescent all
+ * the time, so grace periods do not wait for it until it comes back.
+ */
+void rcu_idle_enter(uint16_t cpu_id)
+{
+    __atomic_store_n(&rcu_online[cpu_id], false, __ATOMIC_SEQ_CST);
+}
+
+void rcu_idle_exit(uint16_t cpu_id)
+{
+    rcu_cpu_online(cpu_id);
+}
+
+/* Callbacks only run in idle tasks, which must not stop ticks for them */
+bool rcu_callbacks_pending(void)
+{
+    return __atomic_load_n(&rcu_cb_head, __ATOMIC_RELAXED) != NULL;
+}
+
+/* The caller must make sure that the CPU is outside any read-side section */
+void rcu_note_qs(uint16_t cpu_id)
+{
+    uint64_t seq = __atomic_load_n(&rcu_gp_seq, __ATOMIC_SEQ_CST);
+    if (rcu_qs_seq[cpu_id] != seq)
+        __atomic_store_n(&rcu_qs_seq[cpu_id], seq, __ATOMIC_SEQ_CST);
+}
+
+/* Report a quiescent state of the current CPU, e.g., from idle tasks */
+void rcu_quiescent(void)
+{
+    uint64_t rflags = irq_save();
+    cpu_t *cpu = smp_get_current_cpu(false);
+    task_t *t = sched_get_current_task();
+    if (cpu != NULL && (t == NULL || t->rcu_nesting == 0))
+        rcu_note_qs(cpu->cpu_id);
+    irq_restore(rflags);
+}
+
+static bool rcu_gp_done(uint64_t seq)
+{
+    for (size_t i = 0; i < CPU_MAX; i++) {
+        if (!__atomic_load_n(&rcu_online[i], __ATOMIC_SEQ_CST))
+            continue;
+        if (__atomic_load_n(&rcu_qs_seq[i], __ATOMIC_SEQ_CST) < seq)
+            return false;
+    }
+    return true;
+}
+
+/* Wait until all read-side sections which are running now have finished */
+void synchronize_rcu(void)
+{
+    uint64_t seq = __atomic_add_fetch(&rcu_gp_seq, 1, __ATOMIC_SEQ_CST);
+    task_t *t = sched_get_current_task();
+
+    if (t != NULL && t->rcu_nesting > 0)
+        kpanic("RCU: tid %d waits for a grace period in read lock\n", t->tid);
+
+    /* Our own CPU reports its quiescent state when we switch away */
+    rcu_quiescent();
+    while (!rcu_gp_done(seq)) {
+        if (t != NULL) {
+            sched_sleep(1);
+        } else {
+            asm volatile("pause");
+        }
+    }
+}
+
+/* Call func(head) after a grace period, head is usually embedded in the
+ * object to be freed. Callbacks run in idle tasks.
+ */
+void call_rcu(rcu_head_t *head, void (*func)(rcu_head_t *head))
+{
+    head->func = func;
+    head->next = NULL;
+
+    lock_lock(&rcu_cb_lock);
+    head->seq = __atomic_add_fetch(&rcu_gp_seq, 1, __ATOMIC_SEQ_CST);
+    if (rcu_cb_tail == NULL) {
+        rcu_cb_head = head;
+    } else {
+        rcu_cb_tail->next = head;
+    }
+    rcu_cb_tail = head;
+    lock_release(&rcu_cb_lock);
+}
+
+/* Run the callbacks whose grace periods are over */
+void rcu_process_callbacks(void)
+{
+    rcu_head_t *done = NULL, *last = NULL;
+
+    lock_lock(&rcu_cb_lock);
+    while (rcu_cb_head != NULL && rcu_gp_done(rcu_cb_head->seq)) {
+        rcu_head_t *head = rcu_cb_head;
+        rcu_cb_head = head->next;
+        if (rcu_cb_head == NULL) rcu_cb_tail = NULL;
+
+        head->next = NULL;
+        if (last == NULL) {
+            done = head;
+        } else {
+            last->next = head;
+        }
+        last = head;
+    }
+    lock_release(&rcu_cb_lock);
+
+    while (done != NULL) {
+        rcu_head_t *next = done->next;
+        done->func(done);
+        done = next;
+    }
+}
+
@@ -0,0 +1,55 @@
+/**-----------------------------------------------------------------------------
+
+ @file    rcu.h
+ @brief   Definition of read-copy-update related data structures and functions
+ @details
+ @verbatim
+
+  RCU lets readers walk shared data without any lock or atomic write:
+
+      rcu_read_lock();
+      p = rcu_dereference(head);
+      ... read *p ...
+      rcu_read_unlock();
+
+  Writers still serialize with a lock. They publish a new version with
+  rcu_assign_pointer() and free the old one only after a grace period, i.e.,
+  after every CPU passed a quiescent state, by synchronize_rcu() or
+  call_rcu().
+
+  A task in a read-side section is not preempted by the timer and must not
+  sleep. Quiescent states are reported by context switches and idle tasks,
+  which also run the callbacks of call_rcu().
+
+ @endverbatim
+
+ **-----------------------------------------------------------------------------
+ */
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+typedef struct rcu_head {
+    struct rcu_head *next;
+    uint64_t seq;                       /* Grace period to wait for */
+    void (*func)(struct rcu_head *head);
+} rcu_head_t;
+
+#define rcu_dereference(p)          __atomic_load_n(&(p), __ATOMIC_CONSUME)
+#define rcu_assign_pointer(p, v)    __atomic_store_n(&(p), (v), __ATOMIC_RELEASE)
+
+void rcu_read_lock(void);
+void rcu_read_unlock(void);
+
+void synchronize_rcu(void);
+void call_rcu(rcu_head_t *head, void (*func)(rcu_head_t *head));
+
+void rcu_cpu_online(uint16_t cpu_id);
+void rcu_idle_enter(uint16_t cpu_id);
+void rcu_idle_exit(uint16_t cpu_id);
+bool rcu_callbacks_pending(void);
+void rcu_note_qs(uint16_t cpu_id);
+void rcu_quiescent(void);
+void rcu_process_callbacks(void);
+
@@ -7,6 +7,43 @@
 
   Context Switching, Scheduling Algorithms etc.
 
+  Each CPU has its own run queue holding the tasks which are not running.
+  A context switch only locks the queue of its own CPU. If nothing there is
+  runnable, the CPU steals a runnable task from the queue of another CPU, so
+  idle CPUs pull work from busy ones.
+
+  Scheduling is weighted fair like CFS. A task's virtual runtime grows by
+  its runtime divided by the weight of its priority (nice value), and the
+  ready tasks are kept in a red-black tree ordered by it, so the leftmost
+  one, which got the least CPU time, runs next. On a timer tick the current
+  task keeps running until it used its share of SCHED_LATENCY, unless a
+  woken up task is behind it by more than SCHED_WAKEUP_GRANULARITY.
+  Sleeping, suspended and exiting tasks stay in a blocked list. Wakers move
+  a task into the ready tree directly, and a task with a wakeup time has a
+  timer in the hierarchical timer wheel of its queue, which is advanced on
+  every context switch, so sleepers cost nothing until they expire. The
+  wheel only resolves ticks. Timers whose tick has come move to a short due
+  list sorted by wakeup time, and a timer event is armed for the first one,
+  so sleepers wake up at their exact time rather than at the next tick.
+
+  An idle CPU with nothing to run or steal stops its periodic tick and
+  programs a one-shot timer for the first timer of its queue. CPUs which
+  queue a task kick it with an IPI, and the tick restarts in the context
+  switch. The "sched.ticks" counter shows how many interrupts are saved.
+
+  A task only runs on the CPUs in its cpus_allowed mask. Stealers skip tasks
+  which may not run on them. A task found on a CPU it is not allowed on, e.g.,
+  after its mask was changed or when it was woken up, is migrated to the
+  shortest allowed queue when it would be picked, keeping its lag.
+
+  Task status is changed with atomic operations, so wakers do not need the
+  queue lock. sched_lock protects the task list, child lists and memory maps,
+  and is taken before any run queue lock.
+
+  Tasks are indexed by tid in a radix tree, and each task links its children,
+  so lookups and waits do not walk all tasks. Both are RCU protected and
+  updated together with the task list.
+
   History:
   Apr 20, 2022 - 1. Redesign the task queue based on vector data structue.
                  2. Scheduler starts working after all processors are launched
@@ -24,50 +61,115 @@
 #include <base/kmalloc.h>
 #include <base/vector.h>
 #include <base/hash.h>
+#include <base/counter.h>
+#include <base/rbtree.h>
+#include <base/twheel.h>
+#include <base/radix.h>
 #include <proc/sched.h>
 #include <proc/elf.h>
 #include <proc/eventbus.h>
+#include <proc/rcu.h>
+#include <fs/filebase.h>
 #include <sys/smp.h>
 #include <sys/timer.h>
 #include <sys/apic.h>
+#include <sys/idt.h>
 #include <sys/hpet.h>
 #include <sys/pit.h>
 #include <sys/isr_base.h>
 #include <sys/panic.h>
 #include <sys/cpu.h>
+#include <sys/fpu.h>
 
 #define TIMESLICE_DEFAULT       MILLIS_TO_NANOS(1)
 
-lock_t sched_lock = lock_new();
+/* Every runnable task should get CPU once within the latency */
+#define SCHED_LATENCY               MILLIS_TO_NANOS(6)
+#define SCHED_MIN_GRANULARITY       TIMESLICE_DEFAULT
+#define SCHED_WAKEUP_GRANULARITY    MILLIS_TO_NANOS(1)
+#define SCHED_WEIGHT_NICE0          1024
+
+/* Longest halt of a tickless idle CPU without any timer */
+#define SCHED_NOHZ_MAX              MILLIS_TO_NANOS(1000)
+
+/* The tick a time falls in, the due list resolves the rest */
+#define sched_nanos_to_ticks(ns)    ((ns) / TIMESLICE_DEFAULT)
+
+rwlock_t sched_lock = rwlock_new();
+
+/* Woken up whenever a task becomes dying or dead */
+waitq_t sched_exit_wq = {0};
+
+/*
+ * Tasks of a CPU which are not running. Runnable ones are in the tree ordered
+ * by virtual runtime, the others are in the blocked list linked by rq_next.
+ * Blocked tasks with a wakeup time also have a timer in the wheel.
+ */
+typedef struct {
+    lock_t lock;
+    rb_root_t ready;
+    task_t *blocked;
+    twheel_t timers;                /* Ticks of TIMESLICE_DEFAULT */
+    task_t *due;                    /* Timers of past ticks by wakeup time */
+    uint64_t clock;                 /* When the wheel was last advanced */
+    uint64_t load;                  /* Sum of the weights of ready tasks */
+    uint64_t min_vruntime;
+    volatile size_t nr;             /* Number of ready tasks */
+} sched_rq_t;
 
 static task_t* tasks_running[CPU_MAX] = {0};
 static task_t* tasks_idle[CPU_MAX] = {0};
-static uint64_t tasks_coordinate[CPU_MAX] = {0};
+static sched_rq_t sched_rqs[CPU_MAX] = {0};
+static counter_t sched_switches = counter_new("sched.switches");
+static counter_t sched_steals = counter_new("sched.steals");
+static counter_t sched_ticks = counter_new("sched.ticks");
+static counter_t sched_kicks = counter_new("sched.kicks");
+static counter_t sched_nohz_entries = counter_new("sched.nohz");
+static counter_t sched_migrations = counter_new("sched.migrations");
+
+/* Idle CPUs whose periodic tick is stopped, they are woken up by IPIs */
+static volatile bool sched_nohz[CPU_MAX] = {0};
+static uint8_t sched_lapic_ids[CPU_MAX] = {0};
+static uint8_t sched_ipi_vector = 0;
 
 static volatile uint16_t cpu_num = 0;
 
-vec_new_static(task_t*, tasks_active);
+/* Every task including idle ones, lookups walk it as RCU readers */
+static task_t *tasks_all = NULL;
+static radix_tree_t tasks_index = radix_new();
 
 extern void enter_context_switch(void* v);
-extern void exit_context_switch(task_t* next, uint64_t cr3val);
+extern void exit_context_switch(void *stack, uint64_t cr3val,
+                                volatile bool *prev_on_cpu);
 extern void force_context_switch(void);
 extern void fork_context_switch(void);
 
 void sched_debug(bool showlog)
 {
-    lock_lock(&sched_lock);
+    uint64_t rflags = rwlock_read_lock(&sched_lock);
 
-    size_t task_num = vec_length(&tasks_active);
+    size_t task_num = 0;
+
+    for (size_t k = 0; k < CPU_MAX; k++) {
+        sched_rq_t *rq = &sched_rqs[k];
+        lock_lock(&rq->lock);
+        for (rb_node_t *n = rb_first(&rq->ready); n != NULL; n = rb_next(n)) {
+            task_t *t = rb_entry(n, task_t, rq_node);
+            if (t->tid < 1)
+                kpanic("SCHED: task tree corrupted (%d 0x%x)\n", showlog, t);
+            task_num++;
+        }
+        for (task_t *t = rq->blocked; t != NULL; t = t->rq_next) {
+            if (t->tid < 1)
+                kpanic("SCHED: task list corrupted (%d 0x%x)\n", showlog, t);
+            task_num++;
+        }
+        lock_release(&rq->lock);
+    }
 
     if (showlog)
         klogd("SCHED: Totally %d active tasks\n", task_num);
 
-    for (size_t i = 0; i < task_num; i++) {
-        task_t *t  = vec_at(&tasks_active, i);
-        if (t->tid < 1)
-            kpanic("SCHED: task list corrupted (%d 0x%x)\n", showlog, t);
-    }
-
     for (size_t k = 0; k < CPU_MAX; k++) {
         if (tasks_running[k] != NULL && tasks_running[k] != tasks_idle[k]) {
             if (showlog) {
@@ -91,7 +193,498 @@ void sched_debug(bool showlog)
 
     }
 
-    lock_release(&sched_lock);
+    rwlock_read_release(&sched_lock, rflags);
+}
+
+/* Must be called with sched_lock held for writing */
+static void task_list_add(task_t *t)
+{
+    if (!radix_insert(&tasks_index, t->tid, t))
+        kpanic("SCHED: cannot index tid %d\n", t->tid);
+
+    task_t *tp = (t->ptid != TID_MAX) ? radix_lookup(&tasks_index, t->ptid) : NULL;
+    if (tp != NULL) {
+        t->sibling = tp->children;
+        rcu_assign_pointer(tp->children, t);
+    }
+
+    t->all_next = tasks_all;
+    rcu_assign_pointer(tasks_all, t);
+}
+
+/*
+ * Must be called with sched_lock held, readers may still see the task.
+ * Returns its parent, NULL if the parent is already gone.
+ */
+static task_t *task_list_del(task_t *t)
+{
+    task_t **pp = &tasks_all;
+    while (*pp != NULL) {
+        if (*pp == t) {
+            rcu_assign_pointer(*pp, t->all_next);
+            break;
+        }
+        pp = &(*pp)->all_next;
+    }
+
+    radix_delete(&tasks_index, t->tid);
+
+    task_t *tp = (t->ptid != TID_MAX) ? radix_lookup(&tasks_index, t->ptid) : NULL;
+    if (tp != NULL) {
+        for (pp = &tp->children; *pp != NULL; pp = &(*pp)->sibling) {
+            if (*pp == t) {
+                rcu_assign_pointer(*pp, t->sibling);
+                break;
+            }
+        }
+    }
+
+    return tp;
+}
+
+static void task_free_rcu(rcu_head_t *head)
+{
+    task_free((task_t*)((uint8_t*)head - offsetof(task_t, rcu)));
+}
+
+/* Weights of nice -20..19, each step changes the CPU share by about 10% */
+static const uint32_t sched_prio_to_weight[TASK_NICE_MAX - TASK_NICE_MIN + 1] = {
+    88761, 71755, 56483, 46273, 36291, 29154, 23254, 18705, 14949, 11916,
+     9548,  7620,  6100,  4904,  3906,  3121,  2501,  1991,  1586,  1277,
+     1024,   820,   655,   526,   423,   335,   272,   215,   172,   137,
+      110,    87,    70,    56,    45,    36,    29,    23,    18,    15
+};
+
+static uint64_t sched_weight(const task_t *t)
+{
+    task_priority_t prio = t->priority;
+    if (prio > TASK_NICE_MAX - TASK_NICE_MIN) prio = TASK_NICE_MAX - TASK_NICE_MIN;
+    return sched_prio_to_weight[prio];
+}
+
+/* Charge the time since last accounting, weighted by priority */
+static void sched_account(task_t *t, uint64_t now)
+{
+    uint64_t delta = now - t->exec_start;
+    t->vruntime += delta * SCHED_WEIGHT_NICE0 / sched_weight(t);
+    t->exec_start = now;
+}
+
+/* Virtual runtimes wrap around, so they are compared by the difference */
+static bool sched_vruntime_less(uint64_t a, uint64_t b)
+{
+    return (int64_t)(a - b) < 0;
+}
+
+static bool rq_less(const rb_node_t *a, const rb_node_t *b)
+{
+    return sched_vruntime_less(rb_entry(a, task_t, rq_node)->vruntime,
+                               rb_entry(b, task_t, rq_node)->vruntime);
+}
+
+/* Run queue helpers, must be called with the queue locked */
+static void rq_enqueue(sched_rq_t *rq, task_t *t)
+{
+    rb_insert(&rq->ready, &t->rq_node, rq_less);
+    t->rq_weight = sched_weight(t);
+    rq->load += t->rq_weight;
+    rq->nr = rq->ready.num;
+}
+
+static void rq_dequeue(sched_rq_t *rq, task_t *t)
+{
+    rb_erase(&rq->ready, &t->rq_node);
+    rq->load -= t->rq_weight;
+    rq->nr = rq->ready.num;
+}
+
+/* Due timers are few, they expire within a tick after the wheel passed them */
+static void rq_due_add(sched_rq_t *rq, task_t *t)
+{
+    task_t **pp = &rq->due;
+    while (*pp != NULL && (*pp)->wakeup_time <= t->wakeup_time)
+        pp = &(*pp)->due_next;
+
+    t->due_next = *pp;
+    if (*pp != NULL) (*pp)->due_pprev = &t->due_next;
+    t->due_pprev = pp;
+    *pp = t;
+}
+
+static void rq_due_del(task_t *t)
+{
+    if (t->due_pprev == NULL) return;
+
+    *t->due_pprev = t->due_next;
+    if (t->due_next != NULL) t->due_next->due_pprev = t->due_pprev;
+    t->due_next = NULL;
+    t->due_pprev = NULL;
+}
+
+static void rq_block(sched_rq_t *rq, task_t *t)
+{
+    t->rq_next = rq->blocked;
+    if (rq->blocked != NULL) rq->blocked->rq_pprev = &t->rq_next;
+    t->rq_pprev = &rq->blocked;
+    rq->blocked = t;
+
+    task_status_t status = __atomic_load_n(&t->status, __ATOMIC_ACQUIRE);
+    if ((status == TASK_SLEEPING || status == TASK_SUSPEND)
+        && t->wakeup_time > 0)
+    {
+        uint64_t tick = sched_nanos_to_ticks(t->wakeup_time);
+
+        /* The wheel already passed its tick, arm an event at once */
+        if (tick < rq->timers.clk) {
+            rq_due_add(rq, t);
+            apic_timer_event((t->wakeup_time > rq->clock)
+                             ? t->wakeup_time - rq->clock : 0);
+        } else {
+            twheel_add(&rq->timers, &t->timer, tick);
+        }
+    }
+}
+
+static void rq_unblock(sched_rq_t *rq, task_t *t)
+{
+    *t->rq_pprev = t->rq_next;
+    if (t->rq_next != NULL) t->rq_next->rq_pprev = t->rq_pprev;
+    t->rq_next = NULL;
+    t->rq_pprev = NULL;
+    twheel_del(&rq->timers, &t->timer);
+    rq_due_del(t);
+}
+
+/* Queue a task by its status, it may be woken up right after the check */
+static void rq_add(sched_rq_t *rq, task_t *t)
+{
+    if (__atomic_load_n(&t->status, __ATOMIC_ACQUIRE) == TASK_READY) {
+        rq_enqueue(rq, t);
+    } else {
+        rq_block(rq, t);
+    }
+}
+
+/* min_vruntime only moves forward, new and woken tasks are placed by it */
+static void rq_update_min(sched_rq_t *rq, task_t *curr)
+{
+    uint64_t vmin = rq->min_vruntime;
+    bool found = false;
+
+    if (curr != NULL) {
+        vmin = curr->vruntime;
+        found = true;
+    }
+    if (!rb_empty(&rq->ready)) {
+        uint64_t v = rb_entry(rb_first(&rq->ready), task_t, rq_node)->vruntime;
+        if (!found || sched_vruntime_less(v, vmin)) vmin = v;
+        found = true;
+    }
+    if (found && sched_vruntime_less(rq->min_vruntime, vmin))
+        rq->min_vruntime = vmin;
+}
+
+/* A sleeper gets at most half of the latency as credit */
+static void rq_place_woken(sched_rq_t *rq, task_t *t)
+{
+    uint64_t floor = rq->min_vruntime - SCHED_LATENCY / 2;
+    if (sched_vruntime_less(t->vruntime, floor)) t->vruntime = floor;
+}
+
+/*
+ * Make a CPU run the scheduler if it is tickless idle. If it is busy, kick
+ * any tickless idle CPU instead so that it can steal the new work.
+ */
+static void sched_kick(uint16_t cpu_id)
+{
+    const smp_info_t *smp_info = smp_get_info();
+
+    /* Pairs with the one in sched_idle_halt() */
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+    if (!__atomic_load_n(&sched_nohz[cpu_id], __ATOMIC_RELAXED)) {
+        uint16_t num = (smp_info != NULL) ? smp_info->num_cpus : 0;
+        uint16_t i;
+        for (i = 0; i < num; i++) {
+            if (__atomic_load_n(&sched_nohz[i], __ATOMIC_RELAXED)) break;
+        }
+        if (i == num) return;
+        cpu_id = i;
+    }
+
+    apic_send_ipi(sched_lapic_ids[cpu_id], sched_ipi_vector, 0);
+    counter_inc(&sched_kicks);
+}
+
+/* Called with interrupts disabled */
+static void sched_tick_restart(uint16_t cpu_id)
+{
+    apic_timer_periodic(TIMESLICE_DEFAULT);
+    rcu_idle_exit(cpu_id);
+    __atomic_store_n(&sched_nohz[cpu_id], false, __ATOMIC_SEQ_CST);
+}
+
+/*
+ * Halt an idle CPU. If nothing can run anywhere, the periodic tick is
+ * replaced by a one-shot timer for the first timer of its queue, and the
+ * tick restarts in the next context switch, i.e., when the timer fires or
+ * another CPU queues a task and kicks this one.
+ */
+static void sched_idle_halt(void)
+{
+    uint64_t rflags = irq_save();
+    const smp_info_t *smp_info = smp_get_info();
+    cpu_t *cpu = smp_get_current_cpu(false);
+
+    if (cpu == NULL || smp_info == NULL || sched_ipi_vector == 0) {
+        asm volatile ("sti; hlt" ::: "memory");
+        irq_restore(rflags);
+        return;
+    }
+
+    uint16_t cpu_id = cpu->cpu_id;
+    sched_rq_t *rq = &sched_rqs[cpu_id];
+
+    /* An interrupt which is not a tick may wake us with the tick stopped */
+    bool stopped = sched_nohz[cpu_id];
+
+    /* Publish the flag before checking the queues, kickers do the reverse */
+    __atomic_store_n(&sched_nohz[cpu_id], true, __ATOMIC_SEQ_CST);
+
+    bool busy = rcu_callbacks_pending();
+    for (uint16_t i = 0; i < smp_info->num_cpus && !busy; i++) {
+        if (__atomic_load_n(&sched_rqs[i].nr, __ATOMIC_SEQ_CST) > 0)
+            busy = true;
+    }
+
+    uint64_t now = hpet_get_nanos();
+    lock_lock(&rq->lock);
+    uint64_t next = twheel_next(&rq->timers);
+    bool due = (rq->due != NULL);
+    lock_release(&rq->lock);
+
+    /* The event of a due timer is armed, the tick keeps going until then */
+    uint64_t delta = SCHED_NOHZ_MAX;
+    if (due) {
+        delta = 0;
+    } else if (next != UINT64_MAX) {
+        uint64_t at = next * TIMESLICE_DEFAULT;
+        delta = (at > now) ? at - now : 0;
+        if (delta > SCHED_NOHZ_MAX) delta = SCHED_NOHZ_MAX;
+    }
+
+    if (busy || delta <= TIMESLICE_DEFAULT) {
+        if (stopped) {
+            sched_tick_restart(cpu_id);
+        } else {
+            __atomic_store_n(&sched_nohz[cpu_id], false, __ATOMIC_SEQ_CST);
+        }
+    } else {
+        if (!stopped) {
+            rcu_idle_enter(cpu_id);
+            counter_inc(&sched_nohz_entries);
+        }
+        apic_timer_oneshot(delta);
+    }
+
+    asm volatile ("sti; hlt" ::: "memory");
+    irq_restore(rflags);
+}
+
+/* Move a woken up task from the blocked list into the ready tree */
+static void rq_activate(sched_rq_t *rq, task_t *t)
+{
+    rq_unblock(rq, t);
+    rq_place_woken(rq, t);
+    rq_enqueue(rq, t);
+}
+
+/* Wake up a task whose timer expired, must be called with the queue locked */
+static void rq_timer_wake(sched_rq_t *rq, task_t *t)
+{
+    task_status_t status = __atomic_load_n(&t->status, __ATOMIC_ACQUIRE);
+
+    if (status != TASK_SLEEPING && status != TASK_SUSPEND) return;
+
+    /* If a waker sets it ready first, the waker activates it */
+    if (__atomic_compare_exchange_n(&t->status, &status, TASK_READY, false,
+                                    __ATOMIC_ACQ_REL, __ATOMIC_RELAXED))
+    {
+        rq_activate(rq, t);
+    }
+}
+
+/* Called by twheel_advance() with the queue locked */
+static void sched_timer_expired(twheel_node_t *node, void *arg)
+{
+    task_t *t = (task_t*)((uint8_t*)node - offsetof(task_t, timer));
+    sched_rq_t *rq = (sched_rq_t*)arg;
+
+    /*
+     * Timers further than the wheel covers were clamped and go back to it.
+     * Others may still expire later within the current tick.
+     */
+    uint64_t tick = sched_nanos_to_ticks(t->wakeup_time);
+    if (tick > sched_nanos_to_ticks(rq->clock)) {
+        twheel_add(&rq->timers, node, tick);
+    } else if (t->wakeup_time > rq->clock) {
+        rq_due_add(rq, t);
+    } else {
+        rq_timer_wake(rq, t);
+    }
+}
+
+/*
+ * Wake up the due timers which expired and arm an event for the next one.
+ * Without TSC-deadline mode it is woken up by the next tick instead.
+ */
+static void rq_due_expire(sched_rq_t *rq)
+{
+    while (rq->due != NULL && rq->due->wakeup_time <= rq->clock) {
+        task_t *t = rq->due;
+        rq_due_del(t);
+        rq_timer_wake(rq, t);
+    }
+    if (rq->due != NULL) apic_timer_event(rq->due->wakeup_time - rq->clock);
+}
+
+/* Lock the queue which owns the task, it may be moved in the meantime */
+static sched_rq_t *sched_lock_task_rq(task_t *t)
+{
+    while (true) {
+        uint16_t cpu_id = __atomic_load_n(&t->rq_cpu, __ATOMIC_ACQUIRE);
+        sched_rq_t *rq = &sched_rqs[cpu_id];
+        lock_lock(&rq->lock);
+        if (t->rq_cpu == cpu_id) return rq;
+        lock_release(&rq->lock);
+    }
+}
+
+/* The shortest queue of the CPUs which the task is allowed on */
+static sched_rq_t *sched_select_rq(const task_t *t)
+{
+    const smp_info_t *smp_info = smp_get_info();
+    uint16_t num = (smp_info != NULL && smp_info->num_cpus > 0)
+                   ? smp_info->num_cpus : 1;
+    sched_rq_t *rq = NULL;
+
+    for (uint16_t i = 0; i < num; i++) {
+        if (!cpumask_test(&t->cpus_allowed, i)) continue;
+        if (rq == NULL || sched_rqs[i].nr < rq->nr) rq = &sched_rqs[i];
+    }
+
+    /* Masks are checked against online CPUs when set, this is a fallback */
+    return (rq != NULL) ? rq : &sched_rqs[0];
+}
+
+/*
+ * Move a ready task which is in no queue from the queue of "from" to an
+ * allowed one. Only the CPU of "from" changes its min_vruntime, so it can
+ * read it without the lock. No queue lock may be held.
+ */
+static void sched_migrate(task_t *t, sched_rq_t *from)
+{
+    uint64_t lag = t->vruntime - from->min_vruntime;
+    sched_rq_t *rq = sched_select_rq(t);
+    uint16_t cpu_id = (uint16_t)(rq - sched_rqs);
+
+    t->rq_next = NULL;
+
+    lock_lock(&rq->lock);
+    t->vruntime = rq->min_vruntime + lag;
+    __atomic_store_n(&t->rq_cpu, cpu_id, __ATOMIC_RELEASE);
+    rq_enqueue(rq, t);
+    lock_release(&rq->lock);
+
+    counter_inc(&sched_migrations);
+    sched_kick(cpu_id);
+}
+
+/*
+ * Wake up a task whose status is "from". A blocked task is moved into the
+ * ready tree of its queue at once. A task which has not left its CPU yet is
+ * queued as ready when it does, since it checks the status under the lock.
+ */
+static bool sched_wake_task(task_t *t, task_status_t from)
+{
+    if (!__atomic_compare_exchange_n(&t->status, &from, TASK_READY, false,
+                                     __ATOMIC_ACQ_REL, __ATOMIC_RELAXED))
+        return false;
+
+    sched_rq_t *rq = sched_lock_task_rq(t);
+
+    /* It may have run and blocked again before we got the lock */
+    bool activated = (t->rq_pprev != NULL && t->status == TASK_READY);
+    if (activated) rq_activate(rq, t);
+    lock_release(&rq->lock);
+
+    if (activated) sched_kick((uint16_t)(rq - sched_rqs));
+
+    return true;
+}
+
+/* The slice is the latency shared by the weights of all runnable tasks */
+static bool rq_slice_over(sched_rq_t *rq, task_t *curr, uint64_t now)
+{
+    uint64_t weight = sched_weight(curr);
+    uint64_t slice = SCHED_LATENCY * weight / (rq->load + weight);
+
+    if (slice < SCHED_MIN_GRANULARITY) slice = SCHED_MIN_GRANULARITY;
+    return now - curr->slice_start >= slice;
+}
+
+/*
+ * Steal the leftmost ready task which may run here from other CPUs, never
+ * holds two queue locks.
+ */
+static task_t *sched_steal(sched_rq_t *rq, uint16_t cpu_id, uint16_t num)
+{
+    for (uint16_t i = 1; i < num; i++) {
+        sched_rq_t *victim = &sched_rqs[(cpu_id + i) % num];
+        if (victim->nr == 0) continue;
+
+        lock_lock(&victim->lock);
+        for (rb_node_t *n = rb_first(&victim->ready); n != NULL; n = rb_next(n)) {
+            task_t *t = rb_entry(n, task_t, rq_node);
+            if (!cpumask_test(&t->cpus_allowed, cpu_id)) continue;
+            if (t->on_cpu) continue;
+
+            rq_dequeue(victim, t);
+            uint64_t lag = t->vruntime - victim->min_vruntime;
+            lock_release(&victim->lock);
+
+            /* Keep its lag relative to the queue it moves to */
+            lock_lock(&rq->lock);
+            t->vruntime = rq->min_vruntime + lag;
+            __atomic_store_n(&t->rq_cpu, cpu_id, __ATOMIC_RELEASE);
+            lock_release(&rq->lock);
+
+            counter_inc(&sched_steals);
+            return t;
+        }
+        lock_release(&victim->lock);
+    }
+    return NULL;
+}
+
+/* Take a dead task out of its blocked list, sched_lock must be held */
+static task_t *sched_take_dead(void)
+{
+    for (size_t k = 0; k < CPU_MAX; k++) {
+        sched_rq_t *rq = &sched_rqs[k];
+        if (rq->blocked == NULL) continue;
+
+        lock_lock(&rq->lock);
+        for (task_t *t = rq->blocked; t != NULL; t = t->rq_next) {
+            if (t->status == TASK_DEAD && !t->on_cpu) {
+                rq_unblock(rq, t);
+                lock_release(&rq->lock);
+                return t;
+            }
+        }
+        lock_release(&rq->lock);
+    }
+    return NULL;
 }
 
 _Noreturn void task_idle_proc(task_id_t tid)
@@ -99,54 +692,46 @@ _Noreturn void task_idle_proc(task_id_t tid)
     (void)tid;
 
     while (true) {
+        /* 0. Idle tasks are never inside RCU read-side sections */
+        rcu_quiescent();
+        rcu_process_callbacks();
+
         /* 1. Free resouces of dead tasks in idle task */
         task_t *t = NULL;
 
+        bool parent_dead = false;
+
         /* Step 1.1: Find a dead task */
-        lock_lock(&sched_lock);
-        size_t task_num = vec_length(&tasks_active);
-        size_t i;
-        if (task_num > 0) {
-            for (i = 0; i < task_num; i++) {
-                t = vec_at(&tasks_active, i);
-                if (t->status == TASK_DEAD) {
-                    vec_erase(&tasks_active, i);
-                    break;
-                } else {
-                    t = NULL;
-                }
-            }
-        }
+        rwlock_write_lock(&sched_lock);
+        t = sched_take_dead();
         if (t != NULL) {
-            for (i = 0; i < task_num; i++) {
-                task_t *tp = vec_at(&tasks_active, i); 
-                if (t->ptid == tp->tid) {
-                    for (size_t k = 0; k < vec_length(&tp->child_list); k++) {
-                        task_id_t tid_child = vec_at(&tp->child_list, k); 
-                        if (tid_child == t->tid) {
-                            vec_erase(&tp->child_list, k)
-                            if (vec_length(&tp->child_list) == 0
-                                && tp->status == TASK_DYING)
-                            {
-                                tp->status = TASK_DEAD;
-                            }
-                            break;
-                        }
-                    }
-                    break;
-                }
+            task_t *tp = task_list_del(t);
+
+            /*
+             * A dying parent is dead after its last child. It is only freed
+             * once it left its CPU, since dead tasks are taken from queues.
+             */
+            task_status_t dying = TASK_DYING;
+            if (tp != NULL && tp->children == NULL
+                && __atomic_compare_exchange_n(&tp->status, &dying, TASK_DEAD,
+                                               false, __ATOMIC_ACQ_REL,
+                                               __ATOMIC_RELAXED))
+            {
+                parent_dead = true;
             }
         }
-        lock_release(&sched_lock);
+        rwlock_write_release(&sched_lock);
+
+        if (parent_dead) waitq_wake_all(&sched_exit_wq);
 
         if (t != NULL) {
             klogi("sched: clean memory of dead task #%d (0x%x)\n", t->tid, t);
 
-            /* Step 1.2: Free all resources of this dead task */
-            task_free(t);
+            /* Step 1.2: Free all resources after lookups stop using it */
+            call_rcu(&t->rcu, task_free_rcu);
         } else {
             /* If we cannot find dead tasks, then fall into sleep */
-            asm volatile ("hlt");
+            sched_idle_halt();
         }
     }
 }
@@ -160,6 +745,9 @@ _Noreturn void task_idle_proc(task_id_t tid)
  */
 void do_context_switch(void* stack, int64_t mode)
 {
+    /* Emulated periodic ticks must be armed even if nothing is switched */
+    if (mode == 0) apic_timer_tick();
+
     const smp_info_t* smp_info = smp_get_info();
     if (smp_info == NULL)               return;
 
@@ -169,84 +757,157 @@ void do_context_switch(void* stack, int64_t mode)
     /* Firstly all events on event bus should be processed */
     eb_dispatch();
 
-    lock_lock(&sched_lock);
-
     cpu_t *cpu = smp_get_current_cpu(true);
     if (cpu == NULL) {
-        lock_release(&sched_lock);
         return;
     }
 
     uint16_t cpu_id = cpu->cpu_id;
-    uint64_t ticks = tasks_coordinate[cpu_id];
+    sched_rq_t *rq = &sched_rqs[cpu_id];
+    uint64_t ticks = counter_read_cpu(&sched_switches, cpu_id);
+
+    /* Timer interrupts and kicks, tickless idle CPUs should have few */
+    if (mode == 0) counter_inc(&sched_ticks);
+    if (sched_nohz[cpu_id]) sched_tick_restart(cpu_id);
 
     task_t *curr = tasks_running[cpu_id];
+    task_t *prev = curr;
+    task_t *curr_fork = NULL;
     task_t *next = NULL;
+    task_t *migrate = NULL;         /* Linked by rq_next */
+
+    /* A task in RCU read-side section keeps running on this CPU */
+    if (curr != NULL && curr->rcu_nesting > 0) {
+        if (mode != 0) {
+            kpanic("SCHED: tid %d gives up CPU in RCU read-side section\n",
+                   curr->tid);
+        }
+        apic_send_eoi();
+        return;
+    }
+    rcu_note_qs(cpu_id);
+
+    /* Idle tasks are never queued and not accounted */
+    task_t *busy = (curr != NULL && curr != tasks_idle[cpu_id]) ? curr : NULL;
+
+    /* TODO: Need to add macros for mode 2 etc. */
+    if (mode == 2 && busy != NULL) {
+        rwlock_write_lock(&sched_lock);
+        curr_fork = task_fork(busy);
+        curr_fork->status = TASK_READY;
+        task_list_add(curr_fork);
+        rwlock_write_release(&sched_lock);
+    }
+
+    uint64_t now = hpet_get_nanos();
+
+    lock_lock(&rq->lock);
+    if (busy != NULL) sched_account(busy, now);
+    rq->clock = now;
+    twheel_advance(&rq->timers, sched_nanos_to_ticks(now),
+                   sched_timer_expired, rq);
+    rq_due_expire(rq);
+    rq_update_min(rq, busy);
+
+    /*
+     * On timer ticks the current task keeps CPU until its slice is used up,
+     * or a woken up task is behind it by more than the wakeup granularity.
+     */
+    if (mode == 0 && busy != NULL && busy->status == TASK_RUNNING
+        && cpumask_test(&busy->cpus_allowed, cpu_id)
+        && (rb_empty(&rq->ready) || (!rq_slice_over(rq, busy, now)
+            && !sched_vruntime_less(rb_entry(rb_first(&rq->ready), task_t,
+                                             rq_node)->vruntime
+                                    + SCHED_WAKEUP_GRANULARITY,
+                                    busy->vruntime))))
+    {
+        lock_release(&rq->lock);
+        apic_send_eoi();
+        return;
+    }
 
     if (curr) {
         curr->tstack_top = stack;
         curr->last_tick = ticks;
         curr->errno = cpu->errno;
+        fpu_switch_out(cpu_id, curr);
 
-        if (curr->status == TASK_RUNNING)
-            curr->status = TASK_READY;
+        /* Wakers may change a sleeping task at the same time */
+        task_status_t running = TASK_RUNNING;
+        __atomic_compare_exchange_n(&curr->status, &running, TASK_READY,
+                                    false, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED);
+    }
 
-        if ((uint64_t)curr != (uint64_t)tasks_idle[cpu_id]) {
-            /* TODO: Need to add macros for mode 2 etc. */
-            if (mode == 2) {
-                task_t *curr_fork = task_fork(curr);
-                vec_push_back(&tasks_active, curr_fork);
-            }
-            vec_push_back(&tasks_active, curr);
+    if (curr_fork != NULL) {
+        curr_fork->rq_cpu = cpu_id;
+        rq_enqueue(rq, curr_fork);
+    }
+    if (busy != NULL) {
+        if (busy->status == TASK_READY
+            && !cpumask_test(&busy->cpus_allowed, cpu_id))
+        {
+            busy->rq_next = migrate;
+            migrate = busy;
+        } else {
+            rq_add(rq, busy);
         }
-
     }
     tasks_running[cpu_id] = NULL;
+    cpu->task = NULL;
     curr = NULL;
 
-    uint64_t loop_size = 0;
-    while (true) {
-        if (vec_length(&tasks_active) > 0) {
-            next = vec_at(&tasks_active, 0);
-            vec_erase(&tasks_active, 0);
-        } else {
-            next = NULL;
-            break;
-        }
-        if (next->status == TASK_READY) break;
-        if (next->status == TASK_SLEEPING) {
-            if ((hpet_get_nanos() >= next->wakeup_time)
-                && (next->wakeup_time > 0)) {
-                break;
-            }
-        }
-        vec_push_back(&tasks_active, next);
-        /* If the whole task list is visited, exit with NULL task */
-        loop_size++;
-        if (loop_size >= vec_length(&tasks_active)) {
-            next = NULL;
+    rb_node_t *n = rb_first(&rq->ready);
+    while (n != NULL) {
+        task_t *t = rb_entry(n, task_t, rq_node);
+        n = rb_next(n);
+
+        /* Switched out by another CPU which has not left its stack yet */
+        if (t->on_cpu && t != prev) continue;
+
+        rq_dequeue(rq, t);
+        if (cpumask_test(&t->cpus_allowed, cpu_id)) {
+            next = t;
+            next->rq_cpu = cpu_id;
             break;
         }
+        t->rq_next = migrate;
+        migrate = t;
+    }
+    lock_release(&rq->lock);
+
+    while (migrate != NULL) {
+        task_t *t = migrate;
+        migrate = t->rq_next;
+        sched_migrate(t, rq);
     }
 
+    if (next == NULL) {
+        next = sched_steal(rq, cpu_id, smp_info->num_cpus);
+    }
     if (next == NULL) {
         next = tasks_idle[cpu_id];
     }
 
-    next->status = TASK_RUNNING;
+    /* Let tickless idle CPUs steal the child */
+    if (curr_fork != NULL) sched_kick(cpu_id);
+
+    __atomic_store_n(&next->status, TASK_RUNNING, __ATOMIC_RELEASE);
+    next->on_cpu = true;
+    next->exec_start = now;
+    next->slice_start = now;
     tasks_running[cpu_id] = next;
+    cpu->task = next;
 
     cpu->errno = next->errno;
     cpu->tss.rsp0 = (uint64_t)(next->kstack_limit + STACK_SIZE);
+    fpu_switch_in(cpu_id, next);
 
-    tasks_coordinate[cpu_id]++;
+    counter_inc(&sched_switches);
     
     if (mode == 0) {
         apic_send_eoi();
     }
 
-    lock_release(&sched_lock);
-
     if (!(cpu->tss.rsp0 & 0xFFFF000000000000) || next->tid < 1) {
         sched_debug(true);
         kpanic("SCHED: CPU %d kernel stack 0x%x corrputed "
@@ -265,9 +926,11 @@ void do_context_switch(void* stack, int64_t mode)
         write_msr(MSR_FS_BASE, next->fs_base);
     }
 
+    /* Others may pick prev once this CPU has switched to the next stack */
     exit_context_switch(next->tstack_top,
         (next->addrspace == NULL)
-            ? 0 : VIRT_TO_PHYS((uint64_t)next->addrspace->PML4));
+            ? 0 : VIRT_TO_PHYS((uint64_t)next->addrspace->PML4),
+        (prev != NULL && prev != next) ? &prev->on_cpu : NULL);
 }
 
 task_id_t sched_get_tid()
@@ -277,13 +940,13 @@ task_id_t sched_get_tid()
         return TID_MAX;
     }   
  
-    lock_lock(&sched_lock);
+    uint64_t rflags = rwlock_read_lock(&sched_lock);
 
     uint16_t cpu_id = cpu->cpu_id;
     task_t* curr = tasks_running[cpu_id];
     task_id_t tid = curr->tid;
 
-    lock_release(&sched_lock);
+    rwlock_read_release(&sched_lock, rflags);
 
     if (tid < 1) kpanic("SCHED: %s returns corrupted tid\n", __func__);
 
@@ -297,7 +960,7 @@ task_id_t sched_fork(void)
         return TID_MAX;
     }   
  
-    lock_lock(&sched_lock);
+    uint64_t rflags = rwlock_read_lock(&sched_lock);
 
     uint16_t cpu_id = cpu->cpu_id;
     task_t *curr = tasks_running[cpu_id];
@@ -309,7 +972,7 @@ task_id_t sched_fork(void)
         tid = curr->tid;
     }
 
-    lock_release(&sched_lock);
+    rwlock_read_release(&sched_lock, rflags);
 
     fork_context_switch();
 
@@ -317,19 +980,25 @@ task_id_t sched_fork(void)
 }
 
 void sched_sleep(time_t millis)
+{
+    sched_nanosleep(MILLIS_TO_NANOS(millis));
+}
+
+/* Sleep for the given nanoseconds, not rounded to ticks with TSC-deadline */
+void sched_nanosleep(time_t nanos)
 {
     cpu_t* cpu = smp_get_current_cpu(false);
     if (cpu == NULL) {
-        hpet_sleep(millis);
+        hpet_nanosleep(nanos);
         return;
     }
  
-    lock_lock(&sched_lock);
+    rwlock_write_lock(&sched_lock);
 
     uint16_t cpu_id = cpu->cpu_id;
     task_t *curr = tasks_running[cpu_id];
     if (curr) {
-        curr->wakeup_time = hpet_get_nanos() + MILLIS_TO_NANOS(millis);
+        curr->wakeup_time = hpet_get_nanos() + nanos;
         curr->wakeup_event.type = EVENT_UNDEFINED;
         curr->status = TASK_SLEEPING;
         if (curr->tid < 1) {
@@ -337,61 +1006,36 @@ void sched_sleep(time_t millis)
         }
     }
 
-    lock_release(&sched_lock);
+    rwlock_write_release(&sched_lock);
 
     force_context_switch();
 }
 
+/* Must be called in RCU read-side section or with sched_lock held */
 static task_status_t sched_get_task_status_impl(task_id_t tid)
 {
-    task_t *ntask = NULL;
-    task_status_t status = TASK_UNKNOWN;
-    bool has_child = false; 
+    task_t *ntask = radix_lookup(&tasks_index, tid);
+    if (ntask == NULL) return TASK_UNKNOWN;
 
-    size_t i;
-    for (i = 0; i < vec_length(&tasks_active); i++) {
-        task_t *t = vec_at(&tasks_active, i); 
-        if (t) {
-            if (t->tid == tid) {
-                status = t->status;
-                ntask = t;
-            }
-            if (t->ptid == tid) {
-                if(t->status != TASK_DEAD && t->status != TASK_UNKNOWN) {
-                    has_child = true;
-                } else if(sched_get_task_status_impl(t->tid) == TASK_RUNNING) {
-                    has_child = true;
-                }
-            }
-        }   
-    }
-    for (i = 0; i < CPU_MAX && !has_child; i++) {
-        task_t *t = tasks_running[i];
-        if (t) {
-            if (t->tid == tid) {
-                status = t->status;
-                ntask = t;
-            }
-            if (t->ptid == tid) {
-                if(t->status != TASK_DEAD && t->status != TASK_UNKNOWN) {
-                    has_child = true;
-                } else if(sched_get_task_status_impl(t->tid) == TASK_RUNNING) {
-                    has_child = true;
-                }
-            }
-        }   
-    }
+    task_status_t status = ntask->status;
+    bool has_child = false; 
 
-    if (!has_child) {
-        if (ntask != NULL) {
-            if (ntask->status == TASK_DEAD || ntask->status == TASK_DYING) {
-                status = TASK_UNKNOWN;
-            }
+    for (task_t *t = rcu_dereference(ntask->children); t != NULL && !has_child;
+         t = rcu_dereference(t->sibling))
+    {
+        task_status_t tstatus = t->status;
+        if (tstatus != TASK_DEAD && tstatus != TASK_UNKNOWN) {
+            has_child = true;
+        } else if (sched_get_task_status_impl(t->tid) == TASK_RUNNING) {
+            has_child = true;
         }
-    } else {
-        status = TASK_RUNNING;
     }
 
+    if (has_child) return TASK_RUNNING;
+
+    if (ntask->status == TASK_DEAD || ntask->status == TASK_DYING)
+        status = TASK_UNKNOWN;
+
     return status;
 }
 
@@ -399,9 +1043,9 @@ task_status_t sched_get_task_status(task_id_t tid)
 {
     task_status_t status = TASK_UNKNOWN;
 
-    lock_lock(&sched_lock);
+    rcu_read_lock();
     status = sched_get_task_status_impl(tid);
-    lock_release(&sched_lock);
+    rcu_read_unlock();
 
     return status;
 }
@@ -415,7 +1059,7 @@ void sched_exit(int64_t status)
         return;
     }   
  
-    lock_lock(&sched_lock);
+    rwlock_write_lock(&sched_lock);
 
     uint16_t cpu_id = cpu->cpu_id;
     task_t *curr = tasks_running[cpu_id];
@@ -424,11 +1068,9 @@ void sched_exit(int64_t status)
         if (curr->tid < 1) {
             kpanic("SCHED: %s meets corrupted tid\n", __func__);
         }
-        size_t len = vec_length(&(curr->child_list));
         bool all_children_dead = true;
-        for (size_t i = 0; i < len; i++) {
-            task_id_t tid_child = vec_at(&(curr->child_list), i);
-            task_status_t status_child = sched_get_task_status_impl(tid_child);
+        for (task_t *c = curr->children; c != NULL; c = c->sibling) {
+            task_status_t status_child = sched_get_task_status_impl(c->tid);
             if (status_child != TASK_DEAD) {
                 all_children_dead = false;
                 break;
@@ -439,7 +1081,9 @@ void sched_exit(int64_t status)
         }
     }   
 
-    lock_release(&sched_lock);
+    rwlock_write_release(&sched_lock);
+
+    waitq_wake_all(&sched_exit_wq);
 
     force_context_switch();
 }
@@ -448,24 +1092,46 @@ bool sched_resume_event(event_t event)
 {
     bool ret = false;
 
-    lock_lock(&sched_lock);
-    for (size_t i = 0; i < vec_length(&tasks_active); i++) {
-        task_t *t = vec_at(&tasks_active, i);
-        if (t) {
-            if (t->status == TASK_SLEEPING
-                && t->wakeup_event.type == event.type)
-            {
-                t->status = TASK_READY;
-                t->wakeup_event.para = event.para;
-                ret = true;
-            }
+    rwlock_write_lock(&sched_lock);
+    for (task_t *t = tasks_all; t != NULL; t = t->all_next) {
+        if (t->status == TASK_SLEEPING && t->wakeup_event.type == event.type) {
+            t->wakeup_event.para = event.para;
+            if (sched_wake_task(t, TASK_SLEEPING)) ret = true;
         }
     }
-    lock_release(&sched_lock);
+    rwlock_write_release(&sched_lock);
 
     return ret;
 }
 
+/* Mark the task as suspended, it keeps running until sched_suspend() */
+void sched_prepare_suspend(task_t *t, time_t millis)
+{
+    rwlock_write_lock(&sched_lock);
+    t->status = TASK_SUSPEND;
+    t->wakeup_time = (millis > 0) ? hpet_get_nanos() + MILLIS_TO_NANOS(millis) : 0;
+    rwlock_write_release(&sched_lock);
+}
+
+/* Give up CPU, returns after sched_wakeup() or timeout */
+void sched_suspend(void)
+{
+    force_context_switch();
+}
+
+/* The task is still running, so it is in no queue and has no timer */
+void sched_cancel_suspend(task_t *t)
+{
+    t->wakeup_time = 0;
+    __atomic_store_n(&t->status, TASK_RUNNING, __ATOMIC_RELEASE);
+}
+
+/* The timer of the task may expire at the same time */
+bool sched_wakeup(task_t *t)
+{
+    return sched_wake_task(t, TASK_SUSPEND);
+}
+
 event_t sched_wait_event(event_t event)
 {
     event_t e = {0};
@@ -474,7 +1140,7 @@ event_t sched_wait_event(event_t event)
         return e;
     }   
    
-    lock_lock(&sched_lock);
+    rwlock_write_lock(&sched_lock);
 
     uint16_t cpu_id = cpu->cpu_id;
     task_t* curr = tasks_running[cpu_id];
@@ -485,7 +1151,7 @@ event_t sched_wait_event(event_t event)
     if (curr->tid < 1)
         kpanic("SCHED: %s meets corrupted tid\n", __func__);
 
-    lock_release(&sched_lock);
+    rwlock_write_release(&sched_lock);
 
     force_context_switch();
 
@@ -494,13 +1160,11 @@ event_t sched_wait_event(event_t event)
 
 task_t* sched_get_current_task()
 {
-    cpu_t* cpu = smp_get_current_cpu(false);
-
-    if (cpu == NULL) {
+    if (!smp_initialized) {
         return NULL;
     }
 
-    return tasks_running[cpu->cpu_id];
+    return percpu_read(task);
 }
 
 uint64_t sched_get_ticks()
@@ -511,21 +1175,32 @@ uint64_t sched_get_ticks()
         return 0;
     }
 
-    return tasks_coordinate[cpu->cpu_id];
+    return counter_read_cpu(&sched_switches, cpu->cpu_id);
 }
 
 void sched_init(const char *name, uint16_t cpu_id)
 {
-    lock_lock(&sched_lock);
-    tasks_idle[cpu_id] = task_make(name, task_idle_proc, 255,
+    rwlock_write_lock(&sched_lock);
+    tasks_idle[cpu_id] = task_make(name, task_idle_proc, TASK_PRIORITY_IDLE,
                                    TASK_KERNEL_MODE, NULL);
-    lock_release(&sched_lock);
+    cpumask_clear(&tasks_idle[cpu_id]->cpus_allowed);
+    cpumask_set(&tasks_idle[cpu_id]->cpus_allowed, cpu_id);
+    task_list_add(tasks_idle[cpu_id]);
+    sched_lapic_ids[cpu_id] = (uint8_t)smp_get_current_cpu(true)->lapic_id;
+    if (sched_ipi_vector == 0) {
+        /* Kicks switch tasks just like timer interrupts */
+        sched_ipi_vector = idt_get_available_vector();
+        idt_set_handler(sched_ipi_vector, enter_context_switch);
+    }
+    rwlock_write_release(&sched_lock);
 
+    rcu_cpu_online(cpu_id);
+
+    /* A deadline which passes while masked is lost, so unmask it first */
     apic_timer_init(); 
-    apic_timer_set_period(TIMESLICE_DEFAULT);
-    apic_timer_set_mode(APIC_TIMER_MODE_PERIODIC);
     apic_timer_set_handler(enter_context_switch);
     apic_timer_start();
+    apic_timer_periodic(TIMESLICE_DEFAULT);
 
     cpu_num++;
 
@@ -533,6 +1208,13 @@ void sched_init(const char *name, uint16_t cpu_id)
           cpu_id, tasks_idle[cpu_id]->tid);
 }
 
+/* Restart the tick of the current CPU if stopped, e.g., to dispatch events */
+void sched_kick_current(void)
+{
+    cpu_t *cpu = smp_get_current_cpu(false);
+    if (cpu != NULL && sched_nohz[cpu->cpu_id]) sched_kick(cpu->cpu_id);
+}
+
 uint16_t sched_get_cpu_num()
 {
     return cpu_num;
@@ -540,20 +1222,102 @@ uint16_t sched_get_cpu_num()
 
 task_t *sched_new(const char *name, void (*entry)(task_id_t), bool usermode)
 {
-    lock_lock(&sched_lock);
+    rwlock_write_lock(&sched_lock);
     task_t *t = task_make(
-        name, entry, 0, usermode ? TASK_USER_MODE : TASK_KERNEL_MODE,
+        name, entry, TASK_PRIORITY_DEFAULT,
+        usermode ? TASK_USER_MODE : TASK_KERNEL_MODE,
         NULL);
-    lock_release(&sched_lock);
+    rwlock_write_release(&sched_lock);
 
     return t;
 }
 
+/*
+ * New tasks go to the shortest allowed run queue, stealing balances them later. They
+ * start from min_vruntime so that they neither starve nor get starved.
+ */
 void sched_add(task_t *t)
 {
-    lock_lock(&sched_lock);
-    vec_push_back(&tasks_active, t); 
-    lock_release(&sched_lock);
+    sched_rq_t *rq = sched_select_rq(t);
+
+    rwlock_write_lock(&sched_lock);
+    task_list_add(t);
+    lock_lock(&rq->lock);
+    t->vruntime = rq->min_vruntime;
+    t->rq_cpu = (uint16_t)(rq - sched_rqs);
+    rq_add(rq, t);
+    lock_release(&rq->lock);
+    rwlock_write_release(&sched_lock);
+
+    sched_kick(t->rq_cpu);
+}
+
+/* Returns the new nice value, which is clamped into the valid range */
+int64_t sched_set_nice(task_t *t, int64_t nice)
+{
+    if (nice < TASK_NICE_MIN) nice = TASK_NICE_MIN;
+    if (nice > TASK_NICE_MAX) nice = TASK_NICE_MAX;
+
+    /* A queued task keeps its old weight in the load until it is dequeued */
+    __atomic_store_n(&t->priority, (task_priority_t)(nice + TASK_PRIORITY_DEFAULT),
+                     __ATOMIC_RELAXED);
+
+    return nice;
+}
+
+/*
+ * Change the CPUs which a task may run on. A queued task moves when it would
+ * be picked, a running one at its next tick, and the current task at once.
+ * Returns false if there is no such task or it is an idle task.
+ */
+bool sched_set_affinity(task_id_t tid, const cpumask_t *mask)
+{
+    task_t *target = NULL;
+    uint16_t rq_cpu = 0;
+
+    rcu_read_lock();
+    task_t *t = radix_lookup(&tasks_index, tid);
+    if (t != NULL && t->priority != TASK_PRIORITY_IDLE) {
+        /* Pickers and stealers read the mask with its queue locked */
+        sched_rq_t *rq = sched_lock_task_rq(t);
+        t->cpus_allowed = *mask;
+        rq_cpu = t->rq_cpu;
+        lock_release(&rq->lock);
+        target = t;
+    }
+    rcu_read_unlock();
+
+    if (target == NULL) return false;
+
+    sched_kick(rq_cpu);
+
+    uint64_t rflags = irq_save();
+    cpu_t *cpu = smp_get_current_cpu(false);
+    bool moved = (target == sched_get_current_task() && cpu != NULL
+                  && !cpumask_test(mask, cpu->cpu_id));
+    irq_restore(rflags);
+
+    if (moved) force_context_switch();
+
+    return true;
+}
+
+/* Returns false if there is no such task */
+bool sched_get_affinity(task_id_t tid, cpumask_t *mask)
+{
+    bool found = false;
+
+    rcu_read_lock();
+    task_t *t = radix_lookup(&tasks_index, tid);
+    if (t != NULL) {
+        sched_rq_t *rq = sched_lock_task_rq(t);
+        *mask = t->cpus_allowed;
+        lock_release(&rq->lock);
+        found = true;
+    }
+    rcu_read_unlock();
+
+    return found;
 }
 
 task_t *sched_execve(
@@ -577,9 +1341,9 @@ task_t *sched_execve(
         }
     }
 
-    lock_lock(&sched_lock);
+    rwlock_write_lock(&sched_lock);
 
-    tc = task_make(tname, NULL, 0, TASK_USER_MODE,
+    tc = task_make(tname, NULL, TASK_PRIORITY_DEFAULT, TASK_USER_MODE,
                    tp == NULL ? NULL : tp->addrspace);
 
     if (tp != NULL) {
@@ -590,7 +1354,7 @@ task_t *sched_execve(
                   tp->tid, tc->tid, dup.fh, dup.newfh);
         }
 
-        /* Increase refcount of all open files */
+        /* Share node descriptors and thus seek positions with the parent */
         memcpy(&tc->openfiles, &tp->openfiles, sizeof(ht_t));
         for (i = 0; i < HT_ARRAY_SIZE; i++) {
             if (tc->openfiles.array[i].key == -1
@@ -598,16 +1362,15 @@ task_t *sched_execve(
             {
                 continue;
             }
-            vfs_node_desc_t* nd = (vfs_node_desc_t*)kmalloc(sizeof(vfs_node_desc_t));
-            memcpy(nd, tc->openfiles.array[i].data, sizeof(vfs_node_desc_t));
-            tc->openfiles.array[i].data = nd; 
-            nd->inode->refcount++;
-            klogd("SCHED: copy fd %d from tid %d to tid %d\n",
+            vfs_node_desc_t* nd =
+                vfs_get_node_desc(tc->openfiles.array[i].data);
+            refcount_inc(&nd->inode->refcount);
+            klogd("SCHED: share fd %d from tid %d with tid %d\n",
                   tc->openfiles.array[i].key, tp->tid, tc->tid);
         } 
     }
 
-    lock_release(&sched_lock);
+    rwlock_write_release(&sched_lock);
 
     if (elf_load(tc, path, &entry, &aux)) {
         /* Need to release memory for task "tc" */
@@ -723,13 +1486,13 @@ task_t *sched_execve(
 
     klogd("SCHED: finished initialization with entry 0x%x\n", entry);
 
-    lock_lock(&sched_lock);
+    rwlock_write_lock(&sched_lock);
     if (tp != NULL) {
         klogi("SCHED: child tid %d and parent tid %d\n", tc->tid, tp->tid);
-        vec_push_back(&tp->child_list, tc->tid);
         tc->ptid = tp->tid;
+        tc->cpus_allowed = tp->cpus_allowed;
     }
-    lock_release(&sched_lock);
+    rwlock_write_release(&sched_lock);
 
     task_debug(tc, true);
 
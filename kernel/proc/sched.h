@@ -14,8 +14,11 @@
 #pragma once
 
 #include <proc/task.h>
+#include <proc/waitq.h>
 #include <base/time.h>
 
+extern waitq_t sched_exit_wq;
+
 _Noreturn void task_idle_proc(task_id_t tid);
 
 void sched_debug(bool showlog);
@@ -23,13 +26,22 @@ void sched_debug(bool showlog);
 void sched_init(const char *name, uint16_t cpu_id);
 task_t *sched_new(const char *name, void (*entry)(task_id_t), bool usermode);
 void sched_add(task_t *t);
+int64_t sched_set_nice(task_t *t, int64_t nice);
+bool sched_set_affinity(task_id_t tid, const cpumask_t *mask);
+bool sched_get_affinity(task_id_t tid, cpumask_t *mask);
 void sched_sleep(time_t ms);
+void sched_nanosleep(time_t nanos);
 task_id_t sched_fork(void);
 void sched_exit(int64_t status);
 event_t sched_wait_event(event_t event);
+void sched_prepare_suspend(task_t *t, time_t millis);
+void sched_suspend(void);
+void sched_cancel_suspend(task_t *t);
+bool sched_wakeup(task_t *t);
 bool sched_resume_event(event_t event);
 task_t *sched_get_current_task(void);
 uint16_t sched_get_cpu_num(void);
+void sched_kick_current(void);
 uint64_t sched_get_ticks(void);
 task_id_t sched_get_tid(void);
 task_status_t sched_get_task_status(task_id_t tid);
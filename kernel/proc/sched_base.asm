@@ -9,6 +9,7 @@ extern do_context_switch
 extern lock_release
 
 enter_context_switch:
+    swapgs_if_user 8
     push_all
 
     mov rdi, rsp
@@ -18,6 +19,7 @@ enter_context_switch:
     call do_context_switch
 
     add rsp, 120
+    swapgs_if_user 8
     iretq
 
 exit_context_switch:
@@ -29,8 +31,15 @@ exit_context_switch:
 
     mov rsp, rdi
 
+    ; The previous task's stack is no longer used, rdx is its on_cpu flag
+    test rdx, rdx
+    jz .prev_kept
+    mov byte [rdx], 0
+.prev_kept:
+
     pop_all
 
+    swapgs_if_user 8
     iretq
 
 force_context_switch:
@@ -10,11 +10,18 @@
 #include <sys/apic.h>
 #include <sys/panic.h>
 #include <sys/isr_base.h>
+#include <sys/hpet.h>
 #include <base/klog.h>
 #include <base/vector.h>
+#include <base/kmalloc.h>
+#include <base/kmem_cache.h>
+#include <base/scratch.h>
+#include <base/irqsoff.h>
+#include <base/counter.h>
 #include <proc/task.h>
 #include <proc/sched.h>
 #include <proc/syscall.h>
+#include <proc/futex.h>
 #include <proc/eventbus.h>
 #include <fs/filebase.h>
 #include <fs/vfs.h>
@@ -28,8 +35,8 @@ extern int64_t syscall_handler();
 
 typedef int64_t (*syscall_ptr_t)(void);
 
-extern lock_t vfs_lock;
-extern lock_t sched_lock;
+extern mutex_t vfs_lock;
+extern rwlock_t sched_lock;
 
 static bool debug_info = false;
 
@@ -129,10 +136,21 @@ uint64_t k_vm_map(uint64_t *hint, uint64_t length, uint64_t prot,
     m.paddr = phys_ptr;
     m.np = NUM_PAGES(length);
     m.flags = pf;
+    if (flags & MAP_SHARED) {
+        m.shared = (mem_shared_t*)kmalloc(sizeof(mem_shared_t));
+        if (m.shared == NULL) {
+            cpu_set_errno(ENOMEM);
+            vmm_unmap(as, ptr, m.np);
+            kmfree((void*)PHYS_TO_VIRT(phys_ptr));
+            goto err_exit;
+        }
+        m.shared->refcount = refcount_new(1);
+        m.shared->paddr = phys_ptr;
+    }
 
-    lock_lock(&sched_lock);
+    rwlock_write_lock(&sched_lock);
     vec_push_back(&t->mmap_list, m);
-    lock_release(&sched_lock);
+    rwlock_write_release(&sched_lock);
 
     return ptr;
 
@@ -142,9 +160,12 @@ err_exit:
     return (uint64_t)NULL;
 }
 
+/*
+ * A block mapped by k_vm_map() is freed when it is unmapped as a whole. A
+ * part of a block is only unmapped, its pages are freed when the task exits.
+ */
 int64_t k_vm_unmap(void *ptr, size_t size)
 {
-    /* Need to implement memory free */
     cpu_set_errno(0);
 
     task_t *t = sched_get_current_task();
@@ -163,9 +184,28 @@ int64_t k_vm_unmap(void *ptr, size_t size)
     uint64_t np = NUM_PAGES(size);
     vmm_unmap(as, (uint64_t)ptr, np);
 
+    bool found = false;
+    mem_map_t m = {0};
+    if (t != NULL) {
+        rwlock_write_lock(&sched_lock);
+        size_t len = vec_length(&t->mmap_list);
+        for (size_t i = 0; i < len; i++) {
+            m = vec_at(&t->mmap_list, i);
+            if (m.vaddr == (uint64_t)ptr && m.np == np) {
+                /* The order does not matter, move the last one here */
+                vec_at(&t->mmap_list, i) = vec_at(&t->mmap_list, len - 1);
+                t->mmap_list.len--;
+                found = true;
+                break;
+            }
+        }
+        rwlock_write_release(&sched_lock);
+    }
+    if (found) task_mmap_release(&m);
+
     if (debug_info) {
-        klogi("k_vm_unmap: 0x%x(PML4 0x%x) unmap 0x%x with %d pages\n",
-              as, as->PML4, ptr, np);
+        klogi("k_vm_unmap: 0x%x(PML4 0x%x) unmap 0x%x with %d pages%s\n",
+              as, as->PML4, ptr, np, found ? " and free them" : "");
     }
 
     return 0;
@@ -209,7 +249,7 @@ int get_full_path(int64_t dirfh, const char *path, char *full_path)
     }
 
     /* Extracted folder name one by one */
-    char temp_path[VFS_MAX_PATH_LEN] = {0};
+    char *temp_path = (char*)scratch_push(VFS_MAX_PATH_LEN);
     char *curr = NULL, *child = NULL;
 
     strcpy(temp_path, path);
@@ -242,6 +282,7 @@ int get_full_path(int64_t dirfh, const char *path, char *full_path)
                 }
             }
             if (!succ) {
+                scratch_pop(temp_path);
                 cpu_set_errno(EINVAL);
                 return -1;
             }
@@ -268,16 +309,13 @@ int get_full_path(int64_t dirfh, const char *path, char *full_path)
         }
     }
 
+    scratch_pop(temp_path);
     return 0;
 }
 
-int64_t k_openat(int64_t dirfh, char *path, int64_t flags, int64_t mode)
+static int64_t openat_path(int64_t dirfh, char *path, int64_t flags,
+                           char *full_path)
 {
-    /* "mode" is always zero */
-    (void)mode;
-    cpu_set_errno(0);
-
-    char full_path[VFS_MAX_PATH_LEN] = {0};
     if (get_full_path(dirfh, path, full_path) < 0) {
         kloge("k_openat: cannot get full path for \"%s\"\n", path);
         cpu_set_errno(EINVAL);
@@ -353,6 +391,18 @@ int64_t k_openat(int64_t dirfh, char *path, int64_t flags, int64_t mode)
     return vfs_open(full_path, openmode);
 }
 
+int64_t k_openat(int64_t dirfh, char *path, int64_t flags, int64_t mode)
+{
+    /* "mode" is always zero */
+    (void)mode;
+    cpu_set_errno(0);
+
+    char *full_path = (char*)scratch_push(VFS_MAX_PATH_LEN);
+    int64_t ret = openat_path(dirfh, path, flags, full_path);
+    scratch_pop(full_path);
+    return ret;
+}
+
 int64_t k_chmod(char *path, int64_t flags)
 {
     cpu_set_errno(0);
@@ -429,23 +479,27 @@ int64_t k_unlink(char *path)
         return -1;
     }
 
-    vfs_inode_t *pi = tnode->parent;
-    for (size_t i = 0; i < vec_length(&(pi->child)); i++) {
-        if (vec_at(&(pi->child), i) == tnode) {
-            if (tnode->inode->refcount == 0) {
-                vec_erase(&(pi->child), i);
-                return 0;
-            } else {
-                klogw("k_unlink: failed because of refcount of \"%s\" is %d\n",
-                    path, tnode->inode->refcount);
-                cpu_set_errno(EINVAL);
-                return -1;
-            }
-        }
+    /* Opens take references with vfs_lock held, so the check is stable */
+    mutex_lock(&vfs_lock);
+    int64_t refs = refcount_read(&tnode->inode->refcount);
+    if (refs != 0) {
+        mutex_unlock(&vfs_lock);
+        klogw("k_unlink: failed because of refcount of \"%s\" is %d\n",
+            path, refs);
+        cpu_set_errno(EINVAL);
+        return -1;
     }
 
-    cpu_set_errno(ENOENT);
-    return -1;
+    lock_lock(&vfs_tree_lock);
+    bool removed = vfs_remove_child(tnode->parent, tnode);
+    lock_release(&vfs_tree_lock);
+    mutex_unlock(&vfs_lock);
+
+    if (!removed) {
+        cpu_set_errno(ENOENT);
+        return -1;
+    }
+    return 0;
 }
 
 int64_t k_seek(int64_t fh, int64_t offset, int64_t whence)
@@ -477,7 +531,7 @@ int64_t k_close(int64_t fh)
     }
 
     if (t != NULL) {
-        lock_lock(&vfs_lock);
+        mutex_lock(&vfs_lock);
         /* Check whether there is file redirection */
         for (size_t i = 0; i < vec_length(&t->dup_list); i++) {
             file_dup_t dup = vec_at(&t->dup_list, i); 
@@ -486,7 +540,7 @@ int64_t k_close(int64_t fh)
                 break;
             }   
         }
-        lock_release(&vfs_lock);
+        mutex_unlock(&vfs_lock);
     }
  
     return vfs_close(fh);
@@ -501,7 +555,7 @@ int64_t k_read(int64_t fh, void* buf, size_t count)
         bool found = false;
         vfs_handle_t oldfh = -1; 
         if (t != NULL) {
-            lock_lock(&vfs_lock);
+            mutex_lock(&vfs_lock);
             /* Check whether it is redirected from some file */
             for (size_t i; i < vec_length(&t->dup_list); i++) {
                 file_dup_t dup = vec_at(&t->dup_list, i);
@@ -514,7 +568,7 @@ int64_t k_read(int64_t fh, void* buf, size_t count)
                     found = true;
                 }
             }
-            lock_release(&vfs_lock);
+            mutex_unlock(&vfs_lock);
         }
         if (found) {
             int64_t ret = vfs_read(oldfh, count, buf);
@@ -540,13 +594,14 @@ int64_t k_read(int64_t fh, void* buf, size_t count)
     }
 }
 
+#define WRITE_QUIET_MILLIS          250
+
 static task_id_t last_write_task_id = 0;
-static uint64_t last_write_ticks = 0;
+static uint64_t last_write_millis = 0;
 
 int64_t k_write(int64_t fh, const void* buf, size_t count)
 {
     task_t *t = sched_get_current_task();
-    uint64_t ticks = sched_get_ticks();
 
     cpu_set_errno(0);
 
@@ -554,7 +609,7 @@ int64_t k_write(int64_t fh, const void* buf, size_t count)
         bool found = false;
         vfs_handle_t oldfh = -1; 
         if (t != NULL) {
-            lock_lock(&vfs_lock);
+            mutex_lock(&vfs_lock);
             /* Check whether it is redirected from some file */
             for (size_t i; i < vec_length(&t->dup_list); i++) {
                 file_dup_t dup = vec_at(&t->dup_list, i); 
@@ -568,7 +623,7 @@ int64_t k_write(int64_t fh, const void* buf, size_t count)
                     break;
                 }
             }
-            lock_release(&vfs_lock);
+            mutex_unlock(&vfs_lock);
         }   
         if (found) {
             klogd("k_write: write %d bytes to oldfh %d <- fh %d\n",
@@ -589,23 +644,27 @@ int64_t k_write(int64_t fh, const void* buf, size_t count)
                 }
             }
 
-            if (last_write_task_id != t->tid)
-            {
-                while(true) {
-                    if (ticks > last_write_ticks
-                        && ticks - last_write_ticks > 250) 
-                    {
-                        break;
-                    }
-                    sched_sleep(100);
-                    ticks = sched_get_ticks();
+            /* Keep output of different tasks apart. Wait until the last
+             * writer has been quiet for a while or has exited.
+             */
+            while (last_write_task_id != t->tid) {
+                waitq_entry_t e;
+                uint64_t quiet = hpet_get_millis() - last_write_millis;
+                if (quiet >= WRITE_QUIET_MILLIS) break;
+
+                waitq_prepare(&sched_exit_wq, &e, WRITE_QUIET_MILLIS - quiet);
+                task_status_t st = sched_get_task_status(last_write_task_id);
+                if (st == TASK_DEAD || st == TASK_UNKNOWN) {
+                    waitq_finish(&sched_exit_wq, &e);
+                    break;
                 }
+                waitq_wait(&sched_exit_wq, &e);
             }
 
-            lock_lock(&vfs_lock);
+            mutex_lock(&vfs_lock);
             last_write_task_id = t->tid;
-            last_write_ticks = ticks;
-            lock_release(&vfs_lock);
+            last_write_millis = hpet_get_millis();
+            mutex_unlock(&vfs_lock);
 
             vfs_handle_t ttyfh = vfs_open("/dev/tty", VFS_MODE_READWRITE);
             if (ttyfh != VFS_INVALID_HANDLE) {
@@ -660,26 +719,38 @@ int64_t k_fstatat(int64_t dirfh, const char *path, int64_t statbuf, int64_t flag
 {
     (void)flags;
 
-    char full_path[VFS_MAX_PATH_LEN] = {0};
-    if (get_full_path(dirfh, path, full_path) < 0) {
+    if (path == NULL || statbuf == 0 || (uint64_t)statbuf >= MEM_VIRT_OFFSET) {
+        cpu_set_errno(EFAULT);
         return -1;
     }
 
+    int64_t ret = -1;
+    char *full_path = (char*)scratch_push(VFS_MAX_PATH_LEN);
+    if (get_full_path(dirfh, path, full_path) < 0) {
+        goto exit;
+    }
+
     vfs_tnode_t *node = vfs_path_to_node(full_path, NO_CREATE, 0);
 
-    if (node != NULL && node->st.st_nlink > 0) {
-        vfs_stat_t *st = (vfs_stat_t*)statbuf;
-        memcpy(st, &(node->st), sizeof(vfs_stat_t));
+    /* The user buffer is only written once the node is known to exist */
+    vfs_stat_t st = {0};
+    if (node != NULL) vfs_get_stat(node, &st);
+
+    if (node != NULL && st.st_nlink > 0) {
+        memcpy((void*)statbuf, &st, sizeof(vfs_stat_t));
         klogd("k_fstatat: success with dirfh 0x%x and path %s(%s), size %d\n",
-              dirfh, full_path, path, st->st_size);
+              dirfh, full_path, path, st.st_size);
         cpu_set_errno(0); 
-        return 0;
+        ret = 0;
     } else {
         klogd("k_fstatat: fail with dirfh 0x%x and path %s(%s)\n",
                dirfh, full_path, path);
         cpu_set_errno(ENOENT);
-        return -1;
     }
+
+exit:
+    scratch_pop(full_path);
+    return ret;
 }
 
 int64_t k_fstat(int64_t handle, int64_t statbuf)
@@ -700,7 +771,7 @@ int64_t k_fstat(int64_t handle, int64_t statbuf)
 
     if (fd != NULL) {
         vfs_stat_t *st = (vfs_stat_t*)statbuf;
-        memcpy(st, &(fd->tnode->st), sizeof(vfs_stat_t));
+        vfs_get_stat(fd->tnode, st);
         klogd("k_fstat: success with file handle %d and size %d\n",
               handle, st->st_size);
         return 0;
@@ -872,22 +943,28 @@ int64_t k_readdir(int64_t handle, uint64_t buff)
         goto err_exit;
     }
 
+    rcu_read_lock();
+    vfs_child_list_t *cl = rcu_dereference(fd->inode->child);
+    size_t num = vfs_child_count(cl);
     if (fd->curr_dir_ent == NULL) {
-        if (vec_length(&fd->inode->child) == 0) {
+        if (num == 0) {
             /* End of dir */
+            rcu_read_unlock();
             goto err_exit;
         }
-        fd->curr_dir_ent = vec_at(&fd->inode->child, 0);
+        fd->curr_dir_ent = cl->nodes[0];
         fd->curr_dir_idx = 0;
     } else {
-        if (fd->curr_dir_idx >= vec_length(&fd->inode->child) - 1) {
+        if (fd->curr_dir_idx + 1 >= num) {
             /* End of dir */
             fd->curr_dir_ent = NULL;
+            rcu_read_unlock();
             goto err_exit;
         }
-        fd->curr_dir_ent = vec_at(&fd->inode->child, fd->curr_dir_idx + 1); 
+        fd->curr_dir_ent = cl->nodes[fd->curr_dir_idx + 1]; 
         fd->curr_dir_idx++;
     }
+    rcu_read_unlock();
 
     strcpy(de->d_name, fd->curr_dir_ent->name);
    
@@ -918,12 +995,207 @@ int64_t k_meminfo()
     }
 
     pmm_dump_usage();
+    kmem_cache_dump();
     return 0;
 
 err_exit:
     return -1;
 }
 
+int64_t k_memprof(int64_t op, int64_t arg)
+{
+    task_t *t = sched_get_current_task();
+    cpu_set_errno(0);
+
+    if (t == NULL) {
+        cpu_set_errno(ENODEV);
+        goto err_exit;
+    }
+
+    switch (op) {
+    case MEMPROF_REPORT:
+        kmalloc_prof_report(arg > 0 ? (size_t)arg : 10);
+        break;
+    case MEMPROF_RESET:
+        kmalloc_prof_reset();
+        break;
+    case MEMPROF_ENABLE:
+        kmalloc_set_tracking(true);
+        break;
+    case MEMPROF_DISABLE:
+        kmalloc_set_tracking(false);
+        break;
+    default:
+        cpu_set_errno(EINVAL);
+        goto err_exit;
+    }
+    return 0;
+
+err_exit:
+    return -1;
+}
+
+int64_t k_lockstat(int64_t op, int64_t arg)
+{
+    cpu_set_errno(0);
+
+#ifdef ENABLE_LOCK_STAT
+    switch (op) {
+    case LOCKSTAT_REPORT:
+        lock_stat_report(arg > 0 ? (size_t)arg : 10);
+        break;
+    case LOCKSTAT_RESET:
+        lock_stat_reset();
+        break;
+    default:
+        cpu_set_errno(EINVAL);
+        goto err_exit;
+    }
+    return 0;
+#else
+    (void)op;
+    (void)arg;
+    cpu_set_errno(ENOSYS);
+    goto err_exit;
+#endif
+
+err_exit:
+    return -1;
+}
+
+int64_t k_irqsoff(int64_t op)
+{
+    cpu_set_errno(0);
+
+#ifdef ENABLE_IRQSOFF_TRACE
+    switch (op) {
+    case IRQSOFF_REPORT:
+        irqsoff_report();
+        break;
+    case IRQSOFF_RESET:
+        irqsoff_reset();
+        break;
+    default:
+        cpu_set_errno(EINVAL);
+        goto err_exit;
+    }
+    return 0;
+#else
+    (void)op;
+    cpu_set_errno(ENOSYS);
+    goto err_exit;
+#endif
+
+err_exit:
+    return -1;
+}
+
+int64_t k_counters(void)
+{
+    cpu_set_errno(0);
+    counter_dump();
+    return 0;
+}
+
+/* Add inc to the nice value of the current task, returns the new one */
+int64_t k_nice(int64_t inc)
+{
+    task_t *t = sched_get_current_task();
+    cpu_set_errno(0);
+
+    if (t == NULL) {
+        cpu_set_errno(ENODEV);
+        goto err_exit;
+    }
+
+    if (inc < TASK_NICE_MIN - TASK_NICE_MAX || inc > TASK_NICE_MAX - TASK_NICE_MIN) {
+        cpu_set_errno(EINVAL);
+        goto err_exit;
+    }
+
+    return sched_set_nice(t, task_nice(t) + inc);
+
+err_exit:
+    return -1;
+}
+
+/*
+ * Set the CPUs which task pid (0 for the current one) may run on. The mask
+ * has size bytes, bits of CPUs which are not online are ignored.
+ */
+int64_t k_sched_setaffinity(int64_t pid, size_t size, const uint64_t *mask)
+{
+    const smp_info_t *smp_info = smp_get_info();
+    task_t *t = sched_get_current_task();
+    cpumask_t cpus;
+    bool online = false;
+    cpu_set_errno(0);
+
+    if (t == NULL || smp_info == NULL) {
+        cpu_set_errno(ENODEV);
+        goto err_exit;
+    }
+
+    if (mask == NULL || size == 0) {
+        cpu_set_errno(EINVAL);
+        goto err_exit;
+    }
+
+    cpumask_clear(&cpus);
+    for (uint16_t i = 0; i < smp_info->num_cpus && i / 8 < size; i++) {
+        if ((((const uint8_t*)mask)[i / 8] >> (i % 8)) & 1) {
+            cpumask_set(&cpus, i);
+            online = true;
+        }
+    }
+
+    if (!online) {
+        cpu_set_errno(EINVAL);
+        goto err_exit;
+    }
+
+    if (!sched_set_affinity(pid == 0 ? t->tid : (task_id_t)pid, &cpus)) {
+        cpu_set_errno(ESRCH);
+        goto err_exit;
+    }
+
+    return 0;
+
+err_exit:
+    return -1;
+}
+
+/* Returns the number of bytes of the mask, which covers all online CPUs */
+int64_t k_sched_getaffinity(int64_t pid, size_t size, uint64_t *mask)
+{
+    const smp_info_t *smp_info = smp_get_info();
+    task_t *t = sched_get_current_task();
+    cpumask_t cpus;
+    cpu_set_errno(0);
+
+    if (t == NULL || smp_info == NULL) {
+        cpu_set_errno(ENODEV);
+        goto err_exit;
+    }
+
+    size_t len = (smp_info->num_cpus + 63) / 64 * sizeof(uint64_t);
+    if (mask == NULL || size < len) {
+        cpu_set_errno(EINVAL);
+        goto err_exit;
+    }
+
+    if (!sched_get_affinity(pid == 0 ? t->tid : (task_id_t)pid, &cpus)) {
+        cpu_set_errno(ESRCH);
+        goto err_exit;
+    }
+
+    memcpy(mask, cpus.bits, len);
+    return (int64_t)len;
+
+err_exit:
+    return -1;
+}
+
 int64_t k_pipe(int32_t *fh, uint32_t flags)
 {
     (void)flags;
@@ -1015,39 +1287,58 @@ int64_t k_fcntl(int64_t fd, int64_t request, int64_t arg)
     return -1; 
 }
 
+#define WAITPID_POLL_MILLIS         100
+#define WAITPID_SELF_TIMEOUT        SECONDS_TO_NANOS(500)
+#define WAITPID_PID_TIMEOUT         SECONDS_TO_NANOS(2)
+
 int64_t k_waitpid(int64_t pid, int32_t *status, int32_t flags)
 {
     task_t *t = sched_get_current_task();
     if (status != NULL) *status = 0;
 
+    waitq_entry_t e;
+
     if ((int32_t)pid == (int32_t)(-1) && t != NULL) {
         klogv("k_waitpid: tid %d waits pid 0x%x status 0x%x flags 0x%x\n",
               t->tid, pid, status, flags);
 
         cpu_set_errno(0);
 
+        /* Queue before checking so that an exit in between wakes us up */
+        waitq_prepare(&sched_exit_wq, &e, WAITPID_POLL_MILLIS);
+
         bool all_dead = true;
-        size_t len = vec_length(&(t->child_list));
+        task_id_t tid_dead = TID_MAX;
 
-        for (size_t i = 0; i < len; i++) {
-            task_id_t tid_child = vec_at(&(t->child_list), i);
+        rcu_read_lock();
+        for (task_t *c = rcu_dereference(t->children); c != NULL;
+             c = rcu_dereference(c->sibling))
+        {
+            task_id_t tid_child = c->tid;
             task_status_t status_child = sched_get_task_status(tid_child);
             if (status_child == TASK_DEAD) {
-                klogw("     tid %d : child tid %d DEAD\n", t->tid, tid_child);
-                return tid_child;
+                tid_dead = tid_child;
+                break;
             } else if (status_child != TASK_UNKNOWN) {
                 all_dead = false;
                 klogv("     tid %d : child tid %d ACTIVE\n", t->tid, tid_child);
             }
         }
+        rcu_read_unlock();
+
+        if (tid_dead != TID_MAX) {
+            klogw("     tid %d : child tid %d DEAD\n", t->tid, tid_dead);
+            waitq_finish(&sched_exit_wq, &e);
+            return tid_dead;
+        }
   
         if (!all_dead) {
-            sched_sleep(100);
+            waitq_wait(&sched_exit_wq, &e);
             klogv("k_waitpid: tid %d waiting pid 0x%x returns with "
                   "active children\n", t->tid, pid);
             return 0;
         } else {
-            sched_sleep(100);
+            waitq_finish(&sched_exit_wq, &e);
             klogd("k_waitpid: tid %d waiting pid 0x%x returns without "
                   "children\n", t->tid, pid);
             cpu_set_errno(ECHILD);
@@ -1062,14 +1353,17 @@ int64_t k_waitpid(int64_t pid, int32_t *status, int32_t flags)
 
         cpu_set_errno(0);
 
-        size_t retry_times = 0;
+        uint64_t deadline = hpet_get_nanos() + WAITPID_SELF_TIMEOUT;
         while(true) {
+            waitq_prepare(&sched_exit_wq, &e, WAITPID_POLL_MILLIS);
+
             bool all_dead = true;
-            size_t len = vec_length(&(t->child_list));
 
-            for (size_t i = 0; i < len; i++) {
-                task_id_t tid_child = vec_at(&(t->child_list), i);
-                task_status_t status_child = sched_get_task_status(tid_child);
+            rcu_read_lock();
+            for (task_t *c = rcu_dereference(t->children); c != NULL;
+                 c = rcu_dereference(c->sibling))
+            {
+                task_status_t status_child = sched_get_task_status(c->tid);
                 if (status_child != TASK_UNKNOWN && status_child != TASK_DEAD
                     && status_child != TASK_DYING)
                 {
@@ -1077,34 +1371,37 @@ int64_t k_waitpid(int64_t pid, int32_t *status, int32_t flags)
                     break;
                 }
             }
+            rcu_read_unlock();
 
-            if (!all_dead) {
-                sched_sleep(100);
-                retry_times++;
-                if (retry_times >= 5000) {
-                    /* Retry for 500 seconds and return an error code.
-                     * I think it is a long time span enough for everything
-                     * done.
-                     */
-                    cpu_set_errno(ECHILD);
-                    return -1;
-                }
-            } else {
+            if (all_dead) {
+                waitq_finish(&sched_exit_wq, &e);
                 return 0;
             }
+            if (hpet_get_nanos() >= deadline) {
+                /* 500 seconds should be long enough for everything done */
+                waitq_finish(&sched_exit_wq, &e);
+                cpu_set_errno(ECHILD);
+                return -1;
+            }
+            waitq_wait(&sched_exit_wq, &e);
         }
     } else {
-        /* Retry for 20 times */
-        for (size_t i = 0; ; i++) {
+        uint64_t deadline = hpet_get_nanos() + WAITPID_PID_TIMEOUT;
+        while (true) {
+            waitq_prepare(&sched_exit_wq, &e, WAITPID_POLL_MILLIS);
+
             task_status_t status = sched_get_task_status(pid);
-            if (status != TASK_DEAD && status != TASK_UNKNOWN) {
-                sched_sleep(100);
-                if (i == 19) {
-                    kloge("k_waitpid: waiting pid 0x%x which is still active\n", pid);
-                    cpu_set_errno(EBUSY);
-                    return -1;
-                }
+            if (status == TASK_DEAD || status == TASK_UNKNOWN) {
+                waitq_finish(&sched_exit_wq, &e);
+                break;
+            }
+            if (hpet_get_nanos() >= deadline) {
+                waitq_finish(&sched_exit_wq, &e);
+                kloge("k_waitpid: waiting pid 0x%x which is still active\n", pid);
+                cpu_set_errno(EBUSY);
+                return -1;
             }
+            waitq_wait(&sched_exit_wq, &e);
         }
         klogd("k_waitpid: waiting pid 0x%x which is not active and exit\n", pid);
         return 0;
@@ -1263,28 +1560,78 @@ int64_t k_dup3(int64_t fh, int64_t newfh, int64_t flags)
     klogd("k_dup3: tid %d fh %d <- newfh %d, flags 0x%x\n",
           t->tid, fh, newfh, flags);
 
-    lock_lock(&vfs_lock);
+    mutex_lock(&vfs_lock);
     file_dup_t dup = {.fh = fh, .newfh = newfh};
     vec_push_back(&t->dup_list, dup);
-    lock_release(&vfs_lock);
+    mutex_unlock(&vfs_lock);
 
     return 0;
 }
 
-/* TODO: need to add futex implementation */
-int64_t k_futex_wait(int64_t *ptr, vfs_timespec_t *tv, int64_t expected)
+/* A NULL timeout means waiting forever */
+int64_t k_futex_wait(int32_t *ptr, vfs_timespec_t *tv, int64_t expected)
 {
-    klogi("k_futex_wait: time spec (%d, %d) with ptr 0x%x, val %d and "
-          "expected %d\n", tv->tv_sec, tv->tv_nsec, ptr, *ptr, expected);
+    time_t millis = 0;
+    int64_t ret;
+
+    cpu_set_errno(0);
+
+    if (tv != NULL) {
+        if (tv->tv_sec < 0 || tv->tv_nsec < 0 || tv->tv_nsec >= 1000000000) {
+            ret = -EINVAL;
+            goto err_exit;
+        }
+        millis = tv->tv_sec * 1000 + NANOS_TO_MILLIS(tv->tv_nsec);
+        /* Zero would wait forever, round a short timeout up */
+        if (millis == 0) millis = 1;
+    }
+
+    ret = futex_wait(ptr, (int32_t)expected, millis);
+    if (ret < 0) goto err_exit;
 
     return 0;
+
+err_exit:
+    if (debug_info) {
+        klogd("k_futex_wait: ptr 0x%x and expected %d returns error %d\n",
+              ptr, expected, -ret);
+    }
+    cpu_set_errno(-ret);
+    return -1;
 }
 
-int64_t k_futex_wake(int64_t *ptr)
+/* Wake all waiters, the same as the futex wake of mlibc */
+int64_t k_futex_wake(int32_t *ptr)
 {
-    klogi("k_futex_wake: ptr 0x%x and val %d\n", ptr, *ptr);
+    cpu_set_errno(0);
 
-    return 0;
+    int64_t ret = futex_wake(ptr, INT64_MAX);
+    if (ret < 0) {
+        cpu_set_errno(-ret);
+        return -1;
+    }
+
+    return ret;
+}
+
+/* Wake nr_wake waiters of ptr and move up to nr_requeue others to ptr2 */
+int64_t k_futex_requeue(int32_t *ptr, int64_t nr_wake,
+                        int32_t *ptr2, int64_t nr_requeue)
+{
+    cpu_set_errno(0);
+
+    if (nr_wake < 0 || nr_requeue < 0) {
+        cpu_set_errno(EINVAL);
+        return -1;
+    }
+
+    int64_t ret = futex_requeue(ptr, nr_wake, ptr2, nr_requeue);
+    if (ret < 0) {
+        cpu_set_errno(-ret);
+        return -1;
+    }
+
+    return ret;
 }
 
 syscall_ptr_t syscall_funcs[] = {
@@ -1325,10 +1672,15 @@ syscall_ptr_t syscall_funcs[] = {
     [SYSCALL_MEMINFO]       = (syscall_ptr_t)k_meminfo,         /* 34 */
     [SYSCALL_PIPE]          = (syscall_ptr_t)k_pipe,
     [SYSCALL_UNLINK]        = (syscall_ptr_t)k_unlink,          /* 36 */
-    (syscall_ptr_t)k_not_implemented,
-    (syscall_ptr_t)k_not_implemented,
+    [SYSCALL_MEMPROF]       = (syscall_ptr_t)k_memprof,
+    [SYSCALL_FUTEX_REQUEUE] = (syscall_ptr_t)k_futex_requeue,
     [SYSCALL_CHMOD]         = (syscall_ptr_t)k_chmod,           /* 39 */
-    (syscall_ptr_t)k_not_implemented,
+    [SYSCALL_LOCKSTAT]      = (syscall_ptr_t)k_lockstat,
+    [SYSCALL_IRQSOFF]       = (syscall_ptr_t)k_irqsoff,
+    [SYSCALL_COUNTERS]      = (syscall_ptr_t)k_counters,
+    [SYSCALL_NICE]          = (syscall_ptr_t)k_nice,
+    [SYSCALL_SCHED_SETAFFINITY] = (syscall_ptr_t)k_sched_setaffinity,   /* 44 */
+    [SYSCALL_SCHED_GETAFFINITY] = (syscall_ptr_t)k_sched_getaffinity,
     (syscall_ptr_t)k_not_implemented
 };
 
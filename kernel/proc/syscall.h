@@ -37,13 +37,35 @@
 #define SYSCALL_MEMINFO     34
 #define SYSCALL_PIPE        35
 #define SYSCALL_UNLINK      36
+#define SYSCALL_MEMPROF     37
+#define SYSCALL_FUTEX_REQUEUE 38
 #define SYSCALL_CHMOD       39
+#define SYSCALL_LOCKSTAT    40
+#define SYSCALL_IRQSOFF     41
+#define SYSCALL_COUNTERS    42
+#define SYSCALL_NICE        43
+#define SYSCALL_SCHED_SETAFFINITY 44
+#define SYSCALL_SCHED_GETAFFINITY 45
 
 /* Standard I/O devices */
 #define STDIN               0
 #define STDOUT              1
 #define STDERR              2
 
+/* Operations of memprof syscall */
+#define MEMPROF_REPORT      0
+#define MEMPROF_RESET       1
+#define MEMPROF_ENABLE      2
+#define MEMPROF_DISABLE     3
+
+/* Operations of lockstat syscall */
+#define LOCKSTAT_REPORT     0
+#define LOCKSTAT_RESET      1
+
+/* Operations of irqsoff syscall */
+#define IRQSOFF_REPORT      0
+#define IRQSOFF_RESET       1
+
 /* Used in memory map of syscall */
 #define MAP_PRIVATE         0x01
 #define MAP_SHARED          0x02
@@ -4,13 +4,17 @@ global syscall_handler
 extern k_print_log
 
 syscall_handler:
+    swapgs                              ; kernel gs, SFMASK keeps IF clear
+    mov [gs:CPU_SCRATCH_RSP], rsp       ; user stack, pushed below before
+                                        ; anything can switch tasks
+
     push r15                ; store r15 in user stack
     mov r15, rsp            ; save process stack to r15
 
     ; push information (gs, cs, rip, rflags, rip)
     ; but the below data are not used in current implementation
     push qword 0x3b         ; user data segment
-    push r15                ; saved stack
+    push qword [gs:CPU_SCRATCH_RSP] ; saved stack
     push r11                ; saved rflags
     push qword 0x43         ; user code segment 
     push rcx                ; current RIP
@@ -26,13 +30,14 @@ syscall_handler:
     ; pop all registers except rax which is used for storing return value
     pop_all_syscall
 
-    swapgs
+    ; A task which slept in the syscall resumes with IF set, but no interrupt
+    ; may come between swapgs and sysret, which restores IF from r11
+    cli
 
-    mov rdx, qword [gs:0x0]  ; return errno in rdx
+    mov rdx, qword [gs:CPU_ERRNO]  ; return errno in rdx
     mov rsp, r15             ; back to user stack
     pop r15                  ; pop r15 from user stack
 
-    swapgs
+    swapgs                   ; user gs
 
     o64 sysret
-
@@ -21,13 +21,18 @@
 #include <proc/task.h>
 #include <proc/sched.h>
 #include <base/kmalloc.h>
+#include <base/kmem_cache.h>
 #include <base/klog.h>
+#include <fs/filebase.h>
 #include <sys/cpu.h>
 #include <sys/hpet.h>
 #include <sys/apic.h>
+#include <sys/fpu.h>
 
 static task_id_t curr_tid = 1;
 
+static kmem_cache_t task_cache = kmem_cache_new("task_t", sizeof(task_t), NULL);
+
 task_t *task_make(
     const char *name, void (*entry)(task_id_t), task_priority_t priority,
     task_mode_t mode, addrspace_t *pas)
@@ -37,7 +42,8 @@ task_t *task_make(
         return NULL;
     }
 
-    task_t *ntask = kmalloc(sizeof(task_t));
+    task_t *ntask = (task_t*)kmem_cache_alloc(&task_cache);
+    if (ntask == NULL) return NULL;
     memset(ntask, 0, sizeof(task_t));
 
     ntask->tid = curr_tid;
@@ -70,7 +76,7 @@ task_t *task_make(
                 NUM_PAGES(STACK_SIZE),
                 VMM_FLAGS_DEFAULT | VMM_FLAGS_USERMODE);
 
-        mem_map_t m;
+        mem_map_t m = {0};
 
         m.vaddr = (uint64_t)ntask->ustack_limit;
         m.paddr = (uint64_t)ntask->ustack_limit;
@@ -114,6 +120,9 @@ task_t *task_make(
     ntask->tstack_top = ntask_regs;
     ntask->ptid = TID_MAX;
     ntask->priority = priority;
+    ntask->fpu_cpu = FPU_CPU_NONE;
+    ntask->on_cpu = false;
+    cpumask_fill(&ntask->cpus_allowed);
     ntask->last_tick = 0;
     ntask->status = TASK_READY;
 
@@ -179,12 +188,23 @@ task_t *task_fork(task_t *tp)
 
     task_debug(tp, false);
 
-    task_t *tc = (task_t*)kmalloc(sizeof(task_t));
+    task_t *tc = (task_t*)kmem_cache_alloc(&task_cache);
     if (tc == NULL) goto norm_exit;
 
     memcpy(tc, tp, sizeof(task_t));
     memset(&tc->mmap_list, 0, sizeof(tc->mmap_list));
-    memset(&tc->child_list, 0, sizeof(tc->child_list));
+    memset(&tc->scratch, 0, sizeof(tc->scratch));
+    tc->rcu_nesting = 0;
+    tc->on_cpu = false;
+    tc->all_next = NULL;
+    tc->children = NULL;
+    tc->sibling = NULL;
+    tc->rq_next = NULL;
+    tc->rq_pprev = NULL;
+    memset(&tc->timer, 0, sizeof(tc->timer));
+    tc->due_next = NULL;
+    tc->due_pprev = NULL;
+    memset(&tc->rq_node, 0, sizeof(tc->rq_node));
 
     tc->isforked = true;
     tc->addrspace = create_addrspace();
@@ -194,6 +214,13 @@ task_t *task_fork(task_t *tp)
           len, tp->tid, curr_tid);
     for (i = 0; i < len; i++) {
         mem_map_t m = vec_at(&(tp->mmap_list), i);
+        if (m.shared != NULL) {
+            /* Parent and child see the same pages, e.g., a futex word */
+            vmm_map(tc->addrspace, m.vaddr, m.paddr, m.np, m.flags);
+            refcount_inc(&m.shared->refcount);
+            vec_push_back(&tc->mmap_list, m);
+            continue;
+        }
         uint64_t ptr = VIRT_TO_PHYS(kmalloc(m.np * PAGE_SIZE));
         memcpy((void*)PHYS_TO_VIRT(ptr), (void*)PHYS_TO_VIRT(m.paddr),
                m.np * PAGE_SIZE);
@@ -215,6 +242,7 @@ task_t *task_fork(task_t *tp)
 
     tc->tid = curr_tid;
     tc->ptid = tp->tid;
+    fpu_fork(tc, tp);
 
     tc->kstack_limit = kmalloc(STACK_SIZE);
     memcpy(tc->kstack_limit, tp->kstack_limit, STACK_SIZE);
@@ -239,7 +267,7 @@ task_t *task_fork(task_t *tp)
         tr->rbp = (uint64_t)tc->kstack_limit + offset;
     }
 
-    /* Increase refcount of all open files */
+    /* Share node descriptors and thus seek positions with the parent */
     memcpy(&tc->openfiles, &tp->openfiles, sizeof(ht_t));
     for (i = 0; i < HT_ARRAY_SIZE; i++) {
         if (tc->openfiles.array[i].key == -1
@@ -247,11 +275,10 @@ task_t *task_fork(task_t *tp)
         {
             continue;
         }
-        vfs_node_desc_t* nd = (vfs_node_desc_t*)kmalloc(sizeof(vfs_node_desc_t));
-        memcpy(nd, tc->openfiles.array[i].data, sizeof(vfs_node_desc_t));
-        tc->openfiles.array[i].data = nd; 
-        nd->inode->refcount++;
-        klogd("TASK: copy fd %d from tid %d to tid %d\n",
+        vfs_node_desc_t* nd =
+            vfs_get_node_desc(tc->openfiles.array[i].data);
+        refcount_inc(&nd->inode->refcount);
+        klogd("TASK: share fd %d from tid %d with tid %d\n",
               tc->openfiles.array[i].key, tp->tid, tc->tid);
     }
 
@@ -272,7 +299,6 @@ task_t *task_fork(task_t *tp)
 #endif
 
     klogd("TASK: child tid %d and parent tid %d\n", tc->tid, tp->tid);
-    vec_push_back(&tp->child_list, tc->tid);
 
     curr_tid++;
 
@@ -280,17 +306,29 @@ norm_exit:
     return tc;
 }
 
+/* Free the pages of a block which is already unmapped, shared pages are
+ * only freed by the last task which maps them
+ */
+void task_mmap_release(mem_map_t *m)
+{
+    if (m->shared != NULL) {
+        if (!refcount_dec_and_test(&m->shared->refcount)) return;
+        kmfree(m->shared);
+    }
+    kmfree((void*)PHYS_TO_VIRT(m->paddr));
+}
+
 void task_free(task_t *t)
 {
     size_t mmap_num = vec_length(&t->mmap_list);
     for (size_t i = 0; i < mmap_num; i++) {
         mem_map_t m = vec_at(&t->mmap_list, i); 
         vmm_unmap(t->addrspace, m.vaddr, m.np);
-        kmfree((void*)PHYS_TO_VIRT(m.paddr));
+        task_mmap_release(&m);
     }
     vec_erase_all(&t->mmap_list);
-    vec_erase_all(&t->child_list);
     vec_erase_all(&t->dup_list);
+    fpu_free(t);
 
     klogi("task_idle: dead task tid %d free mmap number %d\n",
           t->tid, mmap_num);
@@ -300,6 +338,7 @@ void task_free(task_t *t)
         /* Notes that ustack memory is already free in mmap_list */
     }
     kmfree((void*)t->kstack_limit);
+    scratch_free(&t->scratch);
 
     size_t mem_num = vec_length(&t->addrspace->mem_list);
     for (size_t i = 0; i < mem_num; i++) {
@@ -326,6 +365,6 @@ void task_free(task_t *t)
      */
     klogv("TASK: try to free task %d (forked: %s)\n",
           t->tid, t->isforked ? "true" : "false");
-    kmfree(t);
+    kmem_cache_free(&task_cache, t);
 }
 
@@ -38,9 +38,13 @@
 #include <base/time.h>
 #include <base/vector.h>
 #include <base/hash.h>
+#include <base/scratch.h>
+#include <base/rbtree.h>
+#include <base/twheel.h>
 #include <sys/smp.h>
 #include <sys/mm.h>
 #include <fs/vfs.h>
+#include <proc/rcu.h>
 
 #define DEFAULT_KMODE_CODE      0b00101000 /* 0x28 */
 #define DEFAULT_KMODE_DATA      0b00110000 /* 0x30 */
@@ -136,6 +140,14 @@
 typedef uint64_t task_id_t;
 typedef uint8_t task_priority_t;
 
+/* Priority is the nice value plus 20, a lower one gets more CPU time */
+#define TASK_NICE_MIN           (-20)
+#define TASK_NICE_MAX           19
+#define TASK_PRIORITY_DEFAULT   20
+#define TASK_PRIORITY_IDLE      255
+
+#define task_nice(t)            ((int64_t)(t)->priority - TASK_PRIORITY_DEFAULT)
+
 typedef struct [[gnu::packed]] {
     uint64_t entry;
     uint64_t phdr;
@@ -155,6 +167,7 @@ typedef enum {
     TASK_READY,
     TASK_RUNNING,
     TASK_SLEEPING,
+    TASK_SUSPEND,       /* Blocked in a wait queue */
     TASK_DYING,
     TASK_DEAD,
     TASK_UNKNOWN
@@ -224,7 +237,6 @@ typedef struct task_t {
     bool            isforked;
 
     auxval_t        aux;
-    vec_struct(task_id_t)  child_list;
 
     ht_t            openfiles;
     vec_struct(file_dup_t) dup_list;
@@ -234,6 +246,29 @@ typedef struct task_t {
     addrspace_t     *addrspace;
     vec_struct(mem_map_t) mmap_list;
     uint64_t        fs_base;
+    void            *fpu;           /* Extended state, NULL until used */
+    uint16_t        fpu_cpu;        /* CPU whose registers hold the state */
+
+    scratch_t       scratch;
+
+    uint32_t        rcu_nesting;    /* Depth of RCU read-side sections */
+    struct task_t   *all_next;      /* Next one in the RCU list of tasks */
+    struct task_t   *children;      /* RCU list of its children */
+    struct task_t   *sibling;       /* Next one in its parent's children */
+    struct task_t   *rq_next;       /* Next one in its CPU's blocked list */
+    struct task_t   **rq_pprev;     /* Not NULL while in the blocked list */
+    uint16_t        rq_cpu;         /* CPU whose run queue owns it */
+    volatile bool   on_cpu;         /* A CPU still runs on its stacks */
+    cpumask_t       cpus_allowed;   /* CPUs it may run on */
+    twheel_node_t   timer;          /* Wakeup timer while blocked */
+    struct task_t   *due_next;      /* Next one in its CPU's due timers */
+    struct task_t   **due_pprev;    /* Not NULL while its timer is due */
+    rb_node_t       rq_node;        /* Node in its CPU's ready tree */
+    uint64_t        rq_weight;      /* Weight counted in the queue's load */
+    uint64_t        vruntime;       /* Runtime in ns weighted by priority */
+    uint64_t        exec_start;     /* When the runtime was last accounted */
+    uint64_t        slice_start;    /* When it got the CPU */
+    rcu_head_t      rcu;
 
     char            cwd[VFS_MAX_PATH_LEN];
     char            name[64];
@@ -246,3 +281,4 @@ task_t* task_make(
 task_t *task_fork(task_t *tp);
 void task_debug(task_t *t, bool force);
 void task_free(task_t *t);
+void task_mmap_release(mem_map_t *m);
@@ -0,0 +1,130 @@
+/**-----------------------------------------------------------------------------
+
+ @file    waitq.c
+ @brief   Implementation of wait queue related functions
+ @details
+ @verbatim
+
+  Lock order is wait queue lock first, then sched_lock. Wakers hold the wait
+  queue lock until the task is marked ready, so a waiter which timed out
+  can not return and release its entry in the middle of a wakeup.
+
+ @endverbatim
+
+ **-----------------------------------------------------------------------------
+ */
+#include <sys/panic.h>
+#include <proc/waitq.h>
+#include <proc/sched.h>
+
+static void waitq_remove(waitq_t *wq, waitq_entry_t *e)
+{
+    waitq_entry_t *prev = NULL;
+    for (waitq_entry_t *it = wq->head; it != NULL; prev = it, it = it->next) {
+        if (it != e) continue;
+        if (prev == NULL) {
+            wq->head = e->next;
+        } else {
+            prev->next = e->next;
+        }
+        if (wq->tail == e) wq->tail = prev;
+        break;
+    }
+    e->next = NULL;
+    e->queued = false;
+}
+
+/* Suspend the current task for at most millis (0 means waiting forever) */
+void waitq_prepare(waitq_t *wq, waitq_entry_t *e, time_t millis)
+{
+    e->task = sched_get_current_task();
+    e->next = NULL;
+    e->queued = false;
+
+    /* Nothing can be suspended before the scheduler starts */
+    if (e->task == NULL) return;
+
+    lock_lock(&wq->lock);
+    if (wq->tail == NULL) {
+        wq->head = e;
+    } else {
+        wq->tail->next = e;
+    }
+    wq->tail = e;
+    e->queued = true;
+    sched_prepare_suspend(e->task, millis);
+    lock_release(&wq->lock);
+}
+
+/*
+ * Sleeping with a spinlock held stalls its other users, which spin with
+ * interrupts disabled. Syscalls run with interrupts masked by SFMASK, so the
+ * held spinlocks are checked instead of the interrupt flag.
+ */
+void waitq_might_sleep(void)
+{
+    uint32_t held = lock_held_count();
+    if (held != 0) {
+        task_t *t = sched_get_current_task();
+        kpanic("WAITQ: tid %d may sleep with %d spinlocks held\n",
+               (t != NULL) ? t->tid : 0, held);
+    }
+}
+
+/* Returns false if it timed out */
+bool waitq_wait(waitq_t *wq, waitq_entry_t *e)
+{
+    if (e->task == NULL) return false;
+
+    waitq_might_sleep();
+
+    sched_suspend();
+
+    lock_lock(&wq->lock);
+    bool woken = !e->queued;
+    if (e->queued) waitq_remove(wq, e);
+    sched_cancel_suspend(e->task);
+    lock_release(&wq->lock);
+
+    return woken;
+}
+
+void waitq_finish(waitq_t *wq, waitq_entry_t *e)
+{
+    if (e->task == NULL) return;
+
+    lock_lock(&wq->lock);
+    if (e->queued) waitq_remove(wq, e);
+    sched_cancel_suspend(e->task);
+    lock_release(&wq->lock);
+}
+
+bool waitq_wake_one(waitq_t *wq)
+{
+    lock_lock(&wq->lock);
+    waitq_entry_t *e = wq->head;
+    if (e != NULL) {
+        waitq_remove(wq, e);
+        sched_wakeup(e->task);
+    }
+    lock_release(&wq->lock);
+
+    return e != NULL;
+}
+
+size_t waitq_wake_all(waitq_t *wq)
+{
+    size_t num = 0;
+
+    lock_lock(&wq->lock);
+    while (wq->head != NULL) {
+        waitq_entry_t *e = wq->head;
+        waitq_remove(wq, e);
+        sched_wakeup(e->task);
+        num++;
+    }
+    lock_release(&wq->lock);
+
+    return num;
+}
+
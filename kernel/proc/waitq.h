@@ -0,0 +1,58 @@
+/**-----------------------------------------------------------------------------
+
+ @file    waitq.h
+ @brief   Definition of wait queue related data structures and functions
+ @details
+ @verbatim
+
+  A task blocks on a wait queue in three steps to avoid lost wakeups:
+
+      waitq_entry_t e;
+      while (true) {
+          waitq_prepare(&wq, &e, 0);      // Queue and mark TASK_SUSPEND
+          if (condition) break;
+          waitq_wait(&wq, &e);            // Switch away until woken
+      }
+      waitq_finish(&wq, &e);              // Dequeue and mark running
+
+  A waker changes the condition first, then calls waitq_wake_one() or
+  waitq_wake_all(). Entries live on the waiter's stack, and every
+  waitq_prepare() must be followed by waitq_wait() or waitq_finish().
+
+  The timeout is set by waitq_prepare(), because the task may be preempted
+  and stay suspended before it reaches waitq_wait().
+
+ @endverbatim
+
+ **-----------------------------------------------------------------------------
+ */
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include <base/lock.h>
+#include <base/time.h>
+#include <proc/task.h>
+
+typedef struct waitq_entry {
+    task_t *task;
+    struct waitq_entry *next;
+    volatile bool queued;
+} waitq_entry_t;
+
+typedef struct {
+    lock_t lock;
+    waitq_entry_t *head;
+    waitq_entry_t *tail;
+} waitq_t;
+
+#define waitq_new()     (waitq_t){0}
+
+void waitq_might_sleep(void);
+void waitq_prepare(waitq_t *wq, waitq_entry_t *e, time_t millis);
+bool waitq_wait(waitq_t *wq, waitq_entry_t *e);
+void waitq_finish(waitq_t *wq, waitq_entry_t *e);
+bool waitq_wake_one(waitq_t *wq);
+size_t waitq_wake_all(waitq_t *wq);
+
@@ -8,6 +8,7 @@
    Important CPU initializations are:
    * Write Combining : Write this bit to speed up framebuffer read/write speed.
    * SSE & SSE2      : We should enable them for SIMD operations.
+   * XSAVE           : Extended states of tasks are switched lazily, see fpu.c.
 
  @endverbatim
 
@@ -16,6 +17,7 @@
 #include <libc/string.h>
 
 #include <sys/cpu.h>
+#include <sys/fpu.h>
 #include <base/klog.h>
 
 static bool cpu_initialized = false;
@@ -127,6 +129,8 @@ void cpu_init()
     vcr4 |= 1 << 10; 
     write_cr("cr4", vcr4);
 
+    fpu_init();
+
     uint32_t x, y, na;
     cpuid(0, 0, &na, &y, &na, &na);
 
@@ -15,6 +15,7 @@
 #include <stdbool.h>
 
 #define MSR_PAT             0x0277
+#define MSR_TSC_DEADLINE    0x06E0
 
 #define MSR_FS_BASE         0xC0000100
 #define MSR_GS_BASE         0xC0000101
@@ -115,6 +116,38 @@ static inline void write_msr(uint32_t msr, uint64_t val)
                  : "eax", "ecx", "edx");
 }
 
+/* Disable interrupts and return the previous rflags */
+static inline uint64_t irq_save(void)
+{
+    uint64_t rflags;
+    asm volatile("pushfq;"
+                 "pop %0;"
+                 "cli;"
+                 : "=r"(rflags)
+                 :
+                 : "memory");
+    return rflags;
+}
+
+static inline void irq_restore(uint64_t rflags)
+{
+    asm volatile("push %0;"
+                 "popfq;"
+                 :
+                 : "r"(rflags)
+                 : "memory", "cc");
+}
+
+/* Read time-stamp counter, which counts CPU cycles since reset */
+static inline uint64_t read_tsc(void)
+{
+    uint32_t low, high;
+
+    asm volatile("rdtsc" : "=a"(low), "=d"(high));
+
+    return ((uint64_t)high << 32) | low;
+}
+
 /* Port I/O functions */
 static inline uint8_t port_inb(uint16_t port)
 {
@@ -250,5 +283,17 @@ static const cpuid_feature_t CPUID_FEATURE_APIC = {
     .reg = CPUID_REG_EDX,
     .mask = 1 << 9 };
 
+static const cpuid_feature_t CPUID_FEATURE_TSC_DEADLINE = {
+    .func = 0x00000001,
+    .reg = CPUID_REG_ECX,
+    .mask = 1 << 24 };
+
+static const cpuid_feature_t CPUID_FEATURE_XSAVE = {
+    .func = 0x00000001,
+    .reg = CPUID_REG_ECX,
+    .mask = 1 << 26 };
+
+void cpuid(uint32_t func, uint32_t param, uint32_t* eax, uint32_t* ebx,
+           uint32_t* ecx, uint32_t* edx);
 bool cpuid_check_feature(cpuid_feature_t feature);
 
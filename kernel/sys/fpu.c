@@ -0,0 +1,233 @@
+/**-----------------------------------------------------------------------------
+
+ @file    fpu.c
+ @brief   Implementation of FPU/SSE/AVX state switching related functions
+ @details
+ @verbatim
+
+  Every CPU remembers the task whose state is in its registers. A task
+  which had TS clear, i.e., which got the registers in its slice, is saved
+  when it is switched out, before it can be picked by other CPUs. XSAVEOPT
+  skips the components which it did not modify since they were restored.
+
+  The registers stay as they are, so if the same task comes back and
+  nobody used the FPU of this CPU in between, TS is cleared at once without
+  any restore. fpu_cpu of the task tells whether its registers are still
+  on this CPU, since it may have run and saved newer state somewhere else.
+
+ @endverbatim
+
+ **-----------------------------------------------------------------------------
+ */
+#include <libc/string.h>
+
+#include <base/klog.h>
+#include <base/kmalloc.h>
+#include <base/counter.h>
+#include <sys/fpu.h>
+#include <sys/cpu.h>
+#include <sys/smp.h>
+#include <sys/isr_base.h>
+#include <sys/panic.h>
+#include <proc/sched.h>
+
+#define CR0_TS                  (1 << 3)
+#define CR4_OSXSAVE             (1 << 18)
+
+#define FPU_EXC_NM              7
+
+/* x87, SSE, AVX and the three AVX-512 components */
+#define XFEATURE_MASK           0xE7ULL
+#define XFEATURE_MASK_AVX512    0xE0ULL
+
+#define FXSAVE_SIZE             512
+#define FPU_FCW_DEFAULT         0x037F
+#define FPU_MXCSR_DEFAULT       0x1F80
+
+static bool fpu_has_xsave = false;
+static bool fpu_has_xsaveopt = false;
+static uint64_t fpu_xfeatures = 0;
+static size_t fpu_size = FXSAVE_SIZE;
+
+static task_t *fpu_owner[CPU_MAX] = {0};
+static bool fpu_active[CPU_MAX] = {0};     /* TS is clear */
+
+static counter_t fpu_restores = counter_new("fpu.restores");
+
+static inline void fpu_clts(void)
+{
+    asm volatile("clts" ::: "memory");
+}
+
+static inline void fpu_stts(void)
+{
+    uint64_t cr0;
+    read_cr("cr0", &cr0);
+    write_cr("cr0", cr0 | CR0_TS);
+}
+
+static void fpu_save(void *area)
+{
+    uint32_t low = (uint32_t)fpu_xfeatures;
+    uint32_t high = (uint32_t)(fpu_xfeatures >> 32);
+
+    if (fpu_has_xsaveopt) {
+        asm volatile("xsaveopt64 (%0)"
+                     : : "r"(area), "a"(low), "d"(high) : "memory");
+    } else if (fpu_has_xsave) {
+        asm volatile("xsave64 (%0)"
+                     : : "r"(area), "a"(low), "d"(high) : "memory");
+    } else {
+        asm volatile("fxsave64 (%0)" : : "r"(area) : "memory");
+    }
+}
+
+static void fpu_restore(void *area)
+{
+    uint32_t low = (uint32_t)fpu_xfeatures;
+    uint32_t high = (uint32_t)(fpu_xfeatures >> 32);
+
+    if (fpu_has_xsave) {
+        asm volatile("xrstor64 (%0)"
+                     : : "r"(area), "a"(low), "d"(high) : "memory");
+    } else {
+        asm volatile("fxrstor64 (%0)" : : "r"(area) : "memory");
+    }
+}
+
+/*
+ * kmalloc() returns whole pages, so the area is 64-byte aligned as XSAVE
+ * requires. A zero XSAVE header restores the components in init state.
+ */
+static void *fpu_alloc(void)
+{
+    uint8_t *area = (uint8_t*)kmalloc(fpu_size);
+    if (area == NULL) return NULL;
+
+    memset(area, 0, fpu_size);
+    *(uint16_t*)(area + 0) = FPU_FCW_DEFAULT;
+    *(uint32_t*)(area + 24) = FPU_MXCSR_DEFAULT;
+    return area;
+}
+
+/* #NM: the current task uses the FPU while TS is set */
+static void fpu_nm_handler(void)
+{
+    cpu_t *cpu = smp_get_current_cpu(false);
+    task_t *t = sched_get_current_task();
+
+    if (cpu == NULL || t == NULL)
+        kpanic("FPU: device not available without current task\n");
+
+    uint16_t cpu_id = cpu->cpu_id;
+
+    fpu_clts();
+    fpu_active[cpu_id] = true;
+
+    if (fpu_owner[cpu_id] == t && t->fpu_cpu == cpu_id) return;
+
+    if (t->fpu == NULL) {
+        t->fpu = fpu_alloc();
+        if (t->fpu == NULL)
+            kpanic("FPU: no memory for state of tid %d\n", t->tid);
+    }
+
+    fpu_restore(t->fpu);
+    fpu_owner[cpu_id] = t;
+    t->fpu_cpu = cpu_id;
+    counter_inc(&fpu_restores);
+}
+
+/* Called by cpu_init() on every CPU */
+void fpu_init(void)
+{
+    uint32_t eax, ebx, ecx, edx;
+
+    if (cpuid_check_feature(CPUID_FEATURE_XSAVE)) {
+        uint64_t cr4;
+        read_cr("cr4", &cr4);
+        write_cr("cr4", cr4 | CR4_OSXSAVE);
+
+        cpuid(0xD, 0, &eax, &ebx, &ecx, &edx);
+        uint64_t xfeatures = (((uint64_t)edx << 32) | eax) & XFEATURE_MASK;
+        if ((xfeatures & XFEATURE_MASK_AVX512) != XFEATURE_MASK_AVX512)
+            xfeatures &= ~XFEATURE_MASK_AVX512;
+        asm volatile("xsetbv"
+                     : : "c"(0), "a"((uint32_t)xfeatures),
+                         "d"((uint32_t)(xfeatures >> 32)));
+
+        /* EBX is the size for the components enabled in XCR0 */
+        cpuid(0xD, 0, &eax, &ebx, &ecx, &edx);
+        fpu_size = ebx;
+        fpu_xfeatures = xfeatures;
+        fpu_has_xsave = true;
+
+        cpuid(0xD, 1, &eax, &ebx, &ecx, &edx);
+        fpu_has_xsaveopt = (eax & 1) != 0;
+    }
+
+    /* No task owns the registers yet, the first use traps */
+    fpu_stts();
+
+    exc_register_handler(FPU_EXC_NM, fpu_nm_handler);
+
+    klogi("FPU: %s with features 0x%x, state size %d bytes\n",
+          fpu_has_xsaveopt ? "XSAVEOPT" : (fpu_has_xsave ? "XSAVE" : "FXSAVE"),
+          fpu_xfeatures, fpu_size);
+}
+
+size_t fpu_state_size(void)
+{
+    return fpu_size;
+}
+
+/* Must be called before prev can be picked by other CPUs */
+void fpu_switch_out(uint16_t cpu_id, task_t *prev)
+{
+    if (fpu_active[cpu_id] && fpu_owner[cpu_id] == prev)
+        fpu_save(prev->fpu);
+}
+
+void fpu_switch_in(uint16_t cpu_id, task_t *next)
+{
+    bool live = (fpu_owner[cpu_id] == next && next->fpu_cpu == cpu_id);
+
+    if (live == fpu_active[cpu_id]) return;
+
+    if (live) {
+        fpu_clts();
+    } else {
+        fpu_stts();
+    }
+    fpu_active[cpu_id] = live;
+}
+
+/* The child gets a copy of the state of its parent, which is running */
+void fpu_fork(task_t *tc, task_t *tp)
+{
+    tc->fpu = NULL;
+    tc->fpu_cpu = FPU_CPU_NONE;
+
+    if (tp->fpu == NULL) return;
+
+    uint64_t rflags = irq_save();
+    cpu_t *cpu = smp_get_current_cpu(false);
+    if (cpu != NULL && fpu_active[cpu->cpu_id]
+        && fpu_owner[cpu->cpu_id] == tp)
+    {
+        fpu_save(tp->fpu);
+    }
+    irq_restore(rflags);
+
+    tc->fpu = kmalloc(fpu_size);
+    if (tc->fpu == NULL) kpanic("FPU: no memory for state of tid %d\n", tc->tid);
+    memcpy(tc->fpu, tp->fpu, fpu_size);
+}
+
+/* Other CPUs may still name it as owner, fpu_cpu of a new task never matches */
+void fpu_free(task_t *t)
+{
+    if (t->fpu != NULL) kmfree(t->fpu);
+    t->fpu = NULL;
+    t->fpu_cpu = FPU_CPU_NONE;
+}
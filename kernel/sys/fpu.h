@@ -0,0 +1,38 @@
+/**-----------------------------------------------------------------------------
+
+ @file    fpu.h
+ @brief   Definition of FPU/SSE/AVX state switching related functions
+ @details
+ @verbatim
+
+  Each task which uses the FPU has its own extended state area, sized by
+  CPUID leaf 0xD and saved with XSAVEOPT (XSAVE or FXSAVE on older CPUs).
+  The kernel itself never touches these registers, it is built with
+  -mgeneral-regs-only.
+
+  State is switched lazily. CR0.TS is set when a task which does not own
+  the registers of its CPU is switched in, and its first FPU instruction
+  raises #NM, which restores its state. Tasks which never use the FPU do not
+  have an area and cost nothing.
+
+ @endverbatim
+
+ **-----------------------------------------------------------------------------
+ */
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <proc/task.h>
+
+/* fpu_cpu of a task whose state is in no CPU's registers */
+#define FPU_CPU_NONE        UINT16_MAX
+
+void fpu_init(void);
+size_t fpu_state_size(void);
+
+void fpu_switch_out(uint16_t cpu_id, task_t *prev);
+void fpu_switch_in(uint16_t cpu_id, task_t *next);
+void fpu_fork(task_t *tc, task_t *tp);
+void fpu_free(task_t *t);
@@ -86,8 +86,11 @@ void exc_handler_proc(uint64_t excno, task_regs_t *tr, uint64_t errcode)
         /* If the IRQ came from the Master PIC, it is sufficient to issue EOI
          * command only to the Master PIC; however if the IRQ came from the
          * Slave PIC, it is necessary to issue EOI to both PIC chips.
+         * Exceptions, e.g., #NM for lazy FPU switching, need no EOI.
          */
-        if (excno >= IRQ0 + 8) {
+        if (excno < IRQ0) {
+            return;
+        } else if (excno >= IRQ0 + 8) {
             port_outb(PIC1, PIC_EOI);
             port_outb(PIC2, PIC_EOI);
         } else {
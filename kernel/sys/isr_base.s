@@ -41,9 +41,20 @@
     pop %rax
 .endm
 
+/* Switch between the user's and the kernel's gs base if the interrupt frame
+ * whose CS is at off(%rsp) belongs to ring 3
+ */
+.macro swapgs_if_user off
+    testb $3, \off(%rsp)
+    jz 1f
+    swapgs
+1:
+.endm
+
 .macro exc_noerrcode excno
 .global exc\excno
 exc\excno:
+    swapgs_if_user 8
     pushq (5 * 8)(%rsp)
     pushq (5 * 8)(%rsp)
     pushq (5 * 8)(%rsp)
@@ -64,6 +75,7 @@ exc\excno:
 .macro exc_errcode excno
 .global exc\excno
 exc\excno:
+    swapgs_if_user 16
     pushq (5 * 8)(%rsp)
     pushq (5 * 8)(%rsp)
     pushq (5 * 8)(%rsp)
@@ -77,12 +89,20 @@ exc\excno:
     movq (20 * 8)(%rsp), %rdx
 
     call exc_handler_proc
-    jmp .exc_end
+    jmp .exc_end_errcode
 .endm
 
 .exc_end:
     popam
     addq $40, %rsp
+    swapgs_if_user 8
+    iretq
+
+/* The error code is skipped as well */
+.exc_end_errcode:
+    popam
+    addq $48, %rsp
+    swapgs_if_user 8
     iretq
 
 exc_noerrcode   0
@@ -109,6 +129,7 @@ exc_errcode     30
 .macro irq_noerrcode irqno
 .global irq\irqno
 irq\irqno:
+    swapgs_if_user 8
     pushq (6 * 8)(%rsp)
     pushq (6 * 8)(%rsp)
     pushq (6 * 8)(%rsp)
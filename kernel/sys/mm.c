@@ -21,7 +21,8 @@
   PMM: The method behind PMM is very simple. The memories with type -
   STIVALE2_MMAP_USABLE are devided into 4K-size pages. A bitmap array is
   used for indicated whether it is free or not. One bit for one page in
-  bitmap array.
+  bitmap array. The bitmap is protected by pmm_lock, which is a leaf lock,
+  since PMM is used by kmalloc, page tables and tasks without a common lock.
 
  @endverbatim
 
@@ -40,8 +41,11 @@
 #include <base/kmalloc.h>
 #include <base/klib.h>
 #include <base/vector.h>
+#include <base/counter.h>
 
 static mem_info_t kmem_info = {0};
+static lock_t pmm_lock = {0};
+static counter_t kmem_free_size = counter_new("pmm.free_bytes");
 static addrspace_t kaddrspace = {0};
 static bool debug_info = false;
 
@@ -71,9 +75,10 @@ static bool bitmap_isfree(uint64_t addr, uint64_t numpages)
 void pmm_free(uint64_t addr, uint64_t numpages,
     const char *func, size_t line)
 {
+    lock_lock(&pmm_lock);
     for (uint64_t i = addr; i < addr + (numpages * PAGE_SIZE); i += PAGE_SIZE) {
         if (!bitmap_isfree(i, 1))
-            kmem_info.free_size += PAGE_SIZE;
+            counter_add(&kmem_free_size, PAGE_SIZE);
         
         kmem_info.bitmap[i / (PAGE_SIZE * BMP_PAGES_PER_BYTE)]
             |= 1 << ((i / PAGE_SIZE) % BMP_PAGES_PER_BYTE);
@@ -81,32 +86,47 @@ void pmm_free(uint64_t addr, uint64_t numpages,
     /* The below log is for debugging memory leaks */
     if (numpages > 8 && debug_info) {
         klogi("pmm_free: %s(%d) free 0x%11x %d pages and available memory are "
-              "%d bytes\n", func, line, addr, numpages, kmem_info.free_size);
+              "%d bytes\n", func, line, addr, numpages,
+              counter_read(&kmem_free_size));
     }
+    lock_release(&pmm_lock);
 }
 
-bool pmm_alloc(uint64_t addr, uint64_t numpages)
+/* Must be called with pmm_lock held */
+static bool pmm_alloc_impl(uint64_t addr, uint64_t numpages)
 {
     if (!bitmap_isfree(addr, numpages))
         return false;
 
     bitmap_markused(addr, numpages);
-    kmem_info.free_size -= numpages * PAGE_SIZE;
+    counter_add(&kmem_free_size, -(int64_t)(numpages * PAGE_SIZE));
     return true;
 }
 
+bool pmm_alloc(uint64_t addr, uint64_t numpages)
+{
+    lock_lock(&pmm_lock);
+    bool ret = pmm_alloc_impl(addr, numpages);
+    lock_release(&pmm_lock);
+    return ret;
+}
+
 uint64_t pmm_get(uint64_t numpages, uint64_t baseaddr, 
     const char *func, size_t line)
 {
+    lock_lock(&pmm_lock);
     for (uint64_t i = baseaddr; i < kmem_info.phys_limit; i += PAGE_SIZE) {
-        if (pmm_alloc(i, numpages)) {
+        if (pmm_alloc_impl(i, numpages)) {
             if (numpages > 8 && debug_info) {
                 klogi("pmm_get: %s(%d) gets 0x%11x with %d pages from memory "
-                      "%d bytes\n", func, line, i, numpages, kmem_info.free_size);
+                      "%d bytes\n", func, line, i, numpages,
+                      counter_read(&kmem_free_size));
             }
+            lock_release(&pmm_lock);
             return i;
         }
     }
+    lock_release(&pmm_lock);
 
     kpanic("Out of Physical Memory");
     return 0;
@@ -116,7 +136,7 @@ void pmm_init(struct limine_memmap_response* map)
 {
     kmem_info.phys_limit = 0;
     kmem_info.total_size = 0;
-    kmem_info.free_size = 0;
+    counter_reset(&kmem_free_size);
 
     klogv("Physical memory's entry number: %d\n", map->entry_count);
 
@@ -179,7 +199,8 @@ void pmm_init(struct limine_memmap_response* map)
     klogi("PMM initialization finished\n");   
     klogi("Memory total: %d, phys limit: %d (0x%x), free: %d, used: %d\n",
           kmem_info.total_size, kmem_info.phys_limit, kmem_info.phys_limit,
-          kmem_info.free_size, kmem_info.total_size - kmem_info.free_size);
+          counter_read(&kmem_free_size),
+          kmem_info.total_size - counter_read(&kmem_free_size));
 }
 
 uint64_t pmm_get_total_memory(void)
@@ -187,9 +208,14 @@ uint64_t pmm_get_total_memory(void)
     return kmem_info.total_size / (1024 * 1024);
 }
 
+uint64_t pmm_get_phys_limit(void)
+{
+    return kmem_info.phys_limit;
+}
+
 void pmm_dump_usage(void)
 {
-    uint64_t t = kmem_info.total_size, f = kmem_info.free_size,
+    uint64_t t = kmem_info.total_size, f = counter_read(&kmem_free_size),
              u = t - f;
 
     kprintf("Physical memory usage:\n"
@@ -201,20 +227,7 @@ void pmm_dump_usage(void)
             u / 1024, u / (1024 * 1024));
 
 #ifdef ENABLE_MEM_DEBUG
-    kprintf("Checking #%d\n", kmalloc_checkno);
-    size_t np = MIN(NUM_PAGES(kmem_info.phys_limit), 1024 * 256);
-    for (uint64_t addr = 0; addr < np * PAGE_SIZE; addr += PAGE_SIZE) {
-        if (bitmap_isfree(addr, 1)) continue;
-        memory_metadata_t *alloc = (memory_metadata_t*)PHYS_TO_VIRT(addr);
-        if (alloc->magic == MEM_MAGIC_NUM) {
-            if (alloc->checkno == kmalloc_checkno && kmalloc_checkno > 0) {
-                kprintf("0x%x %s():%d %d bytes\n", alloc, alloc->filename,
-                        alloc->lineno, alloc->size);
-            }
-        }
-    }
-    kmalloc_checkno++;
-    kprintf("Update checking point to #%d for kmalloc()\n", kmalloc_checkno);
+    kmalloc_dump_leaks();
 #endif
 }
 
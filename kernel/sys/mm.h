@@ -22,6 +22,7 @@
 
 #include <3rd-party/boot/limine.h>
 #include <base/lock.h>
+#include <base/refcount.h>
 #include <base/vector.h>
 
 #define PAGE_SIZE               4096
@@ -44,16 +45,22 @@
 typedef struct {
     uint64_t phys_limit;
     uint64_t total_size;
-    uint64_t free_size;
 
     uint8_t *bitmap;
 } mem_info_t;
 
+/* Pages of a MAP_SHARED block, freed when the last task drops them */
+typedef struct {
+    refcount_t refcount;
+    uint64_t paddr;
+} mem_shared_t;
+
 typedef struct {
     uint64_t vaddr;
     uint64_t paddr;
     uint64_t flags;
     uint64_t np; 
+    mem_shared_t *shared;   /* MAP_SHARED, fork maps the same pages */
 } mem_map_t;
 
 void pmm_init(struct limine_memmap_response* map);
@@ -64,6 +71,7 @@ void pmm_free(uint64_t addr, uint64_t numpages,
 bool pmm_alloc(uint64_t addr, uint64_t numpages);
 void pmm_dump_usage(void);
 uint64_t pmm_get_total_memory(void);
+uint64_t pmm_get_phys_limit(void);
 
 #define VMM_FLAG_PRESENT        (1 << 0)
 #define VMM_FLAG_READWRITE      (1 << 1)
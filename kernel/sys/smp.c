@@ -39,55 +39,35 @@ static volatile int* ap_boot_counter = (volatile int*)PHYS_TO_VIRT(SMP_AP_BOOT_C
 
 static smp_info_t* smp_info = NULL;
 
-static bool smp_initialized = false;
-
-static lock_t smp_lock = {0};
+bool smp_initialized = false;
 
 const smp_info_t* smp_get_info()
 {
     return smp_info;
 }
 
-/* The reason why there is a force_read parameter here is that when
- * initializing SMP, it should not return NULL if we know this CPU
- * is already initialized. Check the code in proc/sched.c whose
- * parameter is true.
+/* Used until smp_initialized is set, e.g., by locks taken while a CPU boots
+ * and its gs base may not be loaded yet.
  */
-cpu_t* smp_get_current_cpu(bool force_read)
+cpu_t* smp_get_boot_cpu(void)
 {
-    if (smp_initialized || force_read) {
-        cpu_t *cpu = (cpu_t*)read_msr(MSR_KERN_GS_BASE);
-        if (cpu == NULL) cpu = (cpu_t*)read_msr(MSR_GS_BASE);
-        return cpu;
-    } else {
-        return NULL;
-    }
+    return (cpu_t*)read_msr(MSR_GS_BASE);
 }
 
-/* This is the only function in this module which will be called very
- * oftenly in syscall functions.
+/* Must be called after gdt_init() which reloads gs and clears its base. The
+ * user's gs base starts as 0 and is swapped in by SWAPGS on the way out.
  */
-bool cpu_set_errno(int64_t val)
+void smp_set_current_cpu(cpu_t *cpu)
 {
-    lock_lock(&smp_lock);
-    if (smp_initialized) {
-        cpu_t *cpu = (cpu_t*)read_msr(MSR_KERN_GS_BASE);
-        if (cpu == NULL) cpu = (cpu_t*)read_msr(MSR_GS_BASE);
-        if (cpu != NULL) {
-            cpu->errno = val;
-            lock_release(&smp_lock);
-            return true;
-        }
-    }
-    lock_release(&smp_lock);
-    return false;
+    cpu->self = cpu;
+    write_msr(MSR_GS_BASE, (uint64_t)cpu);
+    write_msr(MSR_KERN_GS_BASE, 0);
 }
 
 void cpu_debug(void)
 {
     if (smp_initialized) {
-        cpu_t *cpu = (cpu_t*)read_msr(MSR_KERN_GS_BASE);
-        if (cpu == NULL) cpu = (cpu_t*)read_msr(MSR_GS_BASE);
+        cpu_t *cpu = percpu_read(self);
         if (cpu != NULL) {
             klogd("CPU: total_num %d, current id %d, kernel stack 0x%x\n",
                   smp_info->num_cpus, cpu->cpu_id, cpu->tss.rsp0);
@@ -115,8 +95,7 @@ _Noreturn void smp_ap_entrypoint(cpu_t* cpuinfo)
     init_tss(cpuinfo);
  
     /* put cpu information in gs */
-    write_msr(MSR_GS_BASE, (uint64_t)cpuinfo);
-    write_msr(MSR_KERN_GS_BASE, (uint64_t)cpuinfo);
+    smp_set_current_cpu(cpuinfo);
 
     /* enable the apic */
     apic_enable();
@@ -189,8 +168,7 @@ void smp_init()
         if (apic_read_reg(APIC_REG_ID) == lapics[i]->apic_id) {
             klogi("SMP: core %d is BSP\n", lapics[i]->proc_id);
             smp_info->cpus[smp_info->num_cpus].is_bsp = true;
-            write_msr(MSR_GS_BASE, (uint64_t)&(smp_info->cpus[smp_info->num_cpus]));
-            write_msr(MSR_KERN_GS_BASE, (uint64_t)&(smp_info->cpus[smp_info->num_cpus]));
+            smp_set_current_cpu(&(smp_info->cpus[smp_info->num_cpus]));
             for (uint64_t dl = 0; dl < 100; dl++) asm volatile ("nop;");
             init_tss(&(smp_info->cpus[smp_info->num_cpus]));
             smp_info->num_cpus++;
@@ -15,6 +15,7 @@
 #pragma once
 
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
 
 #define SMP_TRAMPOLINE_BLOB_ADDR        0x1000
@@ -59,11 +60,19 @@ typedef struct [[gnu::packed]] {
 
 /*
  * In 64bit and with smp, there is a local structure for each cpu stored in the
- * gs register (other kernels can use fs). This structure contains a temporary
- * stack for the syscall, an address to store the process stack temporarily.
+ * gs register (other kernels can use fs). While the CPU runs kernel code,
+ * GS_BASE points to it and KERNEL_GS_BASE holds the user's gs base. Every
+ * entry from ring 3 (syscall, interrupts and exceptions) does SWAPGS before
+ * touching gs and again before returning, so each field is one gs-relative
+ * load away from any kernel code. The offsets are also used by assembly, see
+ * sys/cpu_macros.mac; errno must stay at gs:0 since the syscall exit path
+ * returns it in rdx.
  */
-typedef struct [[gnu::packed]] {
+typedef struct [[gnu::packed]] cpu {
     int64_t errno;
+    struct cpu *self;                   /* Address of this structure */
+    struct task_t *task;                /* Task running on this CPU */
+    uint64_t scratch_rsp;               /* User rsp at syscall entry */
     tss_t tss;
     uint16_t cpu_id;
     uint16_t lapic_id;
@@ -71,13 +80,86 @@ typedef struct [[gnu::packed]] {
     uint8_t reserved_1[3];
 } cpu_t;
 
+_Static_assert(offsetof(cpu_t, errno) == 0, "errno must be at gs:0");
+_Static_assert(offsetof(cpu_t, self) == 8, "see CPU_SELF");
+_Static_assert(offsetof(cpu_t, task) == 16, "see CPU_TASK");
+_Static_assert(offsetof(cpu_t, scratch_rsp) == 24, "see CPU_SCRATCH_RSP");
+
+/* Access a field of the current CPU's structure with a single instruction */
+#define percpu_read(field) ({                                               \
+    __typeof__(((cpu_t*)0)->field) __val;                                   \
+    asm volatile("mov %%gs:%c1, %0"                                         \
+                 : "=r"(__val) : "i"(offsetof(cpu_t, field)));              \
+    __val;                                                                  \
+})
+
+#define percpu_write(field, val) do {                                       \
+    __typeof__(((cpu_t*)0)->field) __val = (val);                           \
+    asm volatile("mov %0, %%gs:%c1"                                         \
+                 : : "r"(__val), "i"(offsetof(cpu_t, field)) : "memory");   \
+} while (0)
+
+/* One bit per CPU id, e.g., the CPUs which a task is allowed to run on */
+typedef struct {
+    uint64_t bits[CPU_MAX / 64];
+} cpumask_t;
+
+static inline void cpumask_clear(cpumask_t *m)
+{
+    for (int i = 0; i < CPU_MAX / 64; i++) m->bits[i] = 0;
+}
+
+static inline void cpumask_fill(cpumask_t *m)
+{
+    for (int i = 0; i < CPU_MAX / 64; i++) m->bits[i] = ~(uint64_t)0;
+}
+
+static inline void cpumask_set(cpumask_t *m, uint16_t cpu_id)
+{
+    m->bits[cpu_id / 64] |= (uint64_t)1 << (cpu_id % 64);
+}
+
+static inline bool cpumask_test(const cpumask_t *m, uint16_t cpu_id)
+{
+    return (m->bits[cpu_id / 64] >> (cpu_id % 64)) & 1;
+}
+
 typedef struct {
     cpu_t cpus[CPU_MAX];
     uint16_t num_cpus;
 } smp_info_t;
 
+extern bool smp_initialized;
+
 void smp_init(void);
 const smp_info_t* smp_get_info(void);
-cpu_t* smp_get_current_cpu(bool force_read);
-bool cpu_set_errno(int64_t val);
+void smp_set_current_cpu(cpu_t *cpu);
+cpu_t* smp_get_boot_cpu(void);
 void cpu_debug(void);
+
+/* Returns NULL until SMP is initialized, unless force_read is set, e.g., by
+ * locks and counters which run while CPUs are still booting.
+ */
+static inline cpu_t* smp_get_current_cpu(bool force_read)
+{
+    if (__builtin_expect(smp_initialized, 1))
+        return percpu_read(self);
+    return force_read ? smp_get_boot_cpu() : NULL;
+}
+
+/* The id of the current CPU, 0 before its structure is set up */
+static inline uint16_t smp_get_cpu_id(void)
+{
+    if (__builtin_expect(smp_initialized, 1))
+        return percpu_read(cpu_id);
+    cpu_t *cpu = smp_get_boot_cpu();
+    return (cpu != NULL) ? cpu->cpu_id : 0;
+}
+
+/* Called by almost every syscall, only touches the current CPU */
+static inline bool cpu_set_errno(int64_t val)
+{
+    if (!smp_initialized) return false;
+    percpu_write(errno, val);
+    return true;
+}
@@ -20,7 +20,11 @@
 
   TSC-Deadline mode:
   - Similar with one-shot mode but using CPU's time stamp counter instead
-    to get higher precision.
+    to get higher precision. Software writes the TSC value at which the
+    IRQ is generated into IA32_TSC_DEADLINE MSR. It is preferred if CPUID
+    reports it, and periodic ticks are emulated by arming the next deadline
+    in every timer IRQ. An extra event, e.g., the expiry of a sleeper, can be
+    armed between two ticks, and the MSR always holds the earlier one.
 
  @endverbatim
    Ref: https://wiki.osdev.org/APIC_timer
@@ -31,6 +35,9 @@
 #include <sys/apic.h>
 #include <sys/idt.h>
 #include <sys/pit.h>
+#include <sys/hpet.h>
+#include <sys/cpu.h>
+#include <sys/smp.h>
 #include <base/klog.h>
 #include <base/time.h>
 
@@ -38,6 +45,16 @@ static uint64_t base_freq = 0;
 static uint8_t divisor = 0;
 static uint8_t vector = 0;
 
+static bool tsc_deadline = false;
+static uint64_t tsc_freq = 0;
+
+/* Emulated periodic ticks of TSC-deadline mode, period 0 means one-shot */
+static struct {
+    uint64_t deadline;              /* UINT64_MAX if nothing is armed */
+    uint64_t period;
+    uint64_t event;                 /* Extra one-shot IRQ, 0 if none */
+} timer_cpus[CPU_MAX] = {0};
+
 [[gnu::interrupt]] void apic_timer_handler(void* v);
 
 void apic_timer_stop(void)
@@ -69,6 +86,16 @@ void apic_timer_set_period(time_t tv)
     apic_timer_set_frequency(freq);
 }
 
+/* Fire once after tv nanoseconds, the timer must be in one-shot mode */
+void apic_timer_set_oneshot(time_t tv)
+{
+    uint64_t count = (base_freq / divisor) * tv / 1000000000;
+
+    if (count == 0) count = 1;
+    if (count > UINT32_MAX) count = UINT32_MAX;
+    apic_write_reg(APIC_REG_TIMER_ICR, (uint32_t)count);
+}
+
 uint8_t apic_timer_get_vector(void)
 {
     return vector;
@@ -77,11 +104,125 @@ uint8_t apic_timer_get_vector(void)
 void apic_timer_set_mode(apic_timer_mode_t mode)
 {
     uint32_t val = apic_read_reg(APIC_REG_TIMER_LVT);
+    val &= ~(APIC_TIMER_FLAG_PERIODIC | APIC_TIMER_FLAG_TSC_DEADLINE);
 
     if(mode == APIC_TIMER_MODE_PERIODIC)
         apic_write_reg(APIC_REG_TIMER_LVT, val | APIC_TIMER_FLAG_PERIODIC);
+    else if (mode == APIC_TIMER_MODE_TSC_DEADLINE)
+        apic_write_reg(APIC_REG_TIMER_LVT, val | APIC_TIMER_FLAG_TSC_DEADLINE);
     else
-        apic_write_reg(APIC_REG_TIMER_LVT, val & ~(APIC_TIMER_FLAG_PERIODIC));
+        apic_write_reg(APIC_REG_TIMER_LVT, val);
+
+    /* The LVT write must be done before the deadline MSR is written */
+    asm volatile("mfence" ::: "memory");
+}
+
+bool apic_timer_has_deadline(void)
+{
+    return tsc_deadline;
+}
+
+/* Split at whole seconds, so that no product overflows 64 bits */
+static uint64_t apic_timer_nanos_to_tsc(time_t tv)
+{
+    uint64_t ns = (uint64_t)tv;
+    return ns / 1000000000 * tsc_freq
+           + ns % 1000000000 * tsc_freq / 1000000000;
+}
+
+static uint16_t apic_timer_cpu_id(void)
+{
+    cpu_t *cpu = smp_get_current_cpu(false);
+    return (cpu == NULL) ? 0 : cpu->cpu_id;
+}
+
+/* Write the earlier one of the tick deadline and the event, 0 disarms it */
+static void apic_timer_arm(uint16_t cpu_id)
+{
+    uint64_t at = timer_cpus[cpu_id].deadline;
+
+    if (timer_cpus[cpu_id].event != 0 && timer_cpus[cpu_id].event < at)
+        at = timer_cpus[cpu_id].event;
+    write_msr(MSR_TSC_DEADLINE, (at == UINT64_MAX) ? 0 : at);
+}
+
+/* Generate an IRQ every tv nanoseconds */
+void apic_timer_periodic(time_t tv)
+{
+    if (tsc_deadline) {
+        uint16_t cpu_id = apic_timer_cpu_id();
+        apic_timer_set_mode(APIC_TIMER_MODE_TSC_DEADLINE);
+        timer_cpus[cpu_id].period = apic_timer_nanos_to_tsc(tv);
+        timer_cpus[cpu_id].deadline = read_tsc() + timer_cpus[cpu_id].period;
+        apic_timer_arm(cpu_id);
+    } else {
+        apic_timer_set_mode(APIC_TIMER_MODE_PERIODIC);
+        apic_timer_set_frequency(1000000000 / tv);
+    }
+}
+
+/* Generate one IRQ after tv nanoseconds instead of periodic ones */
+void apic_timer_oneshot(time_t tv)
+{
+    if (tsc_deadline) {
+        uint16_t cpu_id = apic_timer_cpu_id();
+        apic_timer_set_mode(APIC_TIMER_MODE_TSC_DEADLINE);
+        timer_cpus[cpu_id].period = 0;
+        timer_cpus[cpu_id].deadline = read_tsc() + apic_timer_nanos_to_tsc(tv);
+        apic_timer_arm(cpu_id);
+    } else {
+        apic_timer_set_mode(APIC_TIMER_MODE_ONESHOT);
+        apic_timer_set_oneshot(tv);
+    }
+}
+
+/*
+ * Generate one more IRQ after tv nanoseconds, keeping the periodic or one-shot
+ * one. Only the earliest pending event is kept. Returns false without
+ * TSC-deadline mode, then the caller has to wait for the next tick.
+ */
+bool apic_timer_event(time_t tv)
+{
+    if (!tsc_deadline) return false;
+
+    uint16_t cpu_id = apic_timer_cpu_id();
+    uint64_t at = read_tsc() + apic_timer_nanos_to_tsc(tv);
+    if (timer_cpus[cpu_id].event == 0 || at < timer_cpus[cpu_id].event) {
+        timer_cpus[cpu_id].event = at;
+        apic_timer_arm(cpu_id);
+    }
+    return true;
+}
+
+/* Must be called in every timer IRQ, arms the next emulated periodic one */
+void apic_timer_tick(void)
+{
+    if (!tsc_deadline) return;
+
+    uint16_t cpu_id = apic_timer_cpu_id();
+    uint64_t now = read_tsc();
+    bool fired = false;
+
+    /* An event replaced the tick deadline in the MSR, so restore it */
+    if (timer_cpus[cpu_id].event != 0 && timer_cpus[cpu_id].event <= now) {
+        timer_cpus[cpu_id].event = 0;
+        fired = true;
+    }
+
+    /* Other IRQs of the same handler come before the deadline */
+    if (now >= timer_cpus[cpu_id].deadline) {
+        if (timer_cpus[cpu_id].period == 0) {
+            timer_cpus[cpu_id].deadline = UINT64_MAX;
+        } else {
+            /* Missed ticks are dropped rather than generated in a burst */
+            timer_cpus[cpu_id].deadline += timer_cpus[cpu_id].period;
+            if (timer_cpus[cpu_id].deadline <= now)
+                timer_cpus[cpu_id].deadline = now + timer_cpus[cpu_id].period;
+        }
+        fired = true;
+    }
+
+    if (fired) apic_timer_arm(cpu_id);
 }
 
 void apic_timer_enable(void)
@@ -102,6 +243,9 @@ void apic_timer_init(void)
 
     apic_write_reg(APIC_REG_TIMER_ICR, UINT32_MAX);
 
+    uint64_t tsc = read_tsc();
+    uint64_t ns = hpet_get_nanos();
+
     /* If we do not sleep enough time, the whole system will halt when
      * running in QEMU-KVM mode.
      */
@@ -109,7 +253,17 @@ void apic_timer_init(void)
 
     base_freq = ((UINT32_MAX - apic_read_reg(APIC_REG_TIMER_CCR)) * 2) * divisor;
 
+    /* TSC is calibrated in the same window for TSC-deadline mode */
+    ns = hpet_get_nanos() - ns;
+    tsc = read_tsc() - tsc;
+    tsc_freq = (ns > 0)
+               ? tsc / ns * 1000000000 + tsc % ns * 1000000000 / ns : 0;
+    tsc_deadline = cpuid_check_feature(CPUID_FEATURE_TSC_DEADLINE)
+                   && tsc_freq > 0;
+
     klogi("APIC timer base frequency: %d Hz. Divisor: 4. IRQ %d.\n",
           base_freq, vector);
+    klogi("APIC timer %s TSC-deadline mode, TSC frequency: %d kHz\n",
+          tsc_deadline ? "uses" : "does not support", tsc_freq / 1000);
 }
 
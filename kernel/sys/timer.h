@@ -13,12 +13,18 @@
   the PIT uses a standard frequency (1,193,182 Hz). To make use of it, you
   have to know how many interrupts/sec it's capable of.
 
+  Users should only need apic_timer_periodic(), apic_timer_oneshot(),
+  apic_timer_event() and apic_timer_tick(), which use TSC-deadline mode if
+  the CPU supports it and fall back to the calibrated periodic and one-shot
+  modes otherwise. Events between two ticks need TSC-deadline mode.
+
  @endverbatim
 
  **-----------------------------------------------------------------------------
  */
 #pragma once
 
+#include <stdbool.h>
 #include <stdint.h>
 #include <base/time.h>
 
@@ -27,12 +33,14 @@
 #define APIC_REG_TIMER_CCR          0x390
 #define APIC_REG_TIMER_DCR          0x3e0
 
+#define APIC_TIMER_FLAG_TSC_DEADLINE (1 << 18)
 #define APIC_TIMER_FLAG_PERIODIC    (1 << 17)
 #define APIC_TIMER_FLAG_MASKED      (1 << 16)
 
 typedef enum {
     APIC_TIMER_MODE_PERIODIC,
-    APIC_TIMER_MODE_ONESHOT
+    APIC_TIMER_MODE_ONESHOT,
+    APIC_TIMER_MODE_TSC_DEADLINE
 } apic_timer_mode_t;
 
 void apic_timer_init(void);
@@ -42,6 +50,12 @@ void apic_timer_start(void);
 void apic_timer_set_handler(void (*h)(void*));
 void apic_timer_set_frequency(uint64_t freq);
 void apic_timer_set_period(time_t tv);
+void apic_timer_set_oneshot(time_t tv);
 void apic_timer_set_mode(apic_timer_mode_t mode);
 uint8_t apic_timer_get_vector(void);
+bool apic_timer_has_deadline(void);
+void apic_timer_periodic(time_t tv);
+void apic_timer_oneshot(time_t tv);
+bool apic_timer_event(time_t tv);
+void apic_timer_tick(void);
 
@@ -3,6 +3,11 @@
 .global apic_timer_handler
 
 apic_timer_handler:
+    /* Keep gs consistent with the other kernel entries, see sys/smp.h */
+    testb $3, 8(%rsp)
+    jz 1f
+    swapgs
+1:
     push %rbp
     mov %rsp, %rbp
 
@@ -30,5 +35,9 @@ apic_timer_handler:
 
     pop %rbp
 
+    testb $3, 8(%rsp)
+    jz 2f
+    swapgs
+2:
     iretq
 
@@ -1,11 +1,13 @@
 /**-----------------------------------------------------------------------------
 
- @file    file.c
- @brief   Implementation of file test functions
+ @file    test.c
+ @brief   Implementation of kernel test functions
  @details
  @verbatim
 
   The file test functions in this file can be called in kmain() function.
+  The tests returning bool check their own invariants and are run one by one
+  by kernel_test() when ENABLE_KERNEL_TEST is defined.
 
  @endverbatim
 
@@ -13,8 +15,14 @@
  */
 #include <fs/vfs.h>
 #include <fs/fat32.h>
+#include <fs/filebase.h>
 
 #include <base/klog.h>
+#include <base/lock.h>
+#include <base/kmalloc.h>
+#include <proc/sched.h>
+#include <proc/rcu.h>
+#include <sys/hpet.h>
 
 #include <test.h>
 
@@ -98,3 +106,405 @@ void file_test(void)
     }
 }
 
+
+#define PATH_TEST_ROUNDS    1000
+
+bool path_test(void)
+{
+    char *fn = "/assets/desktop.bmp";
+    uint64_t start, open_ns, lookup_ns;
+
+    /* Every path buffer must go back to the scratch arena of this task */
+    task_t *curr = sched_get_current_task();
+    size_t scratch_top = curr->scratch.top;
+
+    start = hpet_get_nanos();
+    for (size_t i = 0; i < PATH_TEST_ROUNDS; i++) {
+        vfs_handle_t fh = vfs_open(fn, VFS_MODE_READ);
+        if (fh == VFS_INVALID_HANDLE) {
+            kloge("Open %s failed\n", fn);
+            return false;
+        }
+        vfs_close(fh);
+    }
+    open_ns = hpet_get_nanos() - start;
+
+    vfs_tnode_t *node = vfs_path_to_node(fn, NO_CREATE, 0);
+    start = hpet_get_nanos();
+    for (size_t i = 0; i < PATH_TEST_ROUNDS; i++) {
+        if (node == NULL || vfs_path_to_node(fn, NO_CREATE, 0) != node) {
+            kloge("Lookup %s failed\n", fn);
+            return false;
+        }
+    }
+    lookup_ns = hpet_get_nanos() - start;
+
+    if (vfs_path_to_node("/assets/no-such-file", NO_CREATE, 0) != NULL) {
+        kloge("Lookup of a missing file succeeded\n");
+        return false;
+    }
+    if (curr->scratch.top != scratch_top) {
+        kloge("Scratch arena top %d, expected %d\n",
+              curr->scratch.top, scratch_top);
+        return false;
+    }
+
+    kprintf("Path test with %d rounds on %s:\n", PATH_TEST_ROUNDS, fn);
+    kprintf("  open/close: %d ns per call\n", open_ns / PATH_TEST_ROUNDS);
+    kprintf("  lookup    : %d ns per call\n", lookup_ns / PATH_TEST_ROUNDS);
+    return true;
+}
+
+#define LOCK_TEST_ROUNDS    100000
+#define STAT_TEST_ROUNDS    10000
+
+#define TEST_WORKERS_MAX    CPU_MAX
+
+static volatile uint16_t test_slot = 0;
+static volatile uint16_t test_done = 0;
+static volatile uint64_t test_spent[TEST_WORKERS_MAX] = {0};
+
+static void test_worker_exit(uint16_t slot, uint64_t start)
+{
+    test_spent[slot] = hpet_get_nanos() - start;
+    __atomic_fetch_add(&test_done, 1, __ATOMIC_RELEASE);
+
+    sched_exit(0);
+    while (true)
+        asm volatile("hlt");
+}
+
+/* Start worker tasks which spread over CPUs and wait until all finish, calling
+ * poll() in the meantime if given. Returns the elapsed time in ns, or 0 if not
+ * all workers could be started.
+ */
+static uint64_t test_run_workers(
+    uint16_t num, void (*entry)(task_id_t), void (*poll)(void))
+{
+    uint16_t started = 0;
+
+    if (num > TEST_WORKERS_MAX) {
+        kloge("Too many test workers: %d\n", num);
+        return 0;
+    }
+
+    test_slot = 0;
+    test_done = 0;
+    for (uint16_t i = 0; i < TEST_WORKERS_MAX; i++) {
+        test_spent[i] = 0;
+    }
+
+    uint64_t start = hpet_get_nanos();
+    for (; started < num; started++) {
+        task_t *t = sched_new("test", entry, false);
+        if (t == NULL) break;
+        sched_add(t);
+    }
+    while (__atomic_load_n(&test_done, __ATOMIC_ACQUIRE) < started) {
+        if (poll != NULL) {
+            poll();
+        } else {
+            sched_sleep(10);
+        }
+    }
+    uint64_t total = hpet_get_nanos() - start;
+
+    if (started < num) {
+        kloge("Only %d of %d test workers started\n", started, num);
+        return 0;
+    }
+    return total;
+}
+
+static lock_t lock_test_lock = {0};
+static volatile uint64_t lock_test_counter = 0;
+
+static void lock_test_worker(task_id_t tid)
+{
+    uint16_t slot = __atomic_fetch_add(&test_slot, 1, __ATOMIC_RELAXED);
+    uint64_t start = hpet_get_nanos();
+    for (size_t i = 0; i < LOCK_TEST_ROUNDS; i++) {
+        lock_lock(&lock_test_lock);
+        lock_test_counter++;
+        lock_release(&lock_test_lock);
+    }
+
+    (void)tid;
+    test_worker_exit(slot, start);
+}
+
+static bool lock_test_run(const char *name, lock_t lock)
+{
+    uint16_t num = sched_get_cpu_num();
+
+    lock_test_lock = lock;
+    lock_test_counter = 0;
+
+    uint64_t total = test_run_workers(num, lock_test_worker, NULL);
+    if (total == 0) return false;
+
+    /* No increment may get lost and the lock must be free afterwards */
+    if (lock_test_counter != (uint64_t)LOCK_TEST_ROUNDS * num) {
+        kloge("%s: counter %d, expected %d\n", name, lock_test_counter,
+              (uint64_t)LOCK_TEST_ROUNDS * num);
+        return false;
+    }
+    if (lock_test_lock.owner != lock_test_lock.next
+        || lock_test_lock.tail != NULL || lock_test_lock.holder != NULL) {
+        kloge("%s: lock is still held after all workers exited\n", name);
+        return false;
+    }
+
+    uint64_t min = (uint64_t)-1, max = 0;
+    for (uint16_t i = 0; i < num; i++) {
+        if (test_spent[i] < min) min = test_spent[i];
+        if (test_spent[i] > max) max = test_spent[i];
+    }
+
+    kprintf("  %s: %d ns per lock, worker spread %d..%d us\n", name,
+            total / (LOCK_TEST_ROUNDS * num), min / 1000, max / 1000);
+    return true;
+}
+
+bool lock_test(void)
+{
+    bool passed = true;
+
+    kprintf("Lock test with %d rounds on %d CPUs:\n",
+            LOCK_TEST_ROUNDS, sched_get_cpu_num());
+    passed &= lock_test_run("ticket", lock_new());
+    passed &= lock_test_run("mcs   ", lock_new_mcs());
+
+    if (lock_held_count() != 0) {
+        kloge("%d locks still held by the test task\n", lock_held_count());
+        passed = false;
+    }
+    return passed;
+}
+
+static vfs_stat_t stat_test_expected;
+static volatile uint64_t stat_test_errors = 0;
+
+static void stat_test_worker(task_id_t tid)
+{
+    uint16_t slot = __atomic_fetch_add(&test_slot, 1, __ATOMIC_RELAXED);
+    uint64_t start = hpet_get_nanos();
+    uint64_t errors = 0;
+    vfs_stat_t st;
+    for (size_t i = 0; i < STAT_TEST_ROUNDS; i++) {
+        vfs_tnode_t *node = vfs_path_to_node("/assets/desktop.bmp", NO_CREATE, 0);
+        if (node == NULL) {
+            errors++;
+        } else {
+            vfs_get_stat(node, &st);
+            if (st.st_ino != stat_test_expected.st_ino
+                || st.st_size != stat_test_expected.st_size)
+                errors++;
+        }
+        if (sched_get_task_status(tid) != TASK_RUNNING)
+            errors++;
+    }
+    __atomic_fetch_add(&stat_test_errors, errors, __ATOMIC_RELAXED);
+
+    test_worker_exit(slot, start);
+}
+
+/* Lookups and task status queries are RCU readers without any lock, so the
+ * throughput should grow with the number of CPUs. Every reader must still see
+ * the node, a consistent stat copy and itself running.
+ */
+bool stat_test(void)
+{
+    uint16_t num = sched_get_cpu_num();
+
+    vfs_tnode_t *node = vfs_path_to_node("/assets/desktop.bmp", NO_CREATE, 0);
+    if (node == NULL) {
+        kloge("Lookup /assets/desktop.bmp failed\n");
+        return false;
+    }
+    vfs_get_stat(node, &stat_test_expected);
+
+    kprintf("Stat test with %d rounds:\n", STAT_TEST_ROUNDS);
+    for (uint16_t n = 1; n <= num; n *= 2) {
+        stat_test_errors = 0;
+        uint64_t total = test_run_workers(n, stat_test_worker, NULL);
+        if (total == 0) return false;
+        if (stat_test_errors != 0) {
+            kloge("%d CPUs: %d failed lookups or stats\n", n, stat_test_errors);
+            return false;
+        }
+        kprintf("  %3d CPUs: %d stats per ms\n",
+                n, (uint64_t)STAT_TEST_ROUNDS * n * 1000000 / total);
+    }
+    return true;
+}
+
+#define RCU_TEST_ROUNDS     100000
+#define RCU_TEST_MAGIC      0x52435554
+
+typedef struct {
+    uint64_t magic;
+    uint64_t version;
+} rcu_test_obj_t;
+
+static rcu_test_obj_t *rcu_test_ptr = NULL;
+static volatile uint64_t rcu_test_errors = 0;
+static uint64_t rcu_test_updates = 0;
+
+static void rcu_test_worker(task_id_t tid)
+{
+    uint16_t slot = __atomic_fetch_add(&test_slot, 1, __ATOMIC_RELAXED);
+    uint64_t start = hpet_get_nanos();
+    uint64_t errors = 0, version = 0;
+    for (size_t i = 0; i < RCU_TEST_ROUNDS; i++) {
+        rcu_read_lock();
+        rcu_test_obj_t *p = rcu_dereference(rcu_test_ptr);
+        if (p->magic != RCU_TEST_MAGIC || p->version < version)
+            errors++;
+        version = p->version;
+        rcu_read_unlock();
+    }
+    __atomic_fetch_add(&rcu_test_errors, errors, __ATOMIC_RELAXED);
+
+    (void)tid;
+    test_worker_exit(slot, start);
+}
+
+/* Publish a new object and poison the old one after a grace period */
+static void rcu_test_update(void)
+{
+    rcu_test_obj_t *old = rcu_test_ptr;
+    rcu_test_obj_t *p = (rcu_test_obj_t*)kmalloc(sizeof(rcu_test_obj_t));
+    p->magic = RCU_TEST_MAGIC;
+    p->version = old->version + 1;
+    rcu_assign_pointer(rcu_test_ptr, p);
+
+    synchronize_rcu();
+    old->magic = 0;
+    kmfree(old);
+    rcu_test_updates++;
+}
+
+/* Readers must never see an object which was poisoned after a grace period,
+ * nor an older version than the one they saw before.
+ */
+bool rcu_test(void)
+{
+    uint16_t num = sched_get_cpu_num();
+
+    rcu_test_ptr = (rcu_test_obj_t*)kmalloc(sizeof(rcu_test_obj_t));
+    rcu_test_ptr->magic = RCU_TEST_MAGIC;
+    rcu_test_ptr->version = 0;
+    rcu_test_errors = 0;
+    rcu_test_updates = 0;
+
+    uint64_t total = test_run_workers(num, rcu_test_worker, rcu_test_update);
+
+    kmfree(rcu_test_ptr);
+    rcu_test_ptr = NULL;
+
+    if (total == 0) return false;
+    if (rcu_test_errors != 0 || rcu_test_updates == 0) {
+        kloge("%d errors in %d grace periods\n",
+              rcu_test_errors, rcu_test_updates);
+        return false;
+    }
+
+    kprintf("RCU test with %d rounds on %d CPUs:\n", RCU_TEST_ROUNDS, num);
+    kprintf("  %d ns per read, %d grace periods\n",
+            total / (RCU_TEST_ROUNDS * num), rcu_test_updates);
+    return true;
+}
+
+#define SCHED_TEST_TASKS    64
+#define SCHED_TEST_ROUNDS   2000000
+
+#define SCHED_TEST_REAP_NS  1000000000
+
+static task_id_t sched_test_tids[SCHED_TEST_TASKS];
+static volatile uint16_t sched_test_cpus[SCHED_TEST_TASKS];
+
+static void sched_test_worker(task_id_t tid)
+{
+    uint16_t slot = __atomic_fetch_add(&test_slot, 1, __ATOMIC_RELAXED);
+    uint64_t start = hpet_get_nanos();
+    sched_test_tids[slot] = tid;
+    sched_test_cpus[slot] = smp_get_cpu_id();
+    for (volatile size_t i = 0; i < SCHED_TEST_ROUNDS; i++) {
+        asm volatile("pause");
+    }
+
+    test_worker_exit(slot, start);
+}
+
+/* Many more runnable tasks than CPUs, each CPU switches on its own run queue
+ * and idle CPUs steal from others. See "sched.switches" and "sched.steals"
+ * counters for the details. All tasks must run to the end, spread over more
+ * than one CPU if there is one, and be reaped afterwards.
+ */
+bool sched_test(void)
+{
+    uint16_t num = sched_get_cpu_num();
+
+    kprintf("Sched test with %d tasks on %d CPUs:\n", SCHED_TEST_TASKS, num);
+    uint64_t total = test_run_workers(SCHED_TEST_TASKS, sched_test_worker, NULL);
+    if (total == 0) return false;
+
+    uint64_t min = (uint64_t)-1, max = 0;
+    bool spread = (num == 1);
+    for (uint16_t i = 0; i < SCHED_TEST_TASKS; i++) {
+        if (test_spent[i] < min) min = test_spent[i];
+        if (test_spent[i] > max) max = test_spent[i];
+        if (sched_test_cpus[i] != sched_test_cpus[0]) spread = true;
+    }
+    if (min == 0 || !spread) {
+        kloge("Tasks %s\n", min == 0 ? "did not finish" : "ran on one CPU");
+        return false;
+    }
+
+    /* Dying and dead tasks are reported as unknown until reaped */
+    uint64_t deadline = hpet_get_nanos() + SCHED_TEST_REAP_NS;
+    for (uint16_t i = 0; i < SCHED_TEST_TASKS; i++) {
+        while (sched_get_task_status(sched_test_tids[i]) != TASK_UNKNOWN) {
+            if (hpet_get_nanos() > deadline) {
+                kloge("Task %d did not exit\n", sched_test_tids[i]);
+                return false;
+            }
+            sched_sleep(10);
+        }
+    }
+
+    kprintf("  %d tasks per s, task time %d..%d ms\n",
+            (uint64_t)SCHED_TEST_TASKS * 1000000000 / total,
+            min / 1000000, max / 1000000);
+    return true;
+}
+
+typedef struct {
+    const char *name;
+    bool (*func)(void);
+} kernel_test_t;
+
+static const kernel_test_t kernel_tests[] = {
+    {"path",  path_test},
+    {"lock",  lock_test},
+    {"stat",  stat_test},
+    {"rcu",   rcu_test},
+    {"sched", sched_test},
+};
+
+/* Run all self-checking tests and return the number of failed ones */
+size_t kernel_test(void)
+{
+    size_t failed = 0;
+    size_t num = sizeof(kernel_tests) / sizeof(kernel_tests[0]);
+
+    for (size_t i = 0; i < num; i++) {
+        bool passed = kernel_tests[i].func();
+        if (!passed) failed++;
+        kprintf("%s test %s\n", kernel_tests[i].name,
+                passed ? "\033[32mpassed\033[0m" : "\033[31mFAILED\033[0m");
+    }
+    kprintf("%d of %d kernel tests passed\n", num - failed, num);
+    return failed;
+}
@@ -6,11 +6,18 @@
  @verbatim
 
   Test functions are mainly designed for the command line interface.
+  kernel_test() runs the self-checking ones at boot if ENABLE_KERNEL_TEST is
+  defined in kconfig.h.
 
  @endverbatim
 
  **-----------------------------------------------------------------------------
  */
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+
 #include <fs/vfs.h>
 #include <fs/fat32.h>
 
@@ -18,4 +25,10 @@
 
 void file_test(void);
 void dir_test(void);
+bool path_test(void);
+bool lock_test(void);
+bool stat_test(void);
+bool rcu_test(void);
+bool sched_test(void);
 
+size_t kernel_test(void);
@@ -0,0 +1,151 @@
+/**-----------------------------------------------------------------------------
+
+ @file    malloc.c
+ @brief   Implementation of userspace heap allocation functions
+ @details
+ @verbatim
+
+  Every block starts with a 16-byte header which records its size class. Free
+  blocks of the same class are linked through their payload, so malloc() and
+  free() of small blocks do not need any syscall once the arena is warmed up.
+
+  Arenas are MALLOC_ARENA_SIZE bytes and are never returned to the kernel.
+  Blocks bigger than MALLOC_MAX_SMALL are mapped and unmapped on their own.
+
+ @endverbatim
+
+ **-----------------------------------------------------------------------------
+ */
+#include <libc/malloc.h>
+#include <libc/string.h>
+#include <libc/sysfunc.h>
+
+#define MALLOC_MAGIC_USED       0x4D4C4355
+#define MALLOC_MAGIC_FREE       0x4D4C4346
+#define MALLOC_CLASS_LARGE      0xFFFFFFFF
+#define MALLOC_PAGE_SIZE        4096
+
+typedef struct {
+    uint32_t magic;
+    uint32_t cls;           /* Size class index or MALLOC_CLASS_LARGE */
+    uint64_t size;          /* Usable bytes after the header */
+} chunk_hdr_t;
+
+typedef struct free_chunk {
+    struct free_chunk *next;
+} free_chunk_t;
+
+static free_chunk_t *free_lists[MALLOC_CLASS_NUM] = {0};
+static uint8_t *arena_ptr = NULL;
+static uint8_t *arena_end = NULL;
+
+static uint32_t size_to_class(size_t size)
+{
+    uint32_t cls = 0;
+    size_t cap = 1 << MALLOC_MIN_SHIFT;
+
+    while (cap < size) {
+        cap <<= 1;
+        cls++;
+    }
+    return cls;
+}
+
+static void *malloc_large(size_t size)
+{
+    size_t len = (size + sizeof(chunk_hdr_t) + MALLOC_PAGE_SIZE - 1)
+                 / MALLOC_PAGE_SIZE * MALLOC_PAGE_SIZE;
+    chunk_hdr_t *hdr = (chunk_hdr_t*)sys_mmap(NULL, len);
+    if (hdr == NULL) return NULL;
+
+    hdr->magic = MALLOC_MAGIC_USED;
+    hdr->cls = MALLOC_CLASS_LARGE;
+    hdr->size = len - sizeof(chunk_hdr_t);
+    return hdr + 1;
+}
+
+void *malloc(size_t size)
+{
+    if (size == 0) return NULL;
+    if (size > MALLOC_MAX_SMALL) return malloc_large(size);
+
+    uint32_t cls = size_to_class(size);
+    size_t cap = 1 << (MALLOC_MIN_SHIFT + cls);
+    chunk_hdr_t *hdr;
+
+    if (free_lists[cls] != NULL) {
+        free_chunk_t *fc = free_lists[cls];
+        free_lists[cls] = fc->next;
+        hdr = (chunk_hdr_t*)fc - 1;
+    } else {
+        size_t need = sizeof(chunk_hdr_t) + cap;
+        if (arena_ptr == NULL || arena_ptr + need > arena_end) {
+            /* The tail of the old arena is simply dropped */
+            arena_ptr = (uint8_t*)sys_mmap(NULL, MALLOC_ARENA_SIZE);
+            if (arena_ptr == NULL) return NULL;
+            arena_end = arena_ptr + MALLOC_ARENA_SIZE;
+        }
+        hdr = (chunk_hdr_t*)arena_ptr;
+        arena_ptr += need;
+        hdr->cls = cls;
+        hdr->size = cap;
+    }
+
+    hdr->magic = MALLOC_MAGIC_USED;
+    return hdr + 1;
+}
+
+void *calloc(size_t num, size_t size)
+{
+    size_t len = num * size;
+    if (size != 0 && len / size != num) return NULL;
+
+    void *ptr = malloc(len);
+    if (ptr != NULL) memset(ptr, 0, len);
+    return ptr;
+}
+
+void free(void *ptr)
+{
+    if (ptr == NULL) return;
+
+    chunk_hdr_t *hdr = (chunk_hdr_t*)ptr - 1;
+    if (hdr->magic != MALLOC_MAGIC_USED) {
+        sys_libc_log("free: invalid pointer or double free\n");
+        return;
+    }
+
+    if (hdr->cls == MALLOC_CLASS_LARGE) {
+        hdr->magic = MALLOC_MAGIC_FREE;
+        sys_munmap(hdr, hdr->size + sizeof(chunk_hdr_t));
+        return;
+    }
+
+    hdr->magic = MALLOC_MAGIC_FREE;
+    free_chunk_t *fc = (free_chunk_t*)ptr;
+    fc->next = free_lists[hdr->cls];
+    free_lists[hdr->cls] = fc;
+}
+
+void *realloc(void *ptr, size_t size)
+{
+    if (ptr == NULL) return malloc(size);
+    if (size == 0) {
+        free(ptr);
+        return NULL;
+    }
+
+    chunk_hdr_t *hdr = (chunk_hdr_t*)ptr - 1;
+    if (hdr->magic != MALLOC_MAGIC_USED) return NULL;
+
+    /* The block is already big enough */
+    if (size <= hdr->size) return ptr;
+
+    void *new = malloc(size);
+    if (new == NULL) return NULL;
+
+    memcpy(new, ptr, hdr->size);
+    free(ptr);
+    return new;
+}
+
@@ -0,0 +1,29 @@
+/**-----------------------------------------------------------------------------
+
+ @file    malloc.h
+ @brief   Definition of userspace heap allocation functions
+ @details
+ @verbatim
+
+  Small requests are served from per size class free lists which are carved
+  from arenas grown by mmap syscall, large requests are mapped directly.
+
+ @endverbatim
+
+ **-----------------------------------------------------------------------------
+ */
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define MALLOC_MIN_SHIFT        4       /* Smallest class is 16 bytes */
+#define MALLOC_CLASS_NUM        8       /* 16, 32, ..., 2048 bytes */
+#define MALLOC_MAX_SMALL        (1 << (MALLOC_MIN_SHIFT + MALLOC_CLASS_NUM - 1))
+#define MALLOC_ARENA_SIZE       (64 * 1024)
+
+void *malloc(size_t size);
+void *calloc(size_t num, size_t size);
+void *realloc(void *ptr, size_t size);
+void free(void *ptr);
+
@@ -62,6 +62,7 @@ typedef struct {
 #else
 #include <fs/vfs.h>
 typedef vfs_stat_t stat_t;
+typedef vfs_timespec_t timespec_t;
 #endif /* NO KERNEL_BUILD */
 /* ----- Definition of file system finished ----- */
 
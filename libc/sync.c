@@ -0,0 +1,107 @@
+/**-----------------------------------------------------------------------------
+
+ @file    sync.c
+ @brief   Implementation of userspace mutex and condition variable functions
+ @details
+ @verbatim
+
+  The mutex is the three-state futex mutex: unlock only issues a wake
+  syscall when the state says somebody may be sleeping.
+
+  The condition variable sleeps on a sequence number. Broadcast wakes one
+  waiter and requeues the others onto the mutex word, so they are woken one
+  by one by unlock instead of all fighting for the mutex at once. A waiter
+  always takes the mutex back in the contended state, because others may be
+  queued on it after a requeue.
+
+ @endverbatim
+
+ **-----------------------------------------------------------------------------
+ */
+#include <stddef.h>
+
+#include <libc/sync.h>
+#include <libc/errno.h>
+#include <libc/sysfunc.h>
+
+static inline int32_t cmpxchg(volatile int32_t *ptr, int32_t old, int32_t new)
+{
+    __atomic_compare_exchange_n(ptr, &old, new, false,
+                                __ATOMIC_ACQUIRE, __ATOMIC_RELAXED);
+    return old;
+}
+
+static inline int32_t xchg(volatile int32_t *ptr, int32_t val)
+{
+    return __atomic_exchange_n(ptr, val, __ATOMIC_ACQUIRE);
+}
+
+static void umutex_lock_contended(umutex_t *m)
+{
+    while (xchg(&m->state, UMUTEX_CONTENDED) != UMUTEX_UNLOCKED)
+        sys_futex_wait((int32_t*)&m->state, UMUTEX_CONTENDED, NULL);
+}
+
+void umutex_lock(umutex_t *m)
+{
+    int32_t c = cmpxchg(&m->state, UMUTEX_UNLOCKED, UMUTEX_LOCKED);
+    if (c == UMUTEX_UNLOCKED) return;
+
+    umutex_lock_contended(m);
+}
+
+bool umutex_trylock(umutex_t *m)
+{
+    return cmpxchg(&m->state, UMUTEX_UNLOCKED, UMUTEX_LOCKED) == UMUTEX_UNLOCKED;
+}
+
+void umutex_unlock(umutex_t *m)
+{
+    if (__atomic_fetch_sub(&m->state, 1, __ATOMIC_RELEASE) != UMUTEX_LOCKED) {
+        __atomic_store_n(&m->state, UMUTEX_UNLOCKED, __ATOMIC_RELEASE);
+        sys_futex_wake((int32_t*)&m->state, 1);
+    }
+}
+
+/* Returns false if it timed out, millis <= 0 means waiting forever */
+bool ucond_timedwait(ucond_t *c, umutex_t *m, int64_t millis)
+{
+    int32_t seq = __atomic_load_n(&c->seq, __ATOMIC_ACQUIRE);
+    timespec_t ts = {
+        .tv_sec  = millis / 1000,
+        .tv_nsec = (millis % 1000) * 1000000,
+    };
+
+    c->mutex = m;
+    umutex_unlock(m);
+
+    int ret = sys_futex_wait((int32_t*)&c->seq, seq,
+                             (millis > 0) ? &ts : NULL);
+
+    umutex_lock_contended(m);
+
+    return ret != -ETIMEDOUT;
+}
+
+void ucond_wait(ucond_t *c, umutex_t *m)
+{
+    ucond_timedwait(c, m, 0);
+}
+
+void ucond_signal(ucond_t *c)
+{
+    __atomic_add_fetch(&c->seq, 1, __ATOMIC_RELEASE);
+    sys_futex_wake((int32_t*)&c->seq, 1);
+}
+
+void ucond_broadcast(ucond_t *c)
+{
+    umutex_t *m = c->mutex;
+
+    __atomic_add_fetch(&c->seq, 1, __ATOMIC_RELEASE);
+    if (m == NULL) {
+        sys_futex_wake((int32_t*)&c->seq, INT32_MAX);
+        return;
+    }
+    sys_futex_requeue((int32_t*)&c->seq, 1, (int32_t*)&m->state, INT32_MAX);
+}
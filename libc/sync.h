@@ -0,0 +1,46 @@
+/**-----------------------------------------------------------------------------
+
+ @file    sync.h
+ @brief   Definition of userspace mutex and condition variable functions
+ @details
+ @verbatim
+
+  Both are built on futex syscalls and only enter the kernel when a task has
+  to sleep or to wake a sleeping one. They work across processes if placed
+  in memory mapped by sys_mmap_shared() before fork.
+
+  A zero-initialized umutex_t or ucond_t is ready to use.
+
+ @endverbatim
+
+ **-----------------------------------------------------------------------------
+ */
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#define UMUTEX_UNLOCKED     0
+#define UMUTEX_LOCKED       1       /* Locked, no waiter */
+#define UMUTEX_CONTENDED    2       /* Locked, may have waiters */
+
+typedef struct {
+    volatile int32_t state;
+} umutex_t;
+
+typedef struct {
+    volatile int32_t seq;           /* Bumped by every signal and broadcast */
+    umutex_t *mutex;                /* Mutex of the current waiters */
+} ucond_t;
+
+#define umutex_new()    (umutex_t){0}
+#define ucond_new()     (ucond_t){0}
+
+void umutex_lock(umutex_t *m);
+bool umutex_trylock(umutex_t *m);
+void umutex_unlock(umutex_t *m);
+
+void ucond_wait(ucond_t *c, umutex_t *m);
+bool ucond_timedwait(ucond_t *c, umutex_t *m, int64_t millis);
+void ucond_signal(ucond_t *c);
+void ucond_broadcast(ucond_t *c);
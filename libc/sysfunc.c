@@ -89,6 +89,14 @@
 #define SYSCALL_MEMINFO     34
 #define SYSCALL_PIPE        35
 #define SYSCALL_UNLINK      36
+#define SYSCALL_MEMPROF     37
+#define SYSCALL_FUTEX_REQUEUE 38
+#define SYSCALL_LOCKSTAT    40
+#define SYSCALL_IRQSOFF     41
+#define SYSCALL_COUNTERS    42
+#define SYSCALL_NICE        43
+#define SYSCALL_SCHED_SETAFFINITY 44
+#define SYSCALL_SCHED_GETAFFINITY 45
 
 void sys_libc_log(const char *message)
 {
@@ -96,6 +104,62 @@ void sys_libc_log(const char *message)
     SYSCALL1(SYSCALL_DEBUGLOG, message);
 }
 
+int sys_memprof(int op, int arg)
+{
+    int64_t ret;
+    int errno;
+    SYSCALL2(SYSCALL_MEMPROF, op, arg);
+    return ret;
+}
+
+int sys_lockstat(int op, int arg)
+{
+    int64_t ret;
+    int errno;
+    SYSCALL2(SYSCALL_LOCKSTAT, op, arg);
+    return ret;
+}
+
+int sys_irqsoff(int op)
+{
+    int64_t ret;
+    int errno;
+    SYSCALL1(SYSCALL_IRQSOFF, op);
+    return ret;
+}
+
+int sys_counters()
+{
+    int64_t ret;
+    int errno;
+    SYSCALL0(SYSCALL_COUNTERS);
+    return ret;
+}
+
+int sys_nice(int inc)
+{
+    int64_t ret;
+    int errno;
+    SYSCALL1(SYSCALL_NICE, inc);
+    return ret;
+}
+
+int sys_sched_setaffinity(int pid, size_t size, const uint64_t *mask)
+{
+    int64_t ret;
+    int errno;
+    SYSCALL3(SYSCALL_SCHED_SETAFFINITY, pid, size, mask);
+    return ret;
+}
+
+int sys_sched_getaffinity(int pid, size_t size, uint64_t *mask)
+{
+    int64_t ret;
+    int errno;
+    SYSCALL3(SYSCALL_SCHED_GETAFFINITY, pid, size, mask);
+    return ret;
+}
+
 int sys_fork()
 {
     int64_t ret;
@@ -221,6 +285,29 @@ void *sys_malloc(int size)
     return ret;
 }
 
+void *sys_mmap(void *hint, size_t length)
+{
+    void *ret;
+    int errno;
+    SYSCALL6(SYSCALL_MMAP, hint, length, 0, 0x08, 0, 0);
+    return ret;
+}
+
+void *sys_mmap_shared(size_t length)
+{
+    void *ret;
+    int errno;
+    SYSCALL6(SYSCALL_MMAP, 0, length, 0, 0x0A, 0, 0);
+    return ret;
+}
+
+int sys_munmap(void *addr, size_t length)
+{
+    int ret, errno;
+    SYSCALL2(SYSCALL_MUNMAP, addr, length);
+    return ret;
+}
+
 int sys_mkdirat(const char *path)
 {
     int ret, errno;
@@ -256,3 +343,28 @@ int sys_readdir(int fd, void *buffer)
     return ret;
 }
 
+int sys_futex_wait(int32_t *ptr, int32_t expected, const timespec_t *timeout)
+{
+    int64_t ret;
+    int errno;
+    SYSCALL3(SYSCALL_FUTEX_WAIT, ptr, timeout, (int64_t)expected);
+    /* Callers need to tell EAGAIN from ETIMEDOUT */
+    return (ret < 0) ? -errno : 0;
+}
+
+int sys_futex_wake(int32_t *ptr, int count)
+{
+    int64_t ret;
+    int errno;
+    SYSCALL4(SYSCALL_FUTEX_REQUEUE, ptr, (int64_t)count, (int32_t*)NULL,
+             (int64_t)0);
+    return ret;
+}
+
+int sys_futex_requeue(int32_t *ptr, int wake, int32_t *ptr2, int requeue)
+{
+    int64_t ret;
+    int errno;
+    SYSCALL4(SYSCALL_FUTEX_REQUEUE, ptr, (int64_t)wake, ptr2, (int64_t)requeue);
+    return ret;
+}
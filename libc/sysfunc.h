@@ -1,5 +1,7 @@
 #pragma once
 
+#include <stddef.h>
+
 #include <libc/stdio.h>
 
 #define AT_FDCWD            -100
@@ -31,6 +33,20 @@
 #define O_CLOEXEC           0x4000
 #define O_PATH              0x8000
 
+/* Operations of sys_memprof() */
+#define MEMPROF_REPORT      0
+#define MEMPROF_RESET       1
+#define MEMPROF_ENABLE      2
+#define MEMPROF_DISABLE     3
+
+/* Operations of sys_lockstat() */
+#define LOCKSTAT_REPORT     0
+#define LOCKSTAT_RESET      1
+
+/* Operations of sys_irqsoff() */
+#define IRQSOFF_REPORT      0
+#define IRQSOFF_RESET       1
+
 typedef struct {
     char command[256];
     char desc[256];
@@ -38,6 +54,13 @@ typedef struct {
 
 void sys_libc_log(const char *message);
 int sys_meminfo();
+int sys_memprof(int op, int arg);
+int sys_lockstat(int op, int arg);
+int sys_irqsoff(int op);
+int sys_counters();
+int sys_nice(int inc);
+int sys_sched_setaffinity(int pid, size_t size, const uint64_t *mask);
+int sys_sched_getaffinity(int pid, size_t size, uint64_t *mask);
 int sys_fork();
 int sys_openat(int dirfd, const char *path, int flags);
 int sys_getcwd(char *buffer, size_t size);
@@ -51,6 +74,9 @@ void sys_exit(int status);
 int sys_wait(int pid);
 void sys_panic(const char *message);
 void *sys_malloc(int size);
+void *sys_mmap(void *hint, size_t length);
+void *sys_mmap_shared(size_t length);
+int sys_munmap(void *addr, size_t length);
 int sys_mkdirat(const char *path);
 int sys_dup(int fd, int flags, int newfd);
 int sys_fstat(int fd, stat_t *statbuf);
@@ -58,3 +84,6 @@ int sys_stat(const char *path, stat_t *statbuf);
 int sys_readdir(int fd, void *buffer);
 int sys_pipe(int *fd);
 int sys_unlink(const char *path);
+int sys_futex_wait(int32_t *ptr, int32_t expected, const timespec_t *timeout);
+int sys_futex_wake(int32_t *ptr, int count);
+int sys_futex_requeue(int32_t *ptr, int wake, int32_t *ptr2, int requeue);
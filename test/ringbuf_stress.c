@@ -0,0 +1,189 @@
+/**-----------------------------------------------------------------------------
+
+ @file    ringbuf_stress.c
+ @brief   Host stress test of kernel/base/ringbuf.h
+ @details
+ @verbatim
+
+  Built and run on the host, not in HanOS:
+
+      gcc -O2 -pthread -I kernel test/ringbuf_stress.c -o ringbuf_stress
+      ./ringbuf_stress
+
+  MPSC: several producers push tagged sequence numbers in random batches,
+  the consumer checks that every producer's elements arrive exactly once
+  and in order. SPSC: one producer and one consumer do the same with odd
+  sized elements. A small capacity keeps the ring wrapping all the time.
+
+ @endverbatim
+
+ **-----------------------------------------------------------------------------
+ */
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <base/ringbuf.h>
+
+#define STRESS_PRODUCERS    4
+#define STRESS_ITEMS        2000000
+#define STRESS_CAPACITY     64
+#define STRESS_BATCH        8
+
+typedef struct {
+    uint32_t producer;
+    uint32_t pad;
+    uint64_t seq;
+} item_t;
+
+/* Odd size to catch wrong slot arithmetic */
+typedef struct {
+    uint8_t bytes[13];
+} odd_item_t;
+
+static ringbuf_t rb;
+static int failures = 0;
+
+static void check(int cond, const char *msg, uint64_t val)
+{
+    if (!cond) {
+        if (failures++ < 10)
+            fprintf(stderr, "FAIL: %s (%llu)\n", msg, (unsigned long long)val);
+    }
+}
+
+static void *mpsc_producer(void *arg)
+{
+    uint32_t id = (uint32_t)(uintptr_t)arg;
+    unsigned int rnd = id + 1;
+    item_t batch[STRESS_BATCH];
+    uint64_t seq = 0;
+
+    while (seq < STRESS_ITEMS) {
+        size_t n = (size_t)(rand_r(&rnd) % STRESS_BATCH) + 1;
+        if (n > STRESS_ITEMS - seq) n = (size_t)(STRESS_ITEMS - seq);
+        for (size_t i = 0; i < n; i++)
+            batch[i] = (item_t){.producer = id, .seq = seq + i};
+
+        size_t done = 0;
+        while (done < n) {
+            size_t k = ringbuf_push(&rb, &batch[done], n - done);
+            if (k == 0) sched_yield();
+            done += k;
+        }
+        seq += n;
+    }
+    return NULL;
+}
+
+static void mpsc_test(void)
+{
+    size_t size = ringbuf_mem_size(RINGBUF_MPSC, STRESS_CAPACITY, sizeof(item_t));
+    void *mem = malloc(size);
+    pthread_t th[STRESS_PRODUCERS];
+    uint64_t next[STRESS_PRODUCERS] = {0};
+    item_t batch[STRESS_BATCH];
+
+    check(ringbuf_init(&rb, RINGBUF_MPSC, mem, STRESS_CAPACITY, sizeof(item_t)),
+          "mpsc init", 0);
+    for (uintptr_t i = 0; i < STRESS_PRODUCERS; i++)
+        pthread_create(&th[i], NULL, mpsc_producer, (void*)i);
+
+    uint64_t total = 0;
+    while (total < (uint64_t)STRESS_PRODUCERS * STRESS_ITEMS) {
+        size_t n = ringbuf_pop(&rb, batch, STRESS_BATCH);
+        if (n == 0) sched_yield();
+        for (size_t i = 0; i < n; i++) {
+            uint32_t p = batch[i].producer;
+            check(p < STRESS_PRODUCERS, "mpsc producer id", p);
+            if (p >= STRESS_PRODUCERS) continue;
+            check(batch[i].seq == next[p], "mpsc order", batch[i].seq);
+            next[p] = batch[i].seq + 1;
+        }
+        total += n;
+    }
+
+    for (size_t i = 0; i < STRESS_PRODUCERS; i++)
+        pthread_join(th[i], NULL);
+    check(ringbuf_count(&rb) == 0, "mpsc empty", ringbuf_count(&rb));
+    check(ringbuf_pop(&rb, batch, 1) == 0, "mpsc pop empty", 0);
+    free(mem);
+
+    printf("MPSC: %d producers, %llu items\n", STRESS_PRODUCERS,
+           (unsigned long long)total);
+}
+
+static void *spsc_producer(void *arg)
+{
+    (void)arg;
+    unsigned int rnd = 42;
+    odd_item_t batch[STRESS_BATCH];
+    uint64_t seq = 0;
+
+    while (seq < STRESS_ITEMS) {
+        size_t n = (size_t)(rand_r(&rnd) % STRESS_BATCH) + 1;
+        if (n > STRESS_ITEMS - seq) n = (size_t)(STRESS_ITEMS - seq);
+        for (size_t i = 0; i < n; i++) {
+            uint64_t v = seq + i;
+            memset(batch[i].bytes, (int)(v & 0xff), sizeof(batch[i].bytes));
+            memcpy(batch[i].bytes, &v, sizeof(v));
+        }
+
+        size_t done = 0;
+        while (done < n) {
+            size_t k = ringbuf_push(&rb, &batch[done], n - done);
+            if (k == 0) sched_yield();
+            done += k;
+        }
+        seq += n;
+    }
+    return NULL;
+}
+
+static void spsc_test(void)
+{
+    size_t size = ringbuf_mem_size(RINGBUF_SPSC, STRESS_CAPACITY, sizeof(odd_item_t));
+    void *mem = malloc(size);
+    odd_item_t batch[STRESS_BATCH];
+    pthread_t th;
+
+    check(!ringbuf_init(&rb, RINGBUF_SPSC, mem, 48, sizeof(odd_item_t)),
+          "capacity must be power of two", 48);
+    check(ringbuf_init(&rb, RINGBUF_SPSC, mem, STRESS_CAPACITY, sizeof(odd_item_t)),
+          "spsc init", 0);
+    pthread_create(&th, NULL, spsc_producer, NULL);
+
+    uint64_t total = 0;
+    while (total < STRESS_ITEMS) {
+        size_t n = ringbuf_pop(&rb, batch, STRESS_BATCH);
+        if (n == 0) sched_yield();
+        for (size_t i = 0; i < n; i++) {
+            uint64_t v;
+            memcpy(&v, batch[i].bytes, sizeof(v));
+            check(v == total + i, "spsc order", v);
+            check(batch[i].bytes[12] == (uint8_t)(v & 0xff), "spsc data", v);
+        }
+        total += n;
+    }
+
+    pthread_join(th, NULL);
+    check(ringbuf_count(&rb) == 0, "spsc empty", ringbuf_count(&rb));
+    free(mem);
+
+    printf("SPSC: %llu items\n", (unsigned long long)total);
+}
+
+int main(void)
+{
+    mpsc_test();
+    spsc_test();
+
+    if (failures > 0) {
+        printf("ringbuf stress test FAILED with %d errors\n", failures);
+        return 1;
+    }
+    printf("ringbuf stress test passed\n");
+    return 0;
+}
@@ -0,0 +1,22 @@
+#include <stddef.h>
+#include <stdint.h>
+
+#include <libc/stdio.h>
+#include <libc/sysfunc.h>
+
+static command_help_t help_msg[] = {
+    {"<help> counters",  "Kernel per-CPU counters: total and value of each CPU."},
+};
+
+int main(int argc, char *argv[])
+{
+    (void)argc;
+    (void)argv;
+
+    if (sys_counters() < 0) {
+        fprintf(STDERR, "counters: failed to dump kernel counters\n");
+        sys_exit(1);
+    }
+
+    sys_exit(0);
+}
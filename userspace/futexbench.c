@@ -0,0 +1,103 @@
+#include <stddef.h>
+#include <stdint.h>
+
+#include <libc/stdio.h>
+#include <libc/string.h>
+#include <libc/sync.h>
+#include <libc/sysfunc.h>
+
+static command_help_t help_msg[] = {
+    {"<help> futexbench [N]",  "Contended futex mutex vs spinlock in N processes."},
+};
+
+#define BENCH_ROUNDS    20000
+#define BENCH_PROCS     4
+#define BENCH_MAX_PROCS 16
+
+/* Placed in a MAP_SHARED block, so forked children share it */
+typedef struct {
+    umutex_t mutex;
+    volatile int32_t spin;
+    volatile int64_t counter;
+    volatile int32_t ready;
+} bench_shared_t;
+
+static inline uint64_t rdtsc(void)
+{
+    uint32_t lo, hi;
+    asm volatile("rdtsc" : "=a"(lo), "=d"(hi));
+    return ((uint64_t)hi << 32) | lo;
+}
+
+static void spin_lock(volatile int32_t *s)
+{
+    while (__atomic_exchange_n(s, 1, __ATOMIC_ACQUIRE) != 0) {
+        while (__atomic_load_n(s, __ATOMIC_RELAXED) != 0)
+            asm volatile("pause");
+    }
+}
+
+static void spin_unlock(volatile int32_t *s)
+{
+    __atomic_store_n(s, 0, __ATOMIC_RELEASE);
+}
+
+static void worker(bench_shared_t *sh, bool use_futex)
+{
+    /* Start together to make the lock really contended */
+    __atomic_sub_fetch(&sh->ready, 1, __ATOMIC_ACQ_REL);
+    while (__atomic_load_n(&sh->ready, __ATOMIC_ACQUIRE) > 0)
+        asm volatile("pause");
+
+    for (int i = 0; i < BENCH_ROUNDS; i++) {
+        if (use_futex) {
+            umutex_lock(&sh->mutex);
+            sh->counter++;
+            umutex_unlock(&sh->mutex);
+        } else {
+            spin_lock(&sh->spin);
+            sh->counter++;
+            spin_unlock(&sh->spin);
+        }
+    }
+}
+
+static void run(const char *name, bench_shared_t *sh, int procs, bool use_futex)
+{
+    sh->counter = 0;
+    sh->ready = procs;
+
+    uint64_t start = rdtsc();
+    for (int i = 0; i < procs; i++) {
+        if (sys_fork() == 0) {
+            worker(sh, use_futex);
+            sys_exit(0);
+        }
+    }
+    for (int i = 0; i < procs; i++) sys_wait(-1);
+    uint64_t cycles = rdtsc() - start;
+
+    int64_t ops = (int64_t)procs * BENCH_ROUNDS;
+    printf("  %s: %d ops, %d cycles/op, counter %s\n", name, (int)ops,
+           (int)(cycles / ops), (sh->counter == ops) ? "ok" : "WRONG");
+}
+
+int main(int argc, char *argv[])
+{
+    int procs = (argc > 1) ? (int)strtol(argv[1], DEC) : BENCH_PROCS;
+    if (procs < 1 || procs > BENCH_MAX_PROCS) procs = BENCH_PROCS;
+
+    bench_shared_t *sh = (bench_shared_t*)sys_mmap_shared(sizeof(bench_shared_t));
+    if (sh == NULL) {
+        printf("futexbench: shared mapping failed\n");
+        sys_exit(1);
+    }
+
+    printf("futexbench: %d processes, %d rounds each\n", procs, BENCH_ROUNDS);
+
+    run("umutex  ", sh, procs, true);
+    run("spinlock", sh, procs, false);
+
+    sys_exit(0);
+}
+
@@ -2,6 +2,7 @@
 #include <stdint.h>
 
 #include <libc/stdio.h>
+#include <libc/malloc.h>
 #include <libc/string.h>
 #include <libc/sysfunc.h>
 
@@ -168,7 +169,7 @@ int getcmd(char *buf, int nbuf)
 
 void main(void)
 {
-    char *buf = (char*)sys_malloc(CMD_MAX_LEN);
+    char *buf = (char*)malloc(CMD_MAX_LEN);
     int fd;
 
     /* TODO: Ensure that three file descriptors are open. */
@@ -222,7 +223,7 @@ struct cmd* execcmd(void)
 {
     struct execcmd *cmd;
 
-    cmd = sys_malloc(sizeof(*cmd));
+    cmd = malloc(sizeof(*cmd));
     memset(cmd, 0, sizeof(*cmd));
     cmd->type = EXEC;
     return (struct cmd*)cmd;
@@ -233,7 +234,7 @@ struct cmd *redircmd(
 {
     struct redircmd *cmd;
 
-    cmd = sys_malloc(sizeof(*cmd));
+    cmd = malloc(sizeof(*cmd));
     memset(cmd, 0, sizeof(*cmd));
     cmd->type = REDIR;
     cmd->cmd = subcmd;
@@ -248,7 +249,7 @@ struct cmd *pipecmd(struct cmd *left, struct cmd *right)
 {
     struct pipecmd *cmd;
 
-    cmd = sys_malloc(sizeof(*cmd));
+    cmd = malloc(sizeof(*cmd));
     memset(cmd, 0, sizeof(*cmd));
     cmd->type = PIPE;
     cmd->left = left;
@@ -260,7 +261,7 @@ struct cmd *listcmd(struct cmd *left, struct cmd *right)
 {
     struct listcmd *cmd;
 
-    cmd = sys_malloc(sizeof(*cmd));
+    cmd = malloc(sizeof(*cmd));
     memset(cmd, 0, sizeof(*cmd));
     cmd->type = LIST;
     cmd->left = left;
@@ -272,7 +273,7 @@ struct cmd *backcmd(struct cmd *subcmd)
 {
     struct backcmd *cmd;
 
-    cmd = sys_malloc(sizeof(*cmd));
+    cmd = malloc(sizeof(*cmd));
     memset(cmd, 0, sizeof(*cmd));
     cmd->type = BACK;
     cmd->cmd = subcmd;
@@ -0,0 +1,32 @@
+#include <stddef.h>
+#include <stdint.h>
+
+#include <libc/stdio.h>
+#include <libc/string.h>
+#include <libc/sysfunc.h>
+
+static command_help_t help_msg[] = {
+    {"<help> irqsoff",  "Longest interrupts-off window per CPU: show or reset."},
+};
+
+int main(int argc, char *argv[])
+{
+    int ret = -1;
+
+    if (argc < 2 || strcmp(argv[1], "show") == 0) {
+        ret = sys_irqsoff(IRQSOFF_REPORT);
+    } else if (strcmp(argv[1], "reset") == 0) {
+        ret = sys_irqsoff(IRQSOFF_RESET);
+    } else {
+        fprintf(STDERR, "Usage: irqsoff [show|reset]\n");
+        sys_exit(1);
+    }
+
+    if (ret < 0) {
+        fprintf(STDERR, "irqsoff: %s failed, is ENABLE_IRQSOFF_TRACE set?\n",
+                argc < 2 ? "show" : argv[1]);
+        sys_exit(1);
+    }
+
+    sys_exit(0);
+}
@@ -0,0 +1,33 @@
+#include <stddef.h>
+#include <stdint.h>
+
+#include <libc/stdio.h>
+#include <libc/string.h>
+#include <libc/sysfunc.h>
+
+static command_help_t help_msg[] = {
+    {"<help> lockstat",  "Kernel lock contention profile: reset or top [N]."},
+};
+
+int main(int argc, char *argv[])
+{
+    int ret = -1;
+
+    if (argc < 2 || strcmp(argv[1], "top") == 0) {
+        int num = (argc > 2) ? (int)strtol(argv[2], DEC) : 10;
+        ret = sys_lockstat(LOCKSTAT_REPORT, num);
+    } else if (strcmp(argv[1], "reset") == 0) {
+        ret = sys_lockstat(LOCKSTAT_RESET, 0);
+    } else {
+        fprintf(STDERR, "Usage: lockstat [reset|top [N]]\n");
+        sys_exit(1);
+    }
+
+    if (ret < 0) {
+        fprintf(STDERR, "lockstat: %s failed, is ENABLE_LOCK_STAT set?\n",
+                argc < 2 ? "top" : argv[1]);
+        sys_exit(1);
+    }
+
+    sys_exit(0);
+}
@@ -0,0 +1,80 @@
+#include <stddef.h>
+#include <stdint.h>
+
+#include <libc/stdio.h>
+#include <libc/malloc.h>
+#include <libc/string.h>
+#include <libc/sysfunc.h>
+
+static command_help_t help_msg[] = {
+    {"<help> mallocbench",  "Compare malloc() with per-call mmap (sys_malloc)."},
+};
+
+#define BENCH_ROUNDS    256
+#define BENCH_SLOTS     32
+
+static void *slots[BENCH_SLOTS] = {0};
+
+static inline uint64_t rdtsc(void)
+{
+    uint32_t lo, hi;
+    asm volatile("rdtsc" : "=a"(lo), "=d"(hi));
+    return ((uint64_t)hi << 32) | lo;
+}
+
+static void report(const char *name, uint64_t cycles, int ops)
+{
+    printf("  %s: %d ops, %d cycles/op\n", name, ops, (int)(cycles / ops));
+}
+
+int main(int argc, char *argv[])
+{
+    (void)argc;
+    (void)argv;
+
+    uint64_t start;
+    int i;
+
+    printf("mallocbench: %d rounds\n", BENCH_ROUNDS);
+
+    /* Old path: every allocation is a syscall and can not be freed */
+    start = rdtsc();
+    for (i = 0; i < BENCH_ROUNDS; i++) {
+        char *p = (char*)sys_malloc(64);
+        p[0] = (char)i;
+    }
+    report("sys_malloc(64)       ", rdtsc() - start, BENCH_ROUNDS);
+
+    /* Same size malloc/free pairs reuse one block from the free list */
+    start = rdtsc();
+    for (i = 0; i < BENCH_ROUNDS; i++) {
+        char *p = (char*)malloc(64);
+        p[0] = (char)i;
+        free(p);
+    }
+    report("malloc/free(64)      ", rdtsc() - start, BENCH_ROUNDS);
+
+    /* Mixed sizes with a working set of live blocks */
+    start = rdtsc();
+    for (i = 0; i < BENCH_ROUNDS * 4; i++) {
+        int k = i % BENCH_SLOTS;
+        free(slots[k]);
+        slots[k] = malloc(16 << (i % 8));
+    }
+    report("malloc/free(16..2048)", rdtsc() - start, BENCH_ROUNDS * 4);
+
+    /* Growing a buffer */
+    start = rdtsc();
+    char *buf = NULL;
+    for (i = 1; i <= BENCH_ROUNDS; i++) {
+        buf = (char*)realloc(buf, i * 8);
+        buf[i * 8 - 1] = 0;
+    }
+    free(buf);
+    report("realloc(8..2048)     ", rdtsc() - start, BENCH_ROUNDS);
+
+    for (i = 0; i < BENCH_SLOTS; i++) free(slots[i]);
+
+    sys_exit(0);
+}
+
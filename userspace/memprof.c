@@ -0,0 +1,37 @@
+#include <stddef.h>
+#include <stdint.h>
+
+#include <libc/stdio.h>
+#include <libc/string.h>
+#include <libc/sysfunc.h>
+
+static command_help_t help_msg[] = {
+    {"<help> memprof",  "Kernel allocation profile: on, off, reset or top [N]."},
+};
+
+int main(int argc, char *argv[])
+{
+    int ret = -1;
+
+    if (argc < 2 || strcmp(argv[1], "top") == 0) {
+        int num = (argc > 2) ? (int)strtol(argv[2], DEC) : 10;
+        ret = sys_memprof(MEMPROF_REPORT, num);
+    } else if (strcmp(argv[1], "reset") == 0) {
+        ret = sys_memprof(MEMPROF_RESET, 0);
+    } else if (strcmp(argv[1], "on") == 0) {
+        ret = sys_memprof(MEMPROF_ENABLE, 0);
+    } else if (strcmp(argv[1], "off") == 0) {
+        ret = sys_memprof(MEMPROF_DISABLE, 0);
+    } else {
+        fprintf(STDERR, "Usage: memprof [on|off|reset|top [N]]\n");
+        sys_exit(1);
+    }
+
+    if (ret < 0) {
+        fprintf(STDERR, "memprof: %s failed\n", argc < 2 ? "top" : argv[1]);
+        sys_exit(1);
+    }
+
+    sys_exit(0);
+}
+
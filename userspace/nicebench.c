@@ -0,0 +1,114 @@
+#include <stddef.h>
+#include <stdint.h>
+
+#include <libc/stdio.h>
+#include <libc/string.h>
+#include <libc/sysfunc.h>
+
+static command_help_t help_msg[] = {
+    {"<help> nicebench [N]",  "Check CPU share of N hogs at nice -5, 0 and 5 on CPU 0."},
+};
+
+#define BENCH_SECONDS   3
+#define BENCH_HOGS      2
+#define BENCH_MAX_HOGS  8
+#define BENCH_LEVELS    3
+
+/* A level passes if its share is within this percentage of its weight share */
+#define BENCH_TOLERANCE 20
+
+/* Nice values and their scheduler weights */
+static const int bench_nice[BENCH_LEVELS] = {-5, 0, 5};
+static const int bench_weight[BENCH_LEVELS] = {3121, 1024, 335};
+
+/* Placed in a MAP_SHARED block, so forked children share it */
+typedef struct {
+    volatile int64_t loops[BENCH_LEVELS * BENCH_MAX_HOGS];
+    volatile int32_t start;
+    volatile int32_t stop;
+    volatile int32_t ready;
+    volatile int32_t failed;
+    int32_t timer;
+} bench_shared_t;
+
+/* All hogs share CPU 0, so their loops follow the weights */
+static void hog(bench_shared_t *sh, int level, int slot)
+{
+    uint64_t mask = 1;
+    if (sys_sched_setaffinity(0, sizeof(mask), &mask) < 0)
+        __atomic_store_n(&sh->failed, 1, __ATOMIC_RELEASE);
+    sys_nice(bench_nice[level]);
+    __atomic_add_fetch(&sh->ready, 1, __ATOMIC_ACQ_REL);
+
+    while (__atomic_load_n(&sh->start, __ATOMIC_ACQUIRE) == 0)
+        ;
+    while (__atomic_load_n(&sh->stop, __ATOMIC_ACQUIRE) == 0)
+        sh->loops[slot]++;
+}
+
+int main(int argc, char *argv[])
+{
+    int hogs = (argc > 1) ? (int)strtol(argv[1], DEC) : BENCH_HOGS;
+    if (hogs < 1 || hogs > BENCH_MAX_HOGS) hogs = BENCH_HOGS;
+
+    bench_shared_t *sh = (bench_shared_t*)sys_mmap_shared(sizeof(bench_shared_t));
+    if (sh == NULL) {
+        printf("nicebench: shared mapping failed\n");
+        sys_exit(1);
+    }
+    memset((void*)sh, 0, sizeof(bench_shared_t));
+
+    printf("nicebench: %d hogs per nice level on CPU 0 for %d seconds\n",
+           hogs, BENCH_SECONDS);
+
+    for (int level = 0; level < BENCH_LEVELS; level++) {
+        for (int i = 0; i < hogs; i++) {
+            if (sys_fork() == 0) {
+                hog(sh, level, level * hogs + i);
+                sys_exit(0);
+            }
+        }
+    }
+
+    /* Sleep on a word which nobody changes until all hogs are pinned */
+    timespec_t poll = {.tv_sec = 0, .tv_nsec = 10000000};
+    while (__atomic_load_n(&sh->ready, __ATOMIC_ACQUIRE) < BENCH_LEVELS * hogs)
+        sys_futex_wait(&sh->timer, 0, &poll);
+    __atomic_store_n(&sh->start, 1, __ATOMIC_RELEASE);
+
+    timespec_t ts = {.tv_sec = BENCH_SECONDS, .tv_nsec = 0};
+    sys_futex_wait(&sh->timer, 0, &ts);
+    __atomic_store_n(&sh->stop, 1, __ATOMIC_RELEASE);
+    for (int i = 0; i < BENCH_LEVELS * hogs; i++) sys_wait(-1);
+
+    int64_t total = 0, weights = 0, sum[BENCH_LEVELS] = {0};
+    for (int level = 0; level < BENCH_LEVELS; level++) {
+        for (int i = 0; i < hogs; i++) sum[level] += sh->loops[level * hogs + i];
+        total += sum[level];
+        weights += bench_weight[level];
+    }
+    if (total == 0) total = 1;
+
+    if (sh->failed) {
+        printf("nicebench: FAIL, hogs could not be pinned to CPU 0\n");
+        sys_exit(1);
+    }
+
+    /* Hogs sharing one CPU get shares close to their weights, in 0.1% */
+    bool passed = true;
+    for (int level = 0; level < BENCH_LEVELS; level++) {
+        int64_t got = sum[level] * 1000 / total;
+        int64_t want = bench_weight[level] * 1000 / weights;
+        int64_t diff = (got > want) ? got - want : want - got;
+        bool ok = diff * 100 <= want * BENCH_TOLERANCE;
+        passed = passed && ok;
+        printf("  nice %d: %d.%d%% of loops, %d.%d%% by weight %s\n",
+               bench_nice[level], (int)(got / 10), (int)(got % 10),
+               (int)(want / 10), (int)(want % 10), ok ? "ok" : "off");
+    }
+
+    printf("nicebench: %s, shares %s within %d%% of the weights\n",
+           passed ? "PASS" : "FAIL", passed ? "are" : "are not",
+           BENCH_TOLERANCE);
+    sys_exit(passed ? 0 : 1);
+}
@@ -0,0 +1,54 @@
+#include <stddef.h>
+#include <stdint.h>
+
+#include <libc/stdio.h>
+#include <libc/string.h>
+#include <libc/sysfunc.h>
+
+static command_help_t help_msg[] = {
+    {"<help> taskset <pid> [cpu ...]",  "Show or set the CPUs which task pid may run on."},
+};
+
+/* Enough for CPU_MAX of the kernel */
+#define TASKSET_WORDS   4
+
+int main(int argc, char *argv[])
+{
+    uint64_t mask[TASKSET_WORDS] = {0};
+
+    if (argc < 2) {
+        fprintf(STDERR, "Usage: taskset <pid> [cpu ...]\n");
+        sys_exit(1);
+    }
+
+    int pid = (int)strtol(argv[1], DEC);
+
+    if (argc > 2) {
+        for (int i = 2; i < argc; i++) {
+            int cpu = (int)strtol(argv[i], DEC);
+            if (cpu < 0 || cpu >= TASKSET_WORDS * 64) {
+                fprintf(STDERR, "taskset: invalid CPU %s\n", argv[i]);
+                sys_exit(1);
+            }
+            mask[cpu / 64] |= (uint64_t)1 << (cpu % 64);
+        }
+        if (sys_sched_setaffinity(pid, sizeof(mask), mask) < 0) {
+            fprintf(STDERR, "taskset: failed to set affinity of pid %d\n", pid);
+            sys_exit(1);
+        }
+    }
+
+    int len = sys_sched_getaffinity(pid, sizeof(mask), mask);
+    if (len < 0) {
+        fprintf(STDERR, "taskset: failed to get affinity of pid %d\n", pid);
+        sys_exit(1);
+    }
+
+    printf("pid %d's CPUs:", pid);
+    for (int cpu = 0; cpu < len * 8; cpu++) {
+        if ((mask[cpu / 64] >> (cpu % 64)) & 1) printf(" %d", cpu);
+    }
+    printf("\n");
+
+    sys_exit(0);
+}